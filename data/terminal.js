@@ -0,0 +1,63 @@
+// Serial output arrives as binary WebSocket frames, keys are sent as typed
+const terminal = document.getElementById('terminal');
+const decoder = new TextDecoder();
+const encoder = new TextEncoder();
+const SCROLLBACK_MAX = 200000;
+
+const KEYS = {
+    Enter: '\r',
+    Backspace: '\x7f',
+    Tab: '\t',
+    Escape: '\x1b',
+    ArrowUp: '\x1b[A',
+    ArrowDown: '\x1b[B',
+    ArrowRight: '\x1b[C',
+    ArrowLeft: '\x1b[D',
+};
+
+const ws = new WebSocket('ws://' + location.host + '/ws');
+ws.binaryType = 'arraybuffer';
+
+ws.onmessage = (event) => {
+    // Escape sequences are dropped, this is not a terminal emulator
+    const text = decoder.decode(event.data, { stream: true })
+        .replace(/\x1b\[[0-9;?]*[A-Za-z]/g, '')
+        .replace(/\r/g, '');
+    for (const part of text.split(/(\x08)/)) {
+        if (part === '\x08') {
+            terminal.textContent = terminal.textContent.slice(0, -1);
+        } else {
+            terminal.append(part);
+        }
+    }
+    if (terminal.textContent.length > SCROLLBACK_MAX) {
+        terminal.textContent = terminal.textContent.slice(-SCROLLBACK_MAX / 2);
+    }
+    terminal.scrollTop = terminal.scrollHeight;
+};
+
+ws.onclose = () => terminal.append('\n[disconnected]\n');
+
+function send(text) {
+    if (ws.readyState === WebSocket.OPEN) {
+        ws.send(encoder.encode(text));
+    }
+}
+
+terminal.onkeydown = (event) => {
+    let text = KEYS[event.key];
+    if (!text && event.key.length === 1 && !event.metaKey) {
+        text = event.ctrlKey ? String.fromCharCode(event.key.toUpperCase().charCodeAt(0) & 31) : event.key;
+    }
+    if (text) {
+        send(text);
+        event.preventDefault();
+    }
+};
+
+terminal.onpaste = (event) => {
+    send(event.clipboardData.getData('text'));
+    event.preventDefault();
+};
+
+terminal.focus();
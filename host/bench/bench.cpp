@@ -0,0 +1,497 @@
+/**
+ * End-to-end benchmark of the UART <-> telnet bridge on the host.
+ *
+ * The bridge main loop (app_main) runs in a child process with a pty
+ * standing in for the UART and the telnet server listening on loopback.
+ * Patterned data is pushed through each direction and the receiving side
+ * reports throughput, per-chunk latency percentiles and bytes lost.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+extern "C" {
+    void app_main(void);
+}
+
+
+using Clock = std::chrono::steady_clock;
+
+static constexpr uint8_t TELNET_IAC  { 0xff };
+static constexpr uint8_t TELNET_SB   { 0xfa };
+static constexpr uint8_t TELNET_SE   { 0xf0 };
+static constexpr uint8_t TELNET_WILL { 0xfb };
+static constexpr uint8_t TELNET_DONT { 0xfe };
+
+static constexpr size_t  BULK_CHUNK        { 1024 };
+static constexpr size_t  KEY_CHUNK_MAX     { 8 };
+static constexpr auto    KEY_INTERVAL      { std::chrono::milliseconds(2) };
+static constexpr int     IDLE_TIMEOUT_MS   { 1000 };
+static constexpr int     DRAIN_QUIET_MS    { 200 };
+static constexpr int     CONNECT_TIMEOUT_S { 5 };
+
+
+enum class Direction {
+    UART_TO_TCP,
+    TCP_TO_UART,
+};
+
+
+struct Pattern {
+    const char *name;
+    bool keystrokes;
+    void (*generate)(std::vector<uint8_t> &data, uint32_t seed);
+};
+
+
+struct Chunk {
+    size_t end;
+    Clock::time_point sent;
+};
+
+
+struct Result {
+    size_t sent { 0 };
+    size_t received { 0 };
+    ssize_t first_error { -1 };
+    double seconds { 0.0 };
+    std::vector<double> latency_us;
+};
+
+
+static uint32_t xorshift(uint32_t &state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+
+static void generate_ascii(std::vector<uint8_t> &data, uint32_t seed)
+{
+    static constexpr const char TEXT[] { "The quick brown fox jumps over the lazy dog 0123456789" };
+    char line[96];
+    size_t pos = 0;
+    for (uint32_t n = seed; pos<data.size(); n++) {
+        int len = snprintf(line, sizeof(line), "%08x %s\r\n", n, TEXT);
+        for (int i=0; i<len && pos<data.size(); i++) {
+            data[pos++] = line[i];
+        }
+    }
+}
+
+
+static void generate_binary(std::vector<uint8_t> &data, uint32_t seed)
+{
+    // A quarter 0xFF, a quarter 0x00, the rest uniformly random
+    uint32_t state = seed | 1;
+    for (auto &b : data) {
+        auto r = xorshift(state);
+        switch (r & 0x03) {
+            case 0: b = 0xff; break;
+            case 1: b = 0x00; break;
+            default: b = r >> 24; break;
+        }
+    }
+}
+
+
+static const Pattern PATTERNS[] {
+    { "ascii",  false, generate_ascii },
+    { "binary", false, generate_binary },
+    { "keys",   true,  generate_ascii },
+};
+
+
+
+static void die(const char *what)
+{
+    fprintf(stderr, "bench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+
+static bool write_all(int fd, const uint8_t *buf, size_t count)
+{
+    while (count) {
+        auto res = ::write(fd, buf, count);
+        if (res<0) {
+            if (errno==EINTR) continue;
+            if (errno==EAGAIN) {
+                struct pollfd pfd { fd, POLLOUT, 0 };
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            return false;
+        }
+        buf += res;
+        count -= res;
+    }
+    return true;
+}
+
+
+static size_t telnet_escape(const uint8_t *buf, size_t count, std::vector<uint8_t> &out)
+{
+    out.clear();
+    for (size_t i=0; i<count; i++) {
+        out.push_back(buf[i]);
+        if (buf[i]==TELNET_IAC) {
+            out.push_back(TELNET_IAC);
+        }
+    }
+    return out.size();
+}
+
+
+
+/**
+ * Minimal client side telnet decoder: drops option negotiation and
+ * subnegotiations, and collapses escaped IAC bytes.
+ */
+class TelnetDecoder {
+    public:
+        size_t decode(const uint8_t *buf, size_t count, uint8_t *out)
+        {
+            size_t olen = 0;
+            for (size_t i=0; i<count; i++) {
+                uint8_t ch = buf[i];
+                switch (m_state) {
+                    case State::DATA:
+                        if (ch==TELNET_IAC) m_state = State::IAC;
+                        else out[olen++] = ch;
+                        break;
+                    case State::IAC:
+                        if (ch==TELNET_IAC) { out[olen++] = ch; m_state = State::DATA; }
+                        else if (ch==TELNET_SB) m_state = State::SB;
+                        else if (ch>=TELNET_WILL && ch<=TELNET_DONT) m_state = State::OPTION;
+                        else m_state = State::DATA;
+                        break;
+                    case State::OPTION:
+                        m_state = State::DATA;
+                        break;
+                    case State::SB:
+                        if (ch==TELNET_IAC) m_state = State::SB_IAC;
+                        break;
+                    case State::SB_IAC:
+                        m_state = (ch==TELNET_SE) ? State::DATA : State::SB;
+                        break;
+                }
+            }
+            return olen;
+        }
+
+    private:
+        enum class State { DATA, IAC, OPTION, SB, SB_IAC };
+        State m_state { State::DATA };
+};
+
+
+
+static void run_writer(int fd, bool telnet, const Pattern &pattern, const std::vector<uint8_t> &data, std::vector<Chunk> &chunks, std::atomic<size_t> &published)
+{
+    std::vector<uint8_t> escaped;
+    uint32_t state = 0x2545f491;
+    size_t pos = 0;
+
+    while (pos<data.size()) {
+        size_t len = pattern.keystrokes ? 1 + xorshift(state) % KEY_CHUNK_MAX : BULK_CHUNK;
+        len = std::min(len, data.size()-pos);
+
+        // Published before writing, the reader may see the data before write() returns
+        auto start = Clock::now();
+        chunks[published.load(std::memory_order_relaxed)] = { pos+len, start };
+        published.fetch_add(1, std::memory_order_release);
+
+        bool ok;
+        if (telnet) {
+            telnet_escape(&data[pos], len, escaped);
+            ok = write_all(fd, escaped.data(), escaped.size());
+        }
+        else {
+            ok = write_all(fd, &data[pos], len);
+        }
+        if (!ok) {
+            fprintf(stderr, "bench: write failed: %s\n", strerror(errno));
+            break;
+        }
+        pos += len;
+
+        if (pattern.keystrokes) {
+            std::this_thread::sleep_until(start + KEY_INTERVAL);
+        }
+    }
+}
+
+
+
+static Result run_case(int pty, int sock, bool raw, const Pattern &pattern, Direction dir, size_t size)
+{
+    Result result;
+    std::vector<uint8_t> data(size);
+    pattern.generate(data, 0x1234);
+    result.sent = data.size();
+
+    std::vector<Chunk> chunks(data.size());
+    std::atomic<size_t> published { 0 };
+    std::atomic<bool> done { false };
+
+    int src = dir==Direction::UART_TO_TCP ? pty : sock;
+    int dst = dir==Direction::UART_TO_TCP ? sock : pty;
+    bool decode = !raw && dir==Direction::UART_TO_TCP;
+    bool encode = !raw && dir==Direction::TCP_TO_UART;
+
+    auto first_tx = Clock::now();
+    auto last_rx = first_tx;
+    std::thread writer([&] {
+        run_writer(src, encode, pattern, data, chunks, published);
+        done.store(true);
+    });
+
+    TelnetDecoder decoder;
+    uint8_t rbuf[4096];
+    uint8_t dbuf[4096];
+    size_t next_chunk = 0;
+    auto idle_since = Clock::now();
+
+    while (result.received<data.size()) {
+        struct pollfd pfd { dst, POLLIN, 0 };
+        int res = poll(&pfd, 1, 50);
+        auto now = Clock::now();
+        if (res<=0) {
+            if (done.load() && now-idle_since > std::chrono::milliseconds(IDLE_TIMEOUT_MS))
+                break;
+            continue;
+        }
+        auto rc = ::read(dst, rbuf, sizeof(rbuf));
+        if (rc<=0) {
+            fprintf(stderr, "bench: read failed: %s\n", rc<0 ? strerror(errno) : "closed");
+            break;
+        }
+        idle_since = now;
+
+        const uint8_t *payload = rbuf;
+        size_t len = rc;
+        if (decode) {
+            len = decoder.decode(rbuf, rc, dbuf);
+            payload = dbuf;
+        }
+        if (len==0)
+            continue;
+        last_rx = now;
+
+        for (size_t i=0; i<len && result.received<data.size(); i++, result.received++) {
+            if (result.first_error<0 && payload[i]!=data[result.received]) {
+                result.first_error = result.received;
+            }
+        }
+
+        auto avail = published.load(std::memory_order_acquire);
+        while (next_chunk<avail && chunks[next_chunk].end<=result.received) {
+            auto lat = std::chrono::duration<double, std::micro>(now - chunks[next_chunk].sent);
+            result.latency_us.push_back(lat.count());
+            next_chunk++;
+        }
+    }
+    writer.join();
+
+    result.seconds = std::chrono::duration<double>(last_rx - first_tx).count();
+    return result;
+}
+
+
+
+static void drain(int fd)
+{
+    uint8_t buf[4096];
+    struct pollfd pfd { fd, POLLIN, 0 };
+    while (poll(&pfd, 1, DRAIN_QUIET_MS)>0) {
+        if (::read(fd, buf, sizeof(buf))<=0)
+            break;
+    }
+}
+
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0.0;
+    size_t idx = std::min(sorted.size()-1, static_cast<size_t>(p * sorted.size()));
+    return sorted[idx];
+}
+
+
+static void print_result(const Pattern &pattern, Direction dir, Result &result)
+{
+    std::sort(result.latency_us.begin(), result.latency_us.end());
+    double mbps = result.seconds>0.0 ? result.received / result.seconds / 1e6 : 0.0;
+    printf("%-7s %-9s %9zu %8.3f %9.0f %9.0f %9.0f %9.0f %8zu %9zd\n",
+        pattern.name,
+        dir==Direction::UART_TO_TCP ? "uart>tcp" : "tcp>uart",
+        result.sent,
+        mbps,
+        percentile(result.latency_us, 0.50),
+        percentile(result.latency_us, 0.90),
+        percentile(result.latency_us, 0.99),
+        result.latency_us.empty() ? 0.0 : result.latency_us.back(),
+        result.sent - result.received,
+        result.first_error);
+    fflush(stdout);
+}
+
+
+
+static int open_pty(std::string &slave_name, int &slave)
+{
+    int master = posix_openpt(O_RDWR|O_NOCTTY);
+    if (master<0 || grantpt(master)!=0 || unlockpt(master)!=0)
+        die("posix_openpt");
+    slave_name = ptsname(master);
+
+    // Keep a slave handle open so the master never sees EIO, and make the
+    // line discipline fully transparent
+    slave = open(slave_name.c_str(), O_RDWR|O_NOCTTY);
+    if (slave<0)
+        die("open pty slave");
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    return master;
+}
+
+
+static int connect_bridge(uint16_t port)
+{
+    struct sockaddr_in addr {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    auto deadline = Clock::now() + std::chrono::seconds(CONNECT_TIMEOUT_S);
+    while (Clock::now()<deadline) {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))==0) {
+            int opt = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+            return sock;
+        }
+        close(sock);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    errno = ETIMEDOUT;
+    die("connect to bridge");
+    return -1;
+}
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+        "Usage: %s [-s bytes] [-k bytes] [-P pattern] [-d uart|tcp] [-r] [-p port] [-v]\n"
+        "  -s  bulk payload size per case (default 1048576)\n"
+        "  -k  keystroke payload size per case (default 2048)\n"
+        "  -P  only run pattern: ascii, binary or keys\n"
+        "  -d  only run direction: uart (uart>tcp) or tcp (tcp>uart)\n"
+        "  -r  use the raw TCP port instead of telnet\n"
+        "  -p  TCP port of the bridge (default 23, or 2323 with -r)\n"
+        "  -v  show bridge log output\n", name);
+}
+
+
+int main(int argc, char **argv)
+{
+    size_t bulk_size = 1024*1024;
+    size_t keys_size = 2048;
+    const char *only_pattern = nullptr;
+    const char *only_dir = nullptr;
+    uint16_t port = 0;
+    bool raw = false;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:k:P:d:rp:vh"))!=-1) {
+        switch (opt) {
+            case 's': bulk_size = strtoul(optarg, nullptr, 0); break;
+            case 'k': keys_size = strtoul(optarg, nullptr, 0); break;
+            case 'P': only_pattern = optarg; break;
+            case 'd': only_dir = optarg; break;
+            case 'r': raw = true; break;
+            case 'p': port = strtoul(optarg, nullptr, 0); break;
+            case 'v': verbose = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
+    if (port==0) {
+        port = raw ? 2323 : 23;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string slave_name;
+    int slave;
+    int pty = open_pty(slave_name, slave);
+    setenv("WIFI_SERIAL_UART_DEV", slave_name.c_str(), 1);
+
+    pid_t bridge = fork();
+    if (bridge<0)
+        die("fork");
+    if (bridge==0) {
+        close(pty);
+        if (!verbose) {
+            int null = open("/dev/null", O_WRONLY);
+            dup2(null, STDOUT_FILENO);
+            dup2(null, STDERR_FILENO);
+        }
+        app_main();
+        _exit(0);
+    }
+
+    int sock = connect_bridge(port);
+    drain(sock);
+
+    printf("%-7s %-9s %9s %8s %9s %9s %9s %9s %8s %9s\n",
+        "pattern", "direction", "bytes", "MB/s", "p50(us)", "p90(us)", "p99(us)", "max(us)", "lost", "first_err");
+
+    for (const auto &pattern : PATTERNS) {
+        if (only_pattern && strcmp(only_pattern, pattern.name)!=0)
+            continue;
+        for (auto dir : { Direction::UART_TO_TCP, Direction::TCP_TO_UART }) {
+            if (only_dir && strncmp(only_dir, dir==Direction::UART_TO_TCP ? "uart" : "tcp", strlen(only_dir))!=0)
+                continue;
+            auto result = run_case(pty, sock, raw, pattern, dir, pattern.keystrokes ? keys_size : bulk_size);
+            print_result(pattern, dir, result);
+            drain(sock);
+            drain(pty);
+        }
+    }
+
+    close(sock);
+    kill(bridge, SIGTERM);
+    waitpid(bridge, nullptr, 0);
+    close(slave);
+    close(pty);
+
+    return 0;
+}
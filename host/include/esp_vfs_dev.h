@@ -0,0 +1,22 @@
+#pragma once
+
+#include "esp_err.h"
+
+typedef enum {
+    ESP_LINE_ENDINGS_CRLF,
+    ESP_LINE_ENDINGS_CR,
+    ESP_LINE_ENDINGS_LF,
+} esp_line_endings_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void esp_vfs_dev_uart_register(void);
+void esp_vfs_dev_uart_use_driver(int uart_num);
+int esp_vfs_dev_uart_port_set_rx_line_endings(int uart_num, esp_line_endings_t mode);
+int esp_vfs_dev_uart_port_set_tx_line_endings(int uart_num, esp_line_endings_t mode);
+
+#ifdef __cplusplus
+}
+#endif
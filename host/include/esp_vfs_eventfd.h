@@ -0,0 +1,22 @@
+#pragma once
+
+/**
+ * Host stand-in for the eventfd VFS. Linux eventfd is used directly; the
+ * descriptors are created non-blocking like the ESP-IDF ones.
+ */
+
+#include <sys/eventfd.h>
+#include "esp_err.h"
+
+#define EFD_SUPPORT_ISR EFD_NONBLOCK
+
+typedef struct {
+    size_t max_fds;
+} esp_vfs_eventfd_config_t;
+
+#define ESP_VFS_EVENTD_CONFIG_DEFAULT() (esp_vfs_eventfd_config_t) { .max_fds = 5 }
+
+static inline esp_err_t esp_vfs_eventfd_register(const esp_vfs_eventfd_config_t *config)
+{
+    return ESP_OK;
+}
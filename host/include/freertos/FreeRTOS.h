@@ -0,0 +1,25 @@
+#pragma once
+
+/**
+ * Host stand-in for the FreeRTOS kernel API used by the bridge.
+ * Tasks map onto POSIX threads; ticks are milliseconds.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include "sdkconfig.h"
+
+typedef int32_t  BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE     ((BaseType_t)0)
+#define pdTRUE      ((BaseType_t)1)
+#define pdPASS      pdTRUE
+#define pdFAIL      pdFALSE
+
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS  ((TickType_t)1000 / CONFIG_FREERTOS_HZ)
+#define pdMS_TO_TICKS(ms)   ((TickType_t)(((uint64_t)(ms) * CONFIG_FREERTOS_HZ) / 1000U))
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct StreamBufferDef_t *StreamBufferHandle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+StreamBufferHandle_t xStreamBufferCreate(size_t xBufferSizeBytes, size_t xTriggerLevelBytes);
+void vStreamBufferDelete(StreamBufferHandle_t xStreamBuffer);
+size_t xStreamBufferSend(StreamBufferHandle_t xStreamBuffer, const void *pvTxData, size_t xDataLengthBytes, TickType_t xTicksToWait);
+size_t xStreamBufferReceive(StreamBufferHandle_t xStreamBuffer, void *pvRxData, size_t xBufferLengthBytes, TickType_t xTicksToWait);
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t xStreamBuffer);
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t xStreamBuffer);
+BaseType_t xStreamBufferIsEmpty(StreamBufferHandle_t xStreamBuffer);
+BaseType_t xStreamBufferReset(StreamBufferHandle_t xStreamBuffer);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,22 @@
+#pragma once
+
+/**
+ * Host stand-in for the lwIP BSD socket layer: the POSIX socket API is
+ * source compatible, only the lwIP extensions need shims.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+static inline char *inet_ntoa_r(struct in_addr addr, char *buf, int buflen)
+{
+    return (char *)inet_ntop(AF_INET, &addr, buf, buflen);
+}
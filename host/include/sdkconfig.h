@@ -0,0 +1,12 @@
+#pragma once
+
+/**
+ * Minimal sdkconfig for the host (Linux) build of the bridge core.
+ * Only the options referenced by the sources in src/ are defined here.
+ */
+
+#define CONFIG_IDF_TARGET "linux"
+#define CONFIG_IDF_TARGET_LINUX 1
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_LOG_DEFAULT_LEVEL 3
+#define CONFIG_LWIP_TCP_MSS 1440
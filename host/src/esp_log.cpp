@@ -0,0 +1,58 @@
+#include <esp_log.h>
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+
+static esp_log_level_t s_level { static_cast<esp_log_level_t>(CONFIG_LOG_DEFAULT_LEVEL) };
+
+
+const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+        case ESP_OK:                return "ESP_OK";
+        case ESP_FAIL:              return "ESP_FAIL";
+        case ESP_ERR_NO_MEM:        return "ESP_ERR_NO_MEM";
+        case ESP_ERR_INVALID_ARG:   return "ESP_ERR_INVALID_ARG";
+        case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+        case ESP_ERR_INVALID_SIZE:  return "ESP_ERR_INVALID_SIZE";
+        case ESP_ERR_NOT_FOUND:     return "ESP_ERR_NOT_FOUND";
+        case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+        case ESP_ERR_TIMEOUT:       return "ESP_ERR_TIMEOUT";
+        default:                    return "UNKNOWN ERROR";
+    }
+}
+
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    // Per tag levels are not needed on the host
+    if (strcmp(tag, "*")==0) {
+        s_level = level;
+    }
+}
+
+
+uint32_t esp_log_timestamp(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+
+void esp_log_write(esp_log_level_t level, const char *tag, const char *format, ...)
+{
+    static constexpr char LETTERS[] { 'N', 'E', 'W', 'I', 'D', 'V' };
+
+    if (level>s_level) 
+        return;
+
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%c (%u) %s: ", LETTERS[level], esp_log_timestamp(), tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
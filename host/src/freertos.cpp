@@ -0,0 +1,280 @@
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/queue.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+struct tskTaskControlBlock {
+    std::mutex lock;
+    std::condition_variable cv;
+    uint32_t notify { 0 };
+};
+
+static thread_local TaskHandle_t s_current { nullptr };
+
+
+BaseType_t xTaskCreate(TaskFunction_t pxTaskCode, const char *const pcName, const uint32_t usStackDepth, void *const pvParameters, UBaseType_t uxPriority, TaskHandle_t *const pxCreatedTask)
+{
+    auto task = new tskTaskControlBlock;
+    if (pxCreatedTask) {
+        *pxCreatedTask = task;
+    }
+    std::thread([=]() {
+        s_current = task;
+        pxTaskCode(pvParameters);
+    }).detach();
+    return pdPASS;
+}
+
+
+void vTaskDelete(TaskHandle_t xTaskToDelete)
+{
+    // Only tasks ending themselves are supported
+    if (!xTaskToDelete || xTaskToDelete==s_current) {
+        pthread_exit(nullptr);
+    }
+}
+
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+    std::lock_guard<std::mutex> guard(xTaskToNotify->lock);
+    xTaskToNotify->notify++;
+    xTaskToNotify->cv.notify_one();
+    return pdPASS;
+}
+
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+    auto task = s_current;
+    std::unique_lock<std::mutex> guard(task->lock);
+    auto ready = [task]() { return task->notify>0; };
+    if (xTicksToWait==portMAX_DELAY) {
+        task->cv.wait(guard, ready);
+    }
+    else {
+        task->cv.wait_for(guard, std::chrono::milliseconds(xTicksToWait*portTICK_PERIOD_MS), ready);
+    }
+    auto value = task->notify;
+    if (value) {
+        task->notify = xClearCountOnExit ? 0 : value-1;
+    }
+    return value;
+}
+
+
+void vTaskDelay(const TickType_t xTicksToDelay)
+{
+    usleep(static_cast<useconds_t>(xTicksToDelay) * portTICK_PERIOD_MS * 1000);
+}
+
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return pdMS_TO_TICKS(ts.tv_sec*1000ULL + ts.tv_nsec/1000000);
+}
+
+
+void taskYIELD(void)
+{
+    sched_yield();
+}
+
+
+
+struct StreamBufferDef_t {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<uint8_t> buf;
+    size_t trigger;
+    size_t head { 0 };
+    size_t count { 0 };
+};
+
+
+template<typename Pred>
+static bool stream_wait(StreamBufferDef_t *sb, std::unique_lock<std::mutex> &guard, TickType_t ticks, Pred pred)
+{
+    if (ticks==portMAX_DELAY) {
+        sb->cv.wait(guard, pred);
+        return true;
+    }
+    return sb->cv.wait_for(guard, std::chrono::milliseconds(ticks*portTICK_PERIOD_MS), pred);
+}
+
+
+StreamBufferHandle_t xStreamBufferCreate(size_t xBufferSizeBytes, size_t xTriggerLevelBytes)
+{
+    auto sb = new StreamBufferDef_t;
+    sb->buf.resize(xBufferSizeBytes);
+    sb->trigger = xTriggerLevelBytes ? xTriggerLevelBytes : 1;
+    return sb;
+}
+
+
+void vStreamBufferDelete(StreamBufferHandle_t xStreamBuffer)
+{
+    delete xStreamBuffer;
+}
+
+
+size_t xStreamBufferSend(StreamBufferHandle_t sb, const void *pvTxData, size_t xDataLengthBytes, TickType_t xTicksToWait)
+{
+    std::unique_lock<std::mutex> guard(sb->lock);
+    auto size = sb->buf.size();
+    auto need = xDataLengthBytes < size ? xDataLengthBytes : size;
+    stream_wait(sb, guard, xTicksToWait, [&]() { return size-sb->count >= need; });
+
+    auto data = static_cast<const uint8_t*>(pvTxData);
+    size_t sent = 0;
+    while (sent<xDataLengthBytes && sb->count<size) {
+        sb->buf[(sb->head+sb->count) % size] = data[sent++];
+        sb->count++;
+    }
+    sb->cv.notify_all();
+    return sent;
+}
+
+
+size_t xStreamBufferReceive(StreamBufferHandle_t sb, void *pvRxData, size_t xBufferLengthBytes, TickType_t xTicksToWait)
+{
+    std::unique_lock<std::mutex> guard(sb->lock);
+    if (!stream_wait(sb, guard, xTicksToWait, [&]() { return sb->count >= sb->trigger; }) && sb->count==0) {
+        return 0;
+    }
+
+    auto size = sb->buf.size();
+    auto data = static_cast<uint8_t*>(pvRxData);
+    size_t received = 0;
+    while (received<xBufferLengthBytes && sb->count>0) {
+        data[received++] = sb->buf[sb->head];
+        sb->head = (sb->head+1) % size;
+        sb->count--;
+    }
+    sb->cv.notify_all();
+    return received;
+}
+
+
+size_t xStreamBufferBytesAvailable(StreamBufferHandle_t sb)
+{
+    std::lock_guard<std::mutex> guard(sb->lock);
+    return sb->count;
+}
+
+
+size_t xStreamBufferSpacesAvailable(StreamBufferHandle_t sb)
+{
+    std::lock_guard<std::mutex> guard(sb->lock);
+    return sb->buf.size()-sb->count;
+}
+
+
+BaseType_t xStreamBufferIsEmpty(StreamBufferHandle_t sb)
+{
+    std::lock_guard<std::mutex> guard(sb->lock);
+    return sb->count==0;
+}
+
+
+BaseType_t xStreamBufferReset(StreamBufferHandle_t sb)
+{
+    std::lock_guard<std::mutex> guard(sb->lock);
+    sb->head = 0;
+    sb->count = 0;
+    sb->cv.notify_all();
+    return pdPASS;
+}
+
+
+
+struct QueueDefinition {
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t item_size;
+};
+
+
+template<typename Pred>
+static bool queue_wait(QueueDefinition *q, std::unique_lock<std::mutex> &guard, TickType_t ticks, Pred pred)
+{
+    if (ticks==portMAX_DELAY) {
+        q->cv.wait(guard, pred);
+        return true;
+    }
+    return q->cv.wait_for(guard, std::chrono::milliseconds(ticks*portTICK_PERIOD_MS), pred);
+}
+
+
+QueueHandle_t xQueueCreate(UBaseType_t uxQueueLength, UBaseType_t uxItemSize)
+{
+    auto q = new QueueDefinition;
+    q->length = uxQueueLength;
+    q->item_size = uxItemSize;
+    return q;
+}
+
+
+void vQueueDelete(QueueHandle_t xQueue)
+{
+    delete xQueue;
+}
+
+
+BaseType_t xQueueSend(QueueHandle_t q, const void *pvItemToQueue, TickType_t xTicksToWait)
+{
+    std::unique_lock<std::mutex> guard(q->lock);
+    if (!queue_wait(q, guard, xTicksToWait, [q]() { return q->items.size() < q->length; })) {
+        return pdFAIL;
+    }
+    auto item = static_cast<const uint8_t*>(pvItemToQueue);
+    q->items.emplace_back(item, item+q->item_size);
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *pvBuffer, TickType_t xTicksToWait)
+{
+    std::unique_lock<std::mutex> guard(q->lock);
+    if (!queue_wait(q, guard, xTicksToWait, [q]() { return !q->items.empty(); })) {
+        return pdFAIL;
+    }
+    memcpy(pvBuffer, q->items.front().data(), q->item_size);
+    q->items.pop_front();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+
+BaseType_t xQueueReset(QueueHandle_t q)
+{
+    std::lock_guard<std::mutex> guard(q->lock);
+    q->items.clear();
+    q->cv.notify_all();
+    return pdPASS;
+}
+
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+    std::lock_guard<std::mutex> guard(q->lock);
+    return q->items.size();
+}
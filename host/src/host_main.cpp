@@ -0,0 +1,15 @@
+/**
+ * Host entry point: runs the bridge main loop against the tty named by
+ * WIFI_SERIAL_UART_DEV (e.g. a pty or a USB serial adapter).
+ */
+
+extern "C" {
+    void app_main(void);
+}
+
+
+int main(int argc, char **argv)
+{
+    app_main();
+    return 0;
+}
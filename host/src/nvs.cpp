@@ -0,0 +1,137 @@
+#include <nvs.h>
+#include <nvs_flash.h>
+
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+static std::mutex s_lock;
+static std::vector<std::string> s_handles;
+struct Value {
+    bool blob;
+    uint32_t u32;
+    std::vector<uint8_t> data;
+};
+
+static std::map<std::string, std::map<std::string, Value>> s_store;
+
+
+esp_err_t nvs_flash_init(void)
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase(void)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_store.clear();
+    return ESP_OK;
+}
+
+
+esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    if (open_mode==NVS_READONLY && s_store.find(namespace_name)==s_store.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    s_handles.push_back(namespace_name);
+    *out_handle = s_handles.size();
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+
+static std::map<std::string, Value> *get_namespace(nvs_handle_t handle)
+{
+    if (handle==0 || handle>s_handles.size())
+        return nullptr;
+    return &s_store[s_handles[handle-1]];
+}
+
+
+esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto ns = get_namespace(handle);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    ns->clear();
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto ns = get_namespace(handle);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    return ns->erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto ns = get_namespace(handle);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    auto it = ns->find(key);
+    if (it==ns->end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (it->second.blob)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    *out_value = it->second.u32;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto ns = get_namespace(handle);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    (*ns)[key] = Value { false, value, {} };
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto ns = get_namespace(handle);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    auto it = ns->find(key);
+    if (it==ns->end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    if (!it->second.blob)
+        return ESP_ERR_NVS_TYPE_MISMATCH;
+    auto &data = it->second.data;
+    if (out_value) {
+        if (*length<data.size())
+            return ESP_ERR_NVS_INVALID_LENGTH;
+        memcpy(out_value, data.data(), data.size());
+    }
+    *length = data.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto ns = get_namespace(handle);
+    if (!ns)
+        return ESP_ERR_NVS_INVALID_HANDLE;
+    auto bytes = static_cast<const uint8_t*>(value);
+    (*ns)[key] = Value { true, 0, std::vector<uint8_t>(bytes, bytes+length) };
+    return ESP_OK;
+}
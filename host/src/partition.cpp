@@ -0,0 +1,140 @@
+#include <esp_partition.h>
+
+#include <string.h>
+#include <mutex>
+#include <vector>
+
+
+// Mirrors partitions.seed_xiao_esp32c3.csv
+static const esp_partition_t s_partitions[] {
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS,    0x9000,  0x6000,   0x1000, "nvs",      false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_PHY,    0xf000,  0x1000,   0x1000, "phy_init", false },
+    { ESP_PARTITION_TYPE_APP,  ESP_PARTITION_SUBTYPE_APP_FACTORY, 0x10000, 0x100000, 0x1000, "factory",  false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, 0x110000, 2488*1024, 0x1000, "storage", false },
+    { ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_ESPHTTPD, 0x37e000, 512*1024, 0x1000, "assets", false },
+};
+static constexpr size_t PARTITION_COUNT { sizeof(s_partitions)/sizeof(s_partitions[0]) };
+
+
+struct esp_partition_iterator_opaque_ {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    const char *label;
+    size_t index;
+};
+
+
+static bool matches(const esp_partition_t &part, esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    if (type!=ESP_PARTITION_TYPE_ANY && part.type!=type) 
+        return false;
+    if (subtype!=ESP_PARTITION_SUBTYPE_ANY && part.subtype!=subtype) 
+        return false;
+    if (label && strcmp(part.label, label)!=0)
+        return false;
+    return true;
+}
+
+
+static esp_partition_iterator_t find_from(esp_partition_iterator_t it, size_t index)
+{
+    for (; index<PARTITION_COUNT; index++) {
+        if (matches(s_partitions[index], it->type, it->subtype, it->label)) {
+            it->index = index;
+            return it;
+        }
+    }
+    delete it;
+    return nullptr;
+}
+
+
+esp_partition_iterator_t esp_partition_find(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    return find_from(new esp_partition_iterator_opaque_ { type, subtype, label, 0 }, 0);
+}
+
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label)
+{
+    auto it = esp_partition_find(type, subtype, label);
+    if (!it) 
+        return nullptr;
+    auto part = esp_partition_get(it);
+    esp_partition_iterator_release(it);
+    return part;
+}
+
+
+const esp_partition_t *esp_partition_get(esp_partition_iterator_t iterator)
+{
+    return &s_partitions[iterator->index];
+}
+
+
+esp_partition_iterator_t esp_partition_next(esp_partition_iterator_t iterator)
+{
+    return find_from(iterator, iterator->index+1);
+}
+
+
+void esp_partition_iterator_release(esp_partition_iterator_t iterator)
+{
+    delete iterator;
+}
+
+
+static std::mutex s_flash_lock;
+static std::vector<uint8_t> s_flash[PARTITION_COUNT];
+
+
+static uint8_t *flash_at(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    auto index = partition-s_partitions;
+    if (index<0 || static_cast<size_t>(index)>=PARTITION_COUNT || offset+size>partition->size) {
+        return nullptr;
+    }
+    auto &flash = s_flash[index];
+    if (flash.empty()) {
+        flash.assign(partition->size, 0xff);
+    }
+    return flash.data()+offset;
+}
+
+
+esp_err_t esp_partition_read(const esp_partition_t *partition, size_t src_offset, void *dst, size_t size)
+{
+    std::lock_guard<std::mutex> guard(s_flash_lock);
+    auto flash = flash_at(partition, src_offset, size);
+    if (!flash) 
+        return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, flash, size);
+    return ESP_OK;
+}
+
+
+esp_err_t esp_partition_write(const esp_partition_t *partition, size_t dst_offset, const void *src, size_t size)
+{
+    std::lock_guard<std::mutex> guard(s_flash_lock);
+    auto flash = flash_at(partition, dst_offset, size);
+    if (!flash) 
+        return ESP_ERR_INVALID_SIZE;
+    auto data = static_cast<const uint8_t*>(src);
+    for (size_t i=0; i<size; i++) {
+        flash[i] &= data[i];
+    }
+    return ESP_OK;
+}
+
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *partition, size_t offset, size_t size)
+{
+    std::lock_guard<std::mutex> guard(s_flash_lock);
+    if (offset%partition->erase_size || size%partition->erase_size)
+        return ESP_ERR_INVALID_ARG;
+    auto flash = flash_at(partition, offset, size);
+    if (!flash) 
+        return ESP_ERR_INVALID_SIZE;
+    memset(flash, 0xff, size);
+    return ESP_OK;
+}
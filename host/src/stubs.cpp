@@ -0,0 +1,42 @@
+/**
+ * The WiFi, USB console and web terminal modules are target only. The
+ * host build links these empty stand-ins so main.cpp can be compiled
+ * unchanged.
+ */
+#include <sys/types.h>
+
+#include "wifi.h"
+#include "console.h"
+#include "web.h"
+
+
+void wifi_init()
+{
+}
+
+
+void console_init()
+{
+}
+
+
+bool WebTerminal::start()
+{
+    return true;
+}
+
+
+void WebTerminal::stop()
+{
+}
+
+
+bool WebTerminal::next(Event &)
+{
+    return false;
+}
+
+
+void WebTerminal::close(int)
+{
+}
@@ -0,0 +1,404 @@
+#include <driver/uart.h>
+#include <esp_vfs_dev.h>
+#include <esp_log.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+static constexpr const char *TAG = "uart";
+
+static constexpr size_t UART_READ_CHUNK { 256 };
+
+
+struct HostUart {
+    int fd { -1 };
+    QueueHandle_t queue { nullptr };
+    std::thread reader;
+    std::atomic<bool> running { false };
+    // Cleared while the RX interrupts are off, data then stays in the pty like in the FIFO
+    std::atomic<bool> rx_enabled { true };
+
+    // RX ring, filled by the reader thread like the driver ISR fills it from the FIFO
+    std::mutex lock;
+    std::condition_variable cv;
+    std::vector<uint8_t> ring;
+    size_t head { 0 };
+    size_t count { 0 };
+};
+
+static bool s_installed[UART_NUM_MAX];
+static uart_config_t s_config[UART_NUM_MAX];
+static HostUart s_uart[UART_NUM_MAX];
+
+
+static void post_event(HostUart &uart, uart_event_type_t type, size_t size)
+{
+    if (uart.queue) {
+        uart_event_t event { type, size, false };
+        xQueueSend(uart.queue, &event, 0);
+    }
+}
+
+
+static void reader(HostUart &uart)
+{
+    uint8_t buf[UART_READ_CHUNK];
+
+    while (uart.running) {
+        size_t space;
+        {
+            std::unique_lock<std::mutex> guard(uart.lock);
+            space = uart.ring.size()-uart.count;
+            if (!uart.rx_enabled) {
+                uart.cv.wait_for(guard, std::chrono::milliseconds(10));
+                continue;
+            }
+            if (space==0) {
+                // The driver stops taking data from the FIFO until the ring has room
+                guard.unlock();
+                post_event(uart, UART_BUFFER_FULL, 0);
+                guard.lock();
+                uart.cv.wait_for(guard, std::chrono::milliseconds(100), [&]() { return uart.count<uart.ring.size(); });
+                continue;
+            }
+        }
+
+        struct pollfd pfd { uart.fd, POLLIN, 0 };
+        if (poll(&pfd, 1, 100)<=0) {
+            continue;
+        }
+        auto len = read(uart.fd, buf, space<sizeof(buf) ? space : sizeof(buf));
+        if (len<=0) {
+            continue;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(uart.lock);
+            auto size = uart.ring.size();
+            for (ssize_t i=0; i<len; i++) {
+                uart.ring[(uart.head+uart.count+i) % size] = buf[i];
+            }
+            uart.count += len;
+        }
+        post_event(uart, UART_DATA, len);
+    }
+}
+
+
+bool uart_is_driver_installed(uart_port_t uart_num)
+{
+    return uart_num>=0 && uart_num<UART_NUM_MAX && s_installed[uart_num];
+}
+
+
+esp_err_t uart_driver_install(uart_port_t uart_num, int rx_buffer_size, int tx_buffer_size, int queue_size, QueueHandle_t *uart_queue, int intr_alloc_flags)
+{
+    if (uart_num<0 || uart_num>=UART_NUM_MAX) 
+        return ESP_ERR_INVALID_ARG;
+    if (s_installed[uart_num])
+        return ESP_FAIL;
+
+    char name[32];
+    snprintf(name, sizeof(name), "WIFI_SERIAL_UART%d_DEV", uart_num);
+    const char *dev = getenv(name);
+    if (!dev) {
+        dev = getenv("WIFI_SERIAL_UART_DEV");
+    }
+    if (!dev) {
+        ESP_LOGE(TAG, "Neither %s nor WIFI_SERIAL_UART_DEV is set", name);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    auto &uart = s_uart[uart_num];
+    uart.fd = open(dev, O_RDWR|O_NONBLOCK|O_NOCTTY);
+    if (uart.fd<0) {
+        ESP_LOGE(TAG, "Cannot open '%s': errno %d", dev, errno);
+        return ESP_FAIL;
+    }
+    ESP_LOGI(TAG, "UART %d backed by %s", uart_num, dev);
+
+    uart.ring.assign(rx_buffer_size, 0);
+    uart.head = 0;
+    uart.count = 0;
+    uart.queue = nullptr;
+    if (queue_size>0 && uart_queue) {
+        uart.queue = xQueueCreate(queue_size, sizeof(uart_event_t));
+        *uart_queue = uart.queue;
+    }
+    uart.running = true;
+    uart.reader = std::thread(reader, std::ref(uart));
+
+    s_installed[uart_num] = true;
+    return ESP_OK;
+}
+
+
+esp_err_t uart_driver_delete(uart_port_t uart_num)
+{
+    if (!uart_is_driver_installed(uart_num))
+        return ESP_ERR_INVALID_STATE;
+    auto &uart = s_uart[uart_num];
+    uart.running = false;
+    uart.reader.join();
+    close(uart.fd);
+    uart.fd = -1;
+    s_installed[uart_num] = false;
+    return ESP_OK;
+}
+
+
+int uart_read_bytes(uart_port_t uart_num, void *buf, uint32_t length, TickType_t ticks_to_wait)
+{
+    if (!uart_is_driver_installed(uart_num))
+        return -1;
+    auto &uart = s_uart[uart_num];
+    std::unique_lock<std::mutex> guard(uart.lock);
+    if (ticks_to_wait) {
+        auto ready = [&]() { return uart.count>=length; };
+        if (ticks_to_wait==portMAX_DELAY) {
+            uart.cv.wait(guard, ready);
+        }
+        else {
+            uart.cv.wait_for(guard, std::chrono::milliseconds(ticks_to_wait*portTICK_PERIOD_MS), ready);
+        }
+    }
+    auto data = static_cast<uint8_t*>(buf);
+    auto size = uart.ring.size();
+    uint32_t len = 0;
+    while (len<length && uart.count>0) {
+        data[len++] = uart.ring[uart.head];
+        uart.head = (uart.head+1) % size;
+        uart.count--;
+    }
+    uart.cv.notify_all();
+    return len;
+}
+
+
+int uart_write_bytes(uart_port_t uart_num, const void *src, size_t size)
+{
+    if (!uart_is_driver_installed(uart_num))
+        return -1;
+    // Return once everything is handed over to the pty, there is no TX ring to drain
+    auto fd = s_uart[uart_num].fd;
+    auto data = static_cast<const uint8_t*>(src);
+    size_t done = 0;
+    while (done<size) {
+        auto res = write(fd, data+done, size-done);
+        if (res<0 && errno==EAGAIN) {
+            struct pollfd pfd { fd, POLLOUT, 0 };
+            poll(&pfd, 1, 10);
+            continue;
+        }
+        if (res<=0) {
+            return -1;
+        }
+        done += res;
+    }
+    return done;
+}
+
+
+esp_err_t uart_wait_tx_done(uart_port_t uart_num, TickType_t ticks_to_wait)
+{
+    if (!uart_is_driver_installed(uart_num))
+        return ESP_FAIL;
+    // uart_write_bytes() has already handed everything to the pty
+    return ESP_OK;
+}
+
+
+esp_err_t uart_param_config(uart_port_t uart_num, const uart_config_t *uart_config)
+{
+    if (uart_num<0 || uart_num>=UART_NUM_MAX || !uart_config) 
+        return ESP_ERR_INVALID_ARG;
+    s_config[uart_num] = *uart_config;
+    return ESP_OK;
+}
+
+
+esp_err_t uart_set_pin(uart_port_t uart_num, int tx_io_num, int rx_io_num, int rts_io_num, int cts_io_num)
+{
+    return (uart_num>=0 && uart_num<UART_NUM_MAX) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+
+esp_err_t uart_set_baudrate(uart_port_t uart_num, uint32_t baudrate)
+{
+    if (uart_num<0 || uart_num>=UART_NUM_MAX) 
+        return ESP_ERR_INVALID_ARG;
+    s_config[uart_num].baud_rate = baudrate;
+    return ESP_OK;
+}
+
+
+esp_err_t uart_get_baudrate(uart_port_t uart_num, uint32_t *baudrate)
+{
+    if (uart_num<0 || uart_num>=UART_NUM_MAX) 
+        return ESP_ERR_INVALID_ARG;
+    *baudrate = s_config[uart_num].baud_rate;
+    return ESP_OK;
+}
+
+
+
+#define UART_CHECK_PORT(uart_num) \
+    if (uart_num<0 || uart_num>=UART_NUM_MAX) return ESP_ERR_INVALID_ARG
+
+
+esp_err_t uart_set_word_length(uart_port_t uart_num, uart_word_length_t data_bit)
+{
+    UART_CHECK_PORT(uart_num);
+    if (data_bit>=UART_DATA_BITS_MAX) 
+        return ESP_ERR_INVALID_ARG;
+    s_config[uart_num].data_bits = data_bit;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_word_length(uart_port_t uart_num, uart_word_length_t *data_bit)
+{
+    UART_CHECK_PORT(uart_num);
+    *data_bit = s_config[uart_num].data_bits;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_parity(uart_port_t uart_num, uart_parity_t parity_mode)
+{
+    UART_CHECK_PORT(uart_num);
+    s_config[uart_num].parity = parity_mode;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_parity(uart_port_t uart_num, uart_parity_t *parity_mode)
+{
+    UART_CHECK_PORT(uart_num);
+    *parity_mode = s_config[uart_num].parity;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_stop_bits(uart_port_t uart_num, uart_stop_bits_t stop_bits)
+{
+    UART_CHECK_PORT(uart_num);
+    if (stop_bits>=UART_STOP_BITS_MAX) 
+        return ESP_ERR_INVALID_ARG;
+    s_config[uart_num].stop_bits = stop_bits;
+    return ESP_OK;
+}
+
+esp_err_t uart_get_stop_bits(uart_port_t uart_num, uart_stop_bits_t *stop_bits)
+{
+    UART_CHECK_PORT(uart_num);
+    *stop_bits = s_config[uart_num].stop_bits;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_hw_flow_ctrl(uart_port_t uart_num, uart_hw_flowcontrol_t flow_ctrl, uint8_t rx_thresh)
+{
+    UART_CHECK_PORT(uart_num);
+    s_config[uart_num].flow_ctrl = flow_ctrl;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_sw_flow_ctrl(uart_port_t uart_num, bool enable,  uint8_t rx_thresh_xon,  uint8_t rx_thresh_xoff)
+{
+    UART_CHECK_PORT(uart_num);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_line_inverse(uart_port_t uart_num, uint32_t inverse_mask)
+{
+    UART_CHECK_PORT(uart_num);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_dtr(uart_port_t uart_num, int level)
+{
+    UART_CHECK_PORT(uart_num);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rts(uart_port_t uart_num, int level)
+{
+    UART_CHECK_PORT(uart_num);
+    if (s_config[uart_num].flow_ctrl & UART_HW_FLOWCTRL_RTS)
+        return ESP_FAIL;
+    return ESP_OK;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart_num)
+{
+    UART_CHECK_PORT(uart_num);
+    auto &uart = s_uart[uart_num];
+    std::lock_guard<std::mutex> guard(uart.lock);
+    uart.head = 0;
+    uart.count = 0;
+    uart.cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart_num, size_t *size)
+{
+    UART_CHECK_PORT(uart_num);
+    auto &uart = s_uart[uart_num];
+    std::lock_guard<std::mutex> guard(uart.lock);
+    *size = uart.count;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_timeout(uart_port_t uart_num, const uint8_t tout_thresh)
+{
+    UART_CHECK_PORT(uart_num);
+    return ESP_OK;
+}
+
+esp_err_t uart_set_rx_full_threshold(uart_port_t uart_num, int threshold)
+{
+    UART_CHECK_PORT(uart_num);
+    return ESP_OK;
+}
+
+esp_err_t uart_enable_rx_intr(uart_port_t uart_num)
+{
+    UART_CHECK_PORT(uart_num);
+    s_uart[uart_num].rx_enabled = true;
+    s_uart[uart_num].cv.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t uart_disable_rx_intr(uart_port_t uart_num)
+{
+    UART_CHECK_PORT(uart_num);
+    s_uart[uart_num].rx_enabled = false;
+    return ESP_OK;
+}
+
+
+
+void esp_vfs_dev_uart_register(void)
+{
+}
+
+void esp_vfs_dev_uart_use_driver(int uart_num)
+{
+}
+
+int esp_vfs_dev_uart_port_set_rx_line_endings(int uart_num, esp_line_endings_t mode)
+{
+    return 0;
+}
+
+int esp_vfs_dev_uart_port_set_tx_line_endings(int uart_num, esp_line_endings_t mode)
+{
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "assets.h"
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_http_server.h>
+
+
+static constexpr const char* TAG = "assets";
+
+static constexpr char ASSETS_MAGIC[4] { 'W', 'S', 'A', '1' };
+static constexpr uint32_t ASSET_GZIP { 1 };
+// Referenced with a version query, a changed file gets a new URL
+static constexpr uint32_t ASSET_VERSIONED { 2 };
+
+static constexpr const char *INDEX_PATH { "/index.html" };
+static constexpr const char *CACHE_VERSIONED { "public, max-age=31536000, immutable" };
+static constexpr const char *CACHE_REVALIDATE { "no-cache" };
+// Room for a few ETags in If-None-Match
+static constexpr size_t IF_NONE_MATCH_SIZE { 96 };
+
+
+bool WebAssets::start()
+{
+    auto partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, m_label);
+    if (!partition) {
+        ESP_LOGE(TAG, "Partition '%s' not found", m_label);
+        return false;
+    }
+
+    Header header;
+    auto res = esp_partition_read(partition, 0, &header, sizeof(header));
+    if (res!=ESP_OK || memcmp(header.magic, ASSETS_MAGIC, sizeof(ASSETS_MAGIC))!=0 ||
+            header.size>partition->size || header.count>(header.size-sizeof(Header))/sizeof(Entry)) {
+        ESP_LOGW(TAG, "No web assets in '%s', see tools/mkassets.py", m_label);
+        return false;
+    }
+
+    const void *image;
+    res = esp_partition_mmap(partition, 0, header.size, ESP_PARTITION_MMAP_DATA, &image, &m_mmap);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Unable to map '%s': err=%d", m_label, res);
+        return false;
+    }
+    auto entries = reinterpret_cast<const Entry*>(static_cast<const uint8_t*>(image)+sizeof(Header));
+    for (size_t i=0; i<header.count; i++) {
+        auto &entry = entries[i];
+        if (entry.path[sizeof(entry.path)-1] || entry.type[sizeof(entry.type)-1] || entry.etag[sizeof(entry.etag)-1] ||
+                entry.offset>header.size || entry.size>header.size-entry.offset) {
+            ESP_LOGE(TAG, "Damaged web assets in '%s'", m_label);
+            esp_partition_munmap(m_mmap);
+            return false;
+        }
+    }
+
+    m_image = static_cast<const uint8_t*>(image);
+    m_entries = entries;
+    m_count = header.count;
+    ESP_LOGI(TAG, "%u web assets, %lu bytes in '%s'", m_count, header.size, m_label);
+    return true;
+}
+
+
+const WebAssets::Entry *WebAssets::find(const char *path, size_t len) const
+{
+    for (size_t i=0; i<m_count; i++) {
+        auto &entry = m_entries[i];
+        if (strncmp(entry.path, path, len)==0 && entry.path[len]=='\0') {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+
+esp_err_t WebAssets::serve(httpd_req_t *req) const
+{
+    // The query only carries the asset version
+    auto len = strcspn(req->uri, "?#");
+    auto entry = len==1 ? find(INDEX_PATH, strlen(INDEX_PATH)) : find(req->uri, len);
+    if (!entry) {
+        return httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, running() ? nullptr : "Web assets not flashed");
+    }
+
+    // Header values are sent from flash as well
+    httpd_resp_set_hdr(req, "ETag", entry->etag);
+    httpd_resp_set_hdr(req, "Cache-Control", entry->flags & ASSET_VERSIONED ? CACHE_VERSIONED : CACHE_REVALIDATE);
+
+    char match[IF_NONE_MATCH_SIZE];
+    if (httpd_req_get_hdr_value_str(req, "If-None-Match", match, sizeof(match))==ESP_OK && strstr(match, entry->etag)) {
+        httpd_resp_set_status(req, "304 Not Modified");
+        return httpd_resp_send(req, nullptr, 0);
+    }
+
+    httpd_resp_set_type(req, entry->type);
+    if (entry->flags & ASSET_GZIP) {
+        // Every browser takes gzip, there is no plain copy to fall back to
+        httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    }
+    return httpd_resp_send(req, reinterpret_cast<const char*>(m_image+entry->offset), entry->size);
+}
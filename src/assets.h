@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <esp_err.h>
+#include <esp_partition.h>
+
+struct httpd_req;
+
+
+/**
+ * Static web files in a flash partition, packed by tools/mkassets.py.
+ *
+ * The image is mapped into the address space once and responses are sent
+ * straight from flash, so a request needs no buffer of its own. Files are
+ * stored gzipped, with a strong ETag: a browser that has the file already
+ * gets a 304 without the body.
+ */
+class WebAssets {
+    public:
+        constexpr WebAssets(const char *label) :
+            m_label { label },
+            m_image { nullptr },
+            m_entries { nullptr },
+            m_count { 0 },
+            m_mmap { 0 }
+        {}
+
+        /** Map the image, false if the partition holds none */
+        bool start();
+        bool running() const { return m_image!=nullptr; }
+
+        /** Answer a GET for the request path, / is index.html */
+        esp_err_t serve(struct httpd_req *req) const;
+
+    private:
+        // Layout written by tools/mkassets.py
+        struct Header {
+            char magic[4];
+            uint32_t count;
+            uint32_t size;
+            uint32_t reserved;
+        };
+
+        struct Entry {
+            char path[48];
+            char type[32];
+            char etag[20];
+            uint32_t offset;
+            uint32_t size;
+            uint32_t flags;
+        };
+
+        const char *m_label;
+        const uint8_t *m_image;
+        const Entry *m_entries;
+        size_t m_count;
+        esp_partition_mmap_handle_t m_mmap;
+
+        const Entry *find(const char *path, size_t len) const;
+};
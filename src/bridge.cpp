@@ -0,0 +1,518 @@
+#include "bridge.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <sys/errno.h>
+#include <sys/param.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <nvs.h>
+
+#include "coalesce.h"
+#include "trace.h"
+#include "globals.h"
+
+static constexpr const char *TAG = "bridge";
+
+static constexpr const char *SCROLLBACK_NVS_NAMESPACE { "telnet" };
+static constexpr const char *SCROLLBACK_NVS_KEY { "scrollback" };
+static constexpr int32_t SCROLLBACK_ALL { -1 };
+
+// Lines replayed to new clients of every bridge, 0 disables replay
+static int32_t scrollback_lines { SCROLLBACK_ALL };
+
+
+static void load_scrollback()
+{
+    nvs_handle_t handle;
+    if (nvs_open(SCROLLBACK_NVS_NAMESPACE, NVS_READONLY, &handle)==ESP_OK) {
+        uint32_t value;
+        if (nvs_get_u32(handle, SCROLLBACK_NVS_KEY, &value)==ESP_OK) {
+            scrollback_lines = static_cast<int32_t>(value);
+        }
+        nvs_close(handle);
+    }
+}
+
+
+bool set_scrollback_lines(int32_t lines)
+{
+    nvs_handle_t handle;
+    auto res = nvs_open(SCROLLBACK_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+    res = nvs_set_u32(handle, SCROLLBACK_NVS_KEY, static_cast<uint32_t>(lines));
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS scrollback: err=%d", res);
+        nvs_close(handle);
+        return false;
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    scrollback_lines = lines;
+    return true;
+}
+
+
+static void on_window_size(uint16_t width, uint16_t height)
+{
+
+}
+
+
+static uint32_t average(uint64_t bytes, uint32_t count)
+{
+    return count ? bytes/count : 0;
+}
+
+
+Bridge::Bridge(const BridgeConfig &config) :
+    m_config { config },
+    m_serial { config.uart, config.tx_pin, config.rx_pin, GPIO_NUM_NC, GPIO_NUM_NC, config.serial_nvs_namespace },
+    m_telnet_server { config.telnet_port, false, config.telnet_nvs_key },
+    m_raw_server { config.raw_port, true, config.raw_nvs_key },
+    m_telnet_ring { config.ring_size, true },
+    m_raw_ring { config.ring_size, false },
+    m_clients { },
+    m_metrics { },
+    m_data_cb { nullptr },
+    m_controller { -1 },
+    m_paused { false },
+    m_running { false }
+{}
+
+
+bool Bridge::start()
+{
+    if (m_running) {
+        return true;
+    }
+    load_scrollback();
+    // Servers opened by an earlier attempt are kept
+    if ((m_telnet_server.fd()<0 && !m_telnet_server.start()) || (m_raw_server.fd()<0 && !m_raw_server.start())) {
+        return false;
+    }
+    if (m_telnet_server.fd()<0 && m_raw_server.fd()<0) {
+        ESP_LOGI(m_config.name, "Bridge disabled, no server port set");
+        return true;
+    }
+    if (!m_telnet_ring.start() || !m_raw_ring.start()) {
+        ESP_LOGE(m_config.name, "Unable to allocate client rings");
+        return false;
+    }
+    if (!m_serial.start()) {
+        return false;
+    }
+    g_reactor.add(m_serial.fd(), on_serial_event, this);
+    if (m_telnet_server.fd()>=0) {
+        g_reactor.add(m_telnet_server.fd(), on_server_event, this);
+    }
+    if (m_raw_server.fd()>=0) {
+        g_reactor.add(m_raw_server.fd(), on_server_event, this);
+    }
+    ESP_LOGI(m_config.name, "Bridge on UART %d, telnet port %u, raw port %u", m_config.uart, m_telnet_server.port(), m_raw_server.port());
+    m_running = true;
+    return true;
+}
+
+
+void Bridge::stop()
+{
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        if (m_clients[i]) {
+            close_client(i);
+        }
+    }
+    g_reactor.remove(m_raw_server.fd());
+    m_raw_server.stop();
+    g_reactor.remove(m_telnet_server.fd());
+    m_telnet_server.stop();
+    if (m_running) {
+        g_reactor.remove(m_serial.fd());
+        m_serial.stop();
+    }
+    m_running = false;
+}
+
+
+int Bridge::free_slot() const
+{
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        if (!m_clients[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+uint32_t Bridge::replay_start(const BroadcastRing &ring) const
+{
+    if (scrollback_lines==0) {
+        return ring.head();
+    }
+    if (scrollback_lines<0) {
+        return ring.sync_point(ring.oldest());
+    }
+    return ring.replay_start(scrollback_lines);
+}
+
+
+void Bridge::set_controller(int idx)
+{
+    m_controller = idx;
+    if (idx>=0) {
+        ESP_LOGI(m_config.name, "Client %d controls the serial port", idx);
+        m_clients[idx].set_serial(&m_serial);
+    }
+}
+
+
+void Bridge::close_client(int idx)
+{
+    ESP_LOGW(m_config.name, "Closing client %d", idx);
+    if (m_clients[idx].websocket()) {
+        // The socket is closed once the server has ended the session
+        g_web_terminal.close(m_clients[idx].fd());
+    }
+    else {
+        g_reactor.remove(m_clients[idx].fd());
+    }
+    m_clients[idx].close();
+    m_metrics.disconnects.add();
+    if (idx!=m_controller) {
+        return;
+    }
+
+    // Hand control to the next connected client
+    int next = -1;
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        if (m_clients[i]) {
+            next = i;
+            break;
+        }
+    }
+    set_controller(next);
+}
+
+
+void Bridge::set_nodelay(bool nodelay)
+{
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        if (m_clients[i]) {
+            m_clients[i].set_nodelay(nodelay);
+        }
+    }
+}
+
+
+void Bridge::print_client_stats() const
+{
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        auto &client = m_clients[i];
+        if (client) {
+            printf("%s client %u%s: %lu bytes in %lu sends, %lu bytes average, %lu dropped\n",
+                m_config.name, i, static_cast<int>(i)==m_controller ? " (controller)" : "",
+                client.sent(), client.segments(), client.segments() ? client.sent()/client.segments() : 0,
+                client.dropped());
+        }
+    }
+}
+
+
+void Bridge::flush()
+{
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        if (m_clients[i] && !m_clients[i].pump()) {
+            close_client(i);
+        }
+    }
+}
+
+
+void Bridge::notice(const char *text, size_t len)
+{
+    if (m_running) {
+        m_telnet_ring.append(reinterpret_cast<const uint8_t*>(text), len);
+    }
+}
+
+
+bool Bridge::on_serial_data()
+{
+    // Chunk size follows the receive profile for the current baud rate.
+    // The data is read straight into the raw ring, and encoded for telnet,
+    // captured and scanned from there.
+    size_t count = m_serial.read_chunk();
+    auto buf = m_raw_ring.reserve(count);
+    uint32_t stamp;
+    auto len = m_serial.read(buf, count, &stamp);
+    if (len<=0) {
+        return false;
+    }
+    m_raw_ring.commit(len);
+    m_raw_ring.stamp(stamp);
+    TRACE_D(TraceEvent::SERIAL_READ, m_config.uart, len);
+    m_metrics.serial_reads.add();
+    m_metrics.serial_read_bytes.add(len);
+    auto head = m_telnet_ring.head();
+    m_telnet_ring.append(buf, len);
+    // Every escape adds one byte to the telnet ring
+    m_metrics.iac_escapes.add(m_telnet_ring.head()-head-len);
+    m_telnet_ring.stamp(stamp);
+    if (m_data_cb) {
+        m_data_cb(buf, len);
+    }
+    bool due = g_coalescer.add(len, esp_timer_get_time());
+    if (m_controller>=0) {
+        m_clients[m_controller].poll_line_state();
+    }
+    return due;
+}
+
+
+void Bridge::client_input(int idx, const uint8_t *data, size_t len)
+{
+    m_metrics.client_reads.add();
+    m_metrics.client_read_bytes.add(len);
+    if (len>0 && idx==m_controller) {
+        TRACE_D(TraceEvent::CLIENT_READ, idx, len);
+        // The controller is only read while there is room for a full read
+        auto queued = m_serial.write(data, len);
+        m_metrics.serial_writes.add();
+        m_metrics.serial_write_bytes.add(queued);
+        if (queued<len) {
+            TRACE_W(TraceEvent::SERIAL_TX_FULL, idx, len-queued);
+        }
+    }
+}
+
+
+void Bridge::on_client_data(int idx)
+{
+    static uint8_t buf[CLIENT_READ_SIZE];
+    auto len = m_clients[idx].read(buf, sizeof(buf));
+    if (len<0) {
+        close_client(idx);
+        return;
+    }
+    client_input(idx, buf, len);
+}
+
+
+bool Bridge::add_client(int idx, BroadcastRing &ring)
+{
+    m_metrics.connects.add();
+    m_clients[idx].attach(&ring, replay_start(ring), &m_metrics);
+    m_clients[idx].set_nodelay(g_coalescer.nodelay());
+    if (m_controller<0) {
+        set_controller(idx);
+    }
+    // Send the replay now rather than with the next serial output
+    if (!m_clients[idx].pump()) {
+        close_client(idx);
+        return false;
+    }
+    return true;
+}
+
+
+void Bridge::on_connection(TelnetServer &server)
+{
+    TelnetConnection client;
+
+    if (!server.accept(client))
+        return;
+
+    int idx = free_slot();
+    if (idx<0) {
+        ESP_LOGW(m_config.name, "Telnet busy");
+        m_metrics.rejects.add();
+        // All client slots are taken - reject connection
+        const char msg[] = "Busy\n";
+        client.write((const uint8_t*)msg, strlen(msg));
+        client.close();
+        return;
+    }
+
+    ESP_LOGW(m_config.name, "Client %d connected", idx);
+    m_clients[idx] = client;
+    m_clients[idx].set_window_size_cb(on_window_size);
+    if (!g_reactor.add(m_clients[idx].fd(), on_client_event, this)) {
+        m_clients[idx].close();
+        return;
+    }
+    add_client(idx, m_clients[idx].raw() ? m_raw_ring : m_telnet_ring);
+}
+
+
+bool Bridge::open_websocket(int fd)
+{
+    int idx = free_slot();
+    if (idx<0) {
+        ESP_LOGW(m_config.name, "Web terminal busy");
+        m_metrics.rejects.add();
+        return false;
+    }
+    ESP_LOGW(m_config.name, "Client %d connected from the web terminal", idx);
+    m_clients[idx].attach_websocket(fd);
+    add_client(idx, m_raw_ring);
+    return true;
+}
+
+
+int Bridge::find_websocket(int fd) const
+{
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        if (m_clients[i] && m_clients[i].websocket() && m_clients[i].fd()==fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+void Bridge::update_events()
+{
+    if (!m_running) {
+        return;
+    }
+    // Viewers that fall behind skip ahead, but the controller must not
+    // lose data: leave it in the UART until the controller catches up.
+    // Once the serial buffers fill up, the UART flow control holds the target.
+    auto backlog = m_controller<0 ? 0 : m_clients[m_controller].backlog();
+    if (m_paused ? backlog <= m_config.ring_size/4 : backlog >= m_config.ring_size/2) {
+        m_paused = !m_paused;
+    }
+    g_reactor.set_events(m_serial.fd(), m_paused ? 0 : Reactor::READ);
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        auto &client = m_clients[i];
+        // WebSocket input is read by the HTTP server
+        if (!client || client.websocket()) {
+            continue;
+        }
+        uint8_t events = 0;
+        // Input from the controller waits in the socket while the UART transmit
+        // buffer is full, the serial fd wakes us up when there is room again.
+        if (static_cast<int>(i)!=m_controller || m_serial.write_space()>=CLIENT_READ_SIZE) {
+            events |= Reactor::READ;
+        }
+        // Only wait for room in the socket while the client is behind
+        if (client.blocked()) {
+            events |= Reactor::WRITE;
+        }
+        g_reactor.set_events(client.fd(), events);
+    }
+}
+
+
+void Bridge::on_serial_event(void *arg, int fd, uint8_t events)
+{
+    auto self = static_cast<Bridge*>(arg);
+    if (self->on_serial_data()) {
+        flush_clients();
+    }
+}
+
+
+void Bridge::on_server_event(void *arg, int fd, uint8_t events)
+{
+    auto self = static_cast<Bridge*>(arg);
+    self->on_connection(fd==self->m_telnet_server.fd() ? self->m_telnet_server : self->m_raw_server);
+}
+
+
+void Bridge::on_client_event(void *arg, int fd, uint8_t events)
+{
+    auto self = static_cast<Bridge*>(arg);
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        auto &client = self->m_clients[i];
+        if (!client || client.websocket() || client.fd()!=fd) {
+            continue;
+        }
+        if ((events & Reactor::WRITE) && !client.pump()) {
+            self->close_client(i);
+            return;
+        }
+        if (events & Reactor::READ) {
+            self->on_client_data(i);
+        }
+        return;
+    }
+}
+
+
+void Bridge::poll()
+{
+    if (m_running) {
+        m_serial.poll();
+    }
+}
+
+
+size_t Bridge::format_stats(char *buf, size_t size)
+{
+    const auto &m = m_metrics;
+    const auto &serial = m_serial.counters();
+    auto serial_read_bytes = m.serial_read_bytes.get();
+    auto send_bytes = m.send_bytes.get();
+    auto client_read_bytes = m.client_read_bytes.get();
+    auto serial_write_bytes = m.serial_write_bytes.get();
+    size_t clients_connected = 0;
+    for (size_t i=0; i<MAX_CLIENTS; i++) {
+        clients_connected += m_clients[i] ? 1 : 0;
+    }
+    auto to_client = m.serial_to_client_us.summary();
+    auto to_serial = m_serial.tx_latency().summary();
+
+    auto len = snprintf(buf, size,
+        "serial_read_bytes %llu\n"
+        "serial_reads %lu\n"
+        "serial_read_avg %lu\n"
+        "iac_escapes %lu\n"
+        "send_bytes %llu\n"
+        "sends %lu\n"
+        "send_avg %lu\n"
+        "short_sends %lu\n"
+        "blocked_us %llu\n"
+        "compress_in_bytes %llu\n"
+        "compress_out_bytes %llu\n"
+        "client_read_bytes %llu\n"
+        "client_reads %lu\n"
+        "client_read_avg %lu\n"
+        "serial_write_bytes %llu\n"
+        "serial_writes %lu\n"
+        "serial_write_avg %lu\n"
+        "fifo_overflows %lu\n"
+        "buffer_full %lu\n"
+        "frame_errors %lu\n"
+        "parity_errors %lu\n"
+        "connects %lu\n"
+        "rejects %lu\n"
+        "disconnects %lu\n"
+        "clients %u\n"
+        "serial_to_client_samples %lu\n"
+        "serial_to_client_p50_us %lu\n"
+        "serial_to_client_p90_us %lu\n"
+        "serial_to_client_p99_us %lu\n"
+        "serial_to_client_max_us %lu\n"
+        "client_to_serial_samples %lu\n"
+        "client_to_serial_p50_us %lu\n"
+        "client_to_serial_p90_us %lu\n"
+        "client_to_serial_p99_us %lu\n"
+        "client_to_serial_max_us %lu\n",
+        serial_read_bytes, m.serial_reads.get(), average(serial_read_bytes, m.serial_reads.get()),
+        m.iac_escapes.get(),
+        send_bytes, m.sends.get(), average(send_bytes, m.sends.get()),
+        m.short_sends.get(), m.blocked_us.get(),
+        m.compress_in_bytes.get(), m.compress_out_bytes.get(),
+        client_read_bytes, m.client_reads.get(), average(client_read_bytes, m.client_reads.get()),
+        serial_write_bytes, m.serial_writes.get(), average(serial_write_bytes, m.serial_writes.get()),
+        serial.fifo_overflows, serial.buffer_full, serial.frame_errors, serial.parity_errors,
+        m.connects.get(), m.rejects.get(), m.disconnects.get(), clients_connected,
+        to_client.count, to_client.p50, to_client.p90, to_client.p99, to_client.max,
+        to_serial.count, to_serial.p50, to_serial.p90, to_serial.p99, to_serial.max);
+    return len<0 ? 0 : len;
+}
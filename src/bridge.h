@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <driver/uart.h>
+#include <driver/gpio.h>
+
+#include "serial.h"
+#include "telnet.h"
+#include "broadcast.h"
+#include "metrics.h"
+
+
+/** One UART served on the network, an entry of the bridge table in main.cpp */
+struct BridgeConfig {
+    // Log tag, and the prefix of the bridge's keys in the stats output
+    const char *name;
+    uart_port_t uart;
+    gpio_num_t tx_pin;
+    gpio_num_t rx_pin;
+    // Serial settings of each UART are kept apart
+    const char *serial_nvs_namespace;
+    // Server ports, 0 disables. An NVS key lets set_port() change the port
+    uint16_t telnet_port;
+    const char *telnet_nvs_key;
+    uint16_t raw_port;
+    const char *raw_nvs_key;
+    // Scrollback of the bridge, and the backlog the controller may build up. A power of two
+    size_t ring_size;
+};
+
+
+/**
+ * A UART and everything serving it: the telnet and raw servers, the rings
+ * the serial output is broadcast from, the client sessions with the one
+ * that controls the port, and the data path metrics.
+ *
+ * All bridges run in the event loop of app_main: start() registers the
+ * descriptors of a bridge with g_reactor, and update_events() sets what
+ * each waits for after every pass. Output coalescing is shared, so a flush
+ * sends the held output of every bridge. Log lines of a bridge are tagged
+ * with its name.
+ */
+class Bridge {
+    public:
+        static constexpr size_t MAX_CLIENTS { 8 };
+        static constexpr size_t CLIENT_READ_SIZE { 256 };
+
+        typedef void (*data_cb_t)(const uint8_t *data, size_t len);
+
+        explicit Bridge(const BridgeConfig &config);
+
+        /** Start the servers, then the rings and the UART unless both servers are disabled */
+        bool start();
+        void stop();
+        /** A server is listening and the UART is open */
+        bool running() const { return m_running; }
+        const char *name() const { return m_config.name; }
+
+        /** Update the events the serial port and the clients wait for, after a loop pass */
+        void update_events();
+        /** Send all pending ring data the client sockets take */
+        void flush();
+        /** Called on every loop iteration */
+        void poll();
+
+        /** Take a WebSocket session the HTTP server accepted as a client, false when all slots are taken */
+        bool open_websocket(int fd);
+        int find_websocket(int fd) const;
+        /** Data from client idx, only the controller's goes to the UART */
+        void client_input(int idx, const uint8_t *data, size_t len);
+        void close_client(int idx);
+
+        /** Text for the telnet clients only, raw clients just get the serial bytes */
+        void notice(const char *text, size_t len);
+        /** Called with every chunk of serial output, for capture and triggers */
+        void set_data_cb(data_cb_t cb) { m_data_cb = cb; }
+
+        /** Apply TCP_NODELAY to the connected clients */
+        void set_nodelay(bool nodelay);
+        /** Print send statistics of the connected clients to stdout */
+        void print_client_stats() const;
+        /** Format the metrics as text, returns the length like snprintf() */
+        size_t format_stats(char *buf, size_t size);
+
+        Serial &serial() { return m_serial; }
+        TelnetServer &telnet_server() { return m_telnet_server; }
+        TelnetServer &raw_server() { return m_raw_server; }
+        BridgeMetrics &metrics() { return m_metrics; }
+
+    private:
+        const BridgeConfig &m_config;
+        Serial m_serial;
+        TelnetServer m_telnet_server;
+        TelnetServer m_raw_server;
+        // Serial output is encoded once per protocol and shared by all clients
+        BroadcastRing m_telnet_ring;
+        BroadcastRing m_raw_ring;
+        TelnetConnection m_clients[MAX_CLIENTS];
+        BridgeMetrics m_metrics;
+        data_cb_t m_data_cb;
+        // Only the controlling client writes to the serial port, the rest are read-only viewers
+        int m_controller;
+        // Serial output is left in the serial buffers until the controller catches up
+        bool m_paused;
+        bool m_running;
+
+        int free_slot() const;
+        uint32_t replay_start(const BroadcastRing &ring) const;
+        void set_controller(int idx);
+        bool add_client(int idx, BroadcastRing &ring);
+        void on_connection(TelnetServer &server);
+        bool on_serial_data();
+        void on_client_data(int idx);
+
+        static void on_serial_event(void *arg, int fd, uint8_t events);
+        static void on_server_event(void *arg, int fd, uint8_t events);
+        static void on_client_event(void *arg, int fd, uint8_t events);
+};
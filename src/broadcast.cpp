@@ -0,0 +1,145 @@
+#include "broadcast.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+
+#include "scan.h"
+
+static constexpr const char* TAG = "broadcast";
+
+static constexpr uint8_t IAC { 0xff };
+
+
+bool BroadcastRing::start()
+{
+    if ((m_size & (m_size-1))!=0) {
+        ESP_LOGE(TAG, "Ring size %u is not a power of two", m_size);
+        return false;
+    }
+    if (!m_buf) {
+        m_buf = static_cast<uint8_t*>(malloc(m_size));
+        if (!m_buf) {
+            ESP_LOGE(TAG, "Unable to allocate %u byte ring", m_size);
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void BroadcastRing::put(const uint8_t *data, size_t count)
+{
+    if (count>m_size) {
+        // Only the tail survives
+        m_head += count-m_size;
+        data += count-m_size;
+        count = m_size;
+    }
+
+    size_t offset = m_head & (m_size-1);
+    size_t first = count < m_size-offset ? count : m_size-offset;
+    memcpy(m_buf+offset, data, first);
+    if (count>first) {
+        memcpy(m_buf, data+first, count-first);
+    }
+    commit(count);
+}
+
+
+uint8_t *BroadcastRing::reserve(size_t &count)
+{
+    size_t offset = m_head & (m_size-1);
+    if (count>m_size-offset) {
+        count = m_size-offset;
+    }
+    return m_buf+offset;
+}
+
+
+void BroadcastRing::commit(size_t count)
+{
+    m_head += count;
+    m_fill = m_fill+count < m_size ? m_fill+count : m_size;
+}
+
+
+void BroadcastRing::append(const uint8_t *data, size_t count)
+{
+    if (!m_escape) {
+        put(data, count);
+        return;
+    }
+
+    static const uint8_t IAC_PAIR[] { IAC, IAC };
+    const uint8_t *end = data+count;
+    while (data<end) {
+        auto run = scan_iac(data, end-data);
+        put(data, run);
+        data += run;
+        if (data<end) {
+            put(IAC_PAIR, sizeof(IAC_PAIR));
+            data++;
+        }
+    }
+}
+
+
+void BroadcastRing::stamp(uint32_t time_us)
+{
+    m_stamp_end[m_stamp_next] = m_head;
+    m_stamp_time[m_stamp_next] = time_us;
+    m_stamp_next = (m_stamp_next+1) % STAMP_COUNT;
+}
+
+
+size_t BroadcastRing::peek(uint32_t pos, struct iovec iov[2]) const
+{
+    size_t count = m_head - pos;
+    if (count==0 || count>m_fill) {
+        return 0;
+    }
+
+    size_t offset = pos & (m_size-1);
+    size_t first = count < m_size-offset ? count : m_size-offset;
+    iov[0] = { m_buf+offset, first };
+    if (count>first) {
+        iov[1] = { m_buf, count-first };
+        return 2;
+    }
+    return 1;
+}
+
+
+uint32_t BroadcastRing::sync_point(uint32_t pos) const
+{
+    if (!m_escape) {
+        return pos;
+    }
+    // A position right after a byte other than 0xFF is always on a boundary.
+    // Once the ring has wrapped the byte before the oldest one is gone, so
+    // that position is unknown.
+    auto first = oldest();
+    bool wrapped = m_fill==m_size;
+    for (; pos!=m_head; pos++) {
+        if (pos==first ? !wrapped : at(pos-1)!=IAC) {
+            return pos;
+        }
+    }
+    return pos;
+}
+
+
+uint32_t BroadcastRing::replay_start(size_t lines) const
+{
+    // A line feed is never part of an escape, so the byte after it is a boundary.
+    // The newline ending the last line doesn't start a line of its own.
+    auto first = oldest();
+    size_t count = 0;
+    for (auto pos=m_head; pos!=first; pos--) {
+        if (at(pos-1)=='\n' && pos!=m_head && ++count==lines) {
+            return pos;
+        }
+    }
+    return sync_point(first);
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>
+
+
+/**
+ * Fixed size ring holding the most recent serial output for all sessions.
+ *
+ * Data is written once and every session sends straight out of the ring
+ * from its own cursor. An escaped ring stores the telnet encoding (0xFF
+ * doubled), so encoding is done once no matter how many clients read it.
+ *
+ * Positions are absolute byte counts that wrap at 2^32; the size must be a
+ * power of two.
+ */
+class BroadcastRing {
+    public:
+        constexpr BroadcastRing(size_t size, bool escape) :
+            m_size { size },
+            m_escape { escape },
+            m_buf { nullptr },
+            m_head { 0 },
+            m_fill { 0 },
+            m_stamp_end { },
+            m_stamp_time { },
+            m_stamp_next { 0 }
+        {}
+
+        bool start();
+
+        void append(const uint8_t *data, size_t count);
+        /**
+         * Room at head to write up to count bytes in place, count is cut to
+         * where the buffer wraps. commit() appends what was written. Only for
+         * rings without escaping, the room holds the oldest data until then.
+         */
+        uint8_t *reserve(size_t &count);
+        void commit(size_t count);
+        /** Record that the data appended up to head arrived at time_us */
+        void stamp(uint32_t time_us);
+        /** Call fn(end, time_us) for the recent stamped chunks that end after from and at or before to */
+        template<typename F>
+        void stamped(uint32_t from, uint32_t to, F fn) const
+        {
+            for (size_t i=0; i<STAMP_COUNT; i++) {
+                if (m_stamp_end[i]-from-1 < to-from) {
+                    fn(m_stamp_end[i], m_stamp_time[i]);
+                }
+            }
+        }
+
+        bool escaped() const { return m_escape; }
+        uint32_t head() const { return m_head; }
+        uint32_t oldest() const { return m_head - m_fill; }
+
+        /** True if the data from pos up to head is still held in the ring */
+        bool valid(uint32_t pos) const { return m_head - pos <= m_fill; }
+
+        uint8_t at(uint32_t pos) const { return m_buf[pos & (m_size-1)]; }
+
+        /** Fill iov with the (up to two) spans from pos to head, returns the span count */
+        size_t peek(uint32_t pos, struct iovec iov[2]) const;
+
+        /** First position at or after pos where a client can start reading without splitting an escaped 0xFF */
+        uint32_t sync_point(uint32_t pos) const;
+
+        /** Start of the last lines lines held in the ring, or of everything it holds if there are fewer */
+        uint32_t replay_start(size_t lines) const;
+
+    private:
+        // Chunk arrival times are only kept for the most recent chunks
+        static constexpr size_t STAMP_COUNT { 32 };
+
+        const size_t m_size;
+        const bool m_escape;
+        uint8_t *m_buf;
+        uint32_t m_head;
+        size_t m_fill;
+        uint32_t m_stamp_end[STAMP_COUNT];
+        uint32_t m_stamp_time[STAMP_COUNT];
+        size_t m_stamp_next;
+
+        void put(const uint8_t *data, size_t count);
+};
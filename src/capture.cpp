@@ -0,0 +1,444 @@
+#include "capture.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <esp_log.h>
+#include <nvs.h>
+
+
+static constexpr const char* TAG = "capture";
+
+static constexpr const char *CAPTURE_NVS_NAMESPACE { "capture" };
+static constexpr const char *CAPTURE_NVS_ENABLED   { "enabled" };
+
+static constexpr size_t   CAPTURE_SECTOR_SIZE { 4096 };
+static constexpr uint32_t CAPTURE_MAGIC { 0x4a435357 }; // "WSCJ"
+
+// A record is closed when it is full, has been open this long, or the line has been idle
+static constexpr uint32_t CAPTURE_RECORD_SPAN_MS { 100 };
+static constexpr uint32_t CAPTURE_RECORD_IDLE_MS { 20 };
+// The writer programs what it has at least this often, and sooner once a sector worth is queued
+static constexpr uint32_t CAPTURE_FLUSH_MS { 1000 };
+static constexpr size_t   CAPTURE_FLUSH_BYTES { CAPTURE_SECTOR_SIZE };
+
+static constexpr uint32_t CAPTURE_TASK_STACK { 3072 };
+static constexpr UBaseType_t CAPTURE_TASK_PRIORITY { tskIDLE_PRIORITY+1 };
+
+
+struct SectorHeader {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t boot;
+    uint32_t reserved;
+};
+
+// Erased flash reads as a record with len 0xffff, which ends the sector
+struct RecordHeader {
+    uint16_t len;
+    uint16_t check;
+    uint32_t time;
+};
+
+// Set in len for a mark: the record holds a note instead of serial data
+static constexpr uint16_t RECORD_MARK { 0x8000 };
+static constexpr uint16_t RECORD_LEN_MASK { 0x7fff };
+
+
+static inline size_t record_size(size_t len)
+{
+    len &= RECORD_LEN_MASK;
+    return sizeof(RecordHeader) + ((len+3) & ~3);
+}
+
+
+static inline uint32_t now_ms()
+{
+    return xTaskGetTickCount()*portTICK_PERIOD_MS;
+}
+
+
+
+bool Capture::start()
+{
+    m_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, m_label);
+    if (!m_partition) {
+        ESP_LOGE(TAG, "Partition '%s' not found", m_label);
+        return false;
+    }
+    m_sectors = m_partition->size / CAPTURE_SECTOR_SIZE;
+
+    m_fifo = static_cast<uint8_t*>(malloc(FIFO_SIZE));
+    m_image = static_cast<uint8_t*>(malloc(CAPTURE_SECTOR_SIZE));
+    if (!m_fifo || !m_image) {
+        ESP_LOGE(TAG, "Unable to allocate capture buffers");
+        free(m_fifo);
+        free(m_image);
+        m_fifo = nullptr;
+        m_image = nullptr;
+        return false;
+    }
+
+    recover();
+
+    nvs_handle_t handle;
+    if (nvs_open(CAPTURE_NVS_NAMESPACE, NVS_READONLY, &handle)==ESP_OK) {
+        uint32_t value;
+        if (nvs_get_u32(handle, CAPTURE_NVS_ENABLED, &value)==ESP_OK) {
+            m_enabled = value!=0;
+        }
+        nvs_close(handle);
+    }
+
+    if (xTaskCreate(task, "capture", CAPTURE_TASK_STACK, this, CAPTURE_TASK_PRIORITY, &m_task)!=pdPASS) {
+        ESP_LOGE(TAG, "Unable to create capture task");
+        m_enabled = false;
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Capture %s, %u sectors in '%s', boot %lu", m_enabled ? "enabled" : "disabled", m_sectors, m_label, m_boot);
+    return true;
+}
+
+
+/**
+ * Find the newest sector, writing continues after it.
+ */
+void Capture::recover()
+{
+    bool found = false;
+    SectorHeader newest { };
+    size_t newest_sector = 0;
+
+    for (size_t sector=0; sector<m_sectors; sector++) {
+        SectorHeader header;
+        if (esp_partition_read(m_partition, sector*CAPTURE_SECTOR_SIZE, &header, sizeof(header))!=ESP_OK) {
+            continue;
+        }
+        if (header.magic!=CAPTURE_MAGIC) {
+            continue;
+        }
+        if (!found || static_cast<int32_t>(header.seq-newest.seq) > 0) {
+            found = true;
+            newest = header;
+            newest_sector = sector;
+        }
+    }
+
+    if (found) {
+        m_sector = newest_sector;
+        m_seq = newest.seq+1;
+        m_boot = newest.boot+1;
+    }
+    else {
+        m_sector = m_sectors-1;
+        m_seq = 1;
+        m_boot = 1;
+    }
+    m_image_len = 0;
+    m_programmed = 0;
+}
+
+
+bool Capture::set_enabled(bool enable)
+{
+    nvs_handle_t handle;
+    auto res = nvs_open(CAPTURE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+    res = nvs_set_u32(handle, CAPTURE_NVS_ENABLED, enable);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS capture state: err=%d", res);
+        nvs_close(handle);
+        return false;
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+
+    m_enabled = enable && m_task;
+    return true;
+}
+
+
+void Capture::write(const uint8_t *data, size_t count)
+{
+    if (!m_enabled) {
+        return;
+    }
+
+    auto now = now_ms();
+    while (count>0) {
+        if (m_record_len==RECORD_MAX || (m_record_len && now-m_record_time >= CAPTURE_RECORD_SPAN_MS)) {
+            close_record();
+        }
+        if (m_record_len==0) {
+            m_record_time = now;
+        }
+        auto len = count < RECORD_MAX-m_record_len ? count : RECORD_MAX-m_record_len;
+        memcpy(m_record_buf+m_record_len, data, len);
+        m_record_len += len;
+        data += len;
+        count -= len;
+    }
+    m_last_time = now;
+}
+
+
+void Capture::poll()
+{
+    if (m_record_len && now_ms()-m_last_time >= CAPTURE_RECORD_IDLE_MS) {
+        close_record();
+    }
+}
+
+
+int64_t Capture::wait() const
+{
+    if (!m_record_len) {
+        return -1;
+    }
+    uint32_t idle = now_ms()-m_last_time;
+    return idle>=CAPTURE_RECORD_IDLE_MS ? 0 : static_cast<int64_t>(CAPTURE_RECORD_IDLE_MS-idle)*1000;
+}
+
+
+void Capture::mark(const char *text)
+{
+    if (!m_enabled) {
+        return;
+    }
+    // The mark goes after the data that led to it
+    if (m_record_len) {
+        close_record();
+    }
+    auto len = strnlen(text, MARK_MAX);
+    queue_record(reinterpret_cast<const uint8_t*>(text), len | RECORD_MARK, now_ms());
+}
+
+
+void Capture::close_record()
+{
+    if (queue_record(m_record_buf, m_record_len, m_record_time)) {
+        m_captured += m_record_len;
+    }
+    else {
+        m_dropped += m_record_len;
+    }
+    m_record_len = 0;
+}
+
+
+bool Capture::queue_record(const uint8_t *data, uint16_t len, uint32_t time)
+{
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto tail = m_tail.load(std::memory_order_acquire);
+    auto size = record_size(len);
+
+    if (FIFO_SIZE-(head-tail) < size) {
+        return false;
+    }
+
+    RecordHeader header {
+        len,
+        static_cast<uint16_t>(~len),
+        time
+    };
+    // Padding bytes are left as they are, the reader skips them
+    const uint8_t *parts[] { reinterpret_cast<const uint8_t*>(&header), data };
+    const size_t lens[] { sizeof(header), static_cast<size_t>(len & RECORD_LEN_MASK) };
+    auto pos = head;
+    for (size_t i=0; i<2; i++) {
+        auto offset = pos & (FIFO_SIZE-1);
+        auto first = lens[i] < FIFO_SIZE-offset ? lens[i] : FIFO_SIZE-offset;
+        memcpy(m_fifo+offset, parts[i], first);
+        memcpy(m_fifo, parts[i]+first, lens[i]-first);
+        pos += lens[i];
+    }
+    m_head.store(head+size, std::memory_order_release);
+
+    if (head+size-tail >= CAPTURE_FLUSH_BYTES && head-tail < CAPTURE_FLUSH_BYTES) {
+        xTaskNotifyGive(m_task);
+    }
+    return true;
+}
+
+
+void Capture::fifo_copy(uint32_t pos, void *dst, size_t len) const
+{
+    auto offset = pos & (FIFO_SIZE-1);
+    auto first = len < FIFO_SIZE-offset ? len : FIFO_SIZE-offset;
+    memcpy(dst, m_fifo+offset, first);
+    memcpy(static_cast<uint8_t*>(dst)+first, m_fifo, len-first);
+}
+
+
+void Capture::program()
+{
+    if (m_image_len==m_programmed) {
+        return;
+    }
+    auto res = esp_partition_write(m_partition, m_sector*CAPTURE_SECTOR_SIZE + m_programmed, m_image+m_programmed, m_image_len-m_programmed);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error writing sector %u: err=%d", m_sector, res);
+    }
+    m_programmed = m_image_len;
+}
+
+
+/**
+ * Move queued records into the sector image. A sector is erased when the
+ * first record goes into it, and programmed when it is full or the queue
+ * has run dry.
+ */
+void Capture::flush()
+{
+    auto tail = m_tail.load(std::memory_order_relaxed);
+    while (true) {
+        auto head = m_head.load(std::memory_order_acquire);
+        if (tail==head) {
+            break;
+        }
+
+        RecordHeader header;
+        fifo_copy(tail, &header, sizeof(header));
+        auto size = record_size(header.len);
+
+        if (m_image_len && m_image_len+size > CAPTURE_SECTOR_SIZE) {
+            program();
+            m_image_len = 0;
+        }
+        if (m_image_len==0) {
+            m_sector = (m_sector+1) % m_sectors;
+            auto res = esp_partition_erase_range(m_partition, m_sector*CAPTURE_SECTOR_SIZE, CAPTURE_SECTOR_SIZE);
+            if (res!=ESP_OK) {
+                ESP_LOGE(TAG, "Error erasing sector %u: err=%d", m_sector, res);
+            }
+            SectorHeader sector { CAPTURE_MAGIC, m_seq++, m_boot, 0xffffffff };
+            memcpy(m_image, &sector, sizeof(sector));
+            m_image_len = sizeof(sector);
+            m_programmed = 0;
+        }
+
+        fifo_copy(tail, m_image+m_image_len, size);
+        m_image_len += size;
+        tail += size;
+        m_tail.store(tail, std::memory_order_release);
+    }
+    program();
+}
+
+
+void Capture::task(void *arg)
+{
+    auto self = static_cast<Capture*>(arg);
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(CAPTURE_FLUSH_MS));
+        self->flush();
+    }
+}
+
+
+void Capture::info() const
+{
+    auto head = m_head.load(std::memory_order_relaxed);
+    auto tail = m_tail.load(std::memory_order_relaxed);
+
+    printf("Capture:   %s\n", m_enabled ? "enabled" : "disabled");
+    printf("Partition: %s, %u sectors of %u bytes\n", m_label, m_sectors, CAPTURE_SECTOR_SIZE);
+    printf("Boot:      %lu, up %lu s\n", m_boot, now_ms()/1000);
+    printf("Sector:    %u, sequence %lu\n", m_sector, m_seq-1);
+    printf("Captured:  %lu bytes\n", m_captured);
+    printf("Dropped:   %lu bytes\n", m_dropped);
+    printf("Queued:    %lu bytes\n", head-tail);
+}
+
+
+void Capture::dump(size_t kbytes) const
+{
+    if (!m_partition || m_seq<=1) {
+        printf("Nothing captured\n");
+        return;
+    }
+
+    // Walk back from the newest sector as long as the sequence is unbroken.
+    // The sector after the newest may be erased at any time, so stop short of it.
+    auto newest = m_sector;
+    auto seq = m_seq-1;
+    size_t wanted = (kbytes*1024 + CAPTURE_SECTOR_SIZE-1) / CAPTURE_SECTOR_SIZE;
+    size_t count = 1;
+    while (count<wanted && count<m_sectors-1) {
+        SectorHeader header;
+        auto sector = (newest+m_sectors-count) % m_sectors;
+        if (esp_partition_read(m_partition, sector*CAPTURE_SECTOR_SIZE, &header, sizeof(header))!=ESP_OK) {
+            break;
+        }
+        if (header.magic!=CAPTURE_MAGIC || header.seq!=seq-count) {
+            break;
+        }
+        count++;
+    }
+
+    bool line_start = true;
+    for (size_t i=count; i>0; i--) {
+        auto sector = (newest+m_sectors-i+1) % m_sectors;
+        auto base = sector*CAPTURE_SECTOR_SIZE;
+        SectorHeader header;
+        if (esp_partition_read(m_partition, base, &header, sizeof(header))!=ESP_OK || header.magic!=CAPTURE_MAGIC) {
+            continue;
+        }
+
+        size_t offset = sizeof(header);
+        while (offset+sizeof(RecordHeader) <= CAPTURE_SECTOR_SIZE) {
+            RecordHeader record;
+            if (esp_partition_read(m_partition, base+offset, &record, sizeof(record))!=ESP_OK) {
+                break;
+            }
+            if (static_cast<uint16_t>(~record.len)!=record.check || record_size(record.len) > CAPTURE_SECTOR_SIZE-offset) {
+                break;
+            }
+
+            size_t record_len = record.len & RECORD_LEN_MASK;
+            if (record.len & RECORD_MARK) {
+                char text[MARK_MAX+1] { };
+                esp_partition_read(m_partition, base+offset+sizeof(record), text, record_len<=MARK_MAX ? record_len : MARK_MAX);
+                printf("%s[%lu %lu.%03lu] *** %s ***\n", line_start ? "" : "\n",
+                    header.boot, record.time/1000, record.time%1000, text);
+                line_start = true;
+                offset += record_size(record.len);
+                continue;
+            }
+
+            uint8_t buf[64];
+            for (size_t pos=0; pos<record_len; pos+=sizeof(buf)) {
+                auto len = record_len-pos < sizeof(buf) ? record_len-pos : sizeof(buf);
+                if (esp_partition_read(m_partition, base+offset+sizeof(record)+pos, buf, len)!=ESP_OK) {
+                    break;
+                }
+                for (size_t j=0; j<len; j++) {
+                    auto ch = buf[j];
+                    if (line_start) {
+                        printf("[%lu %lu.%03lu] ", header.boot, record.time/1000, record.time%1000);
+                        line_start = false;
+                    }
+                    if (ch=='\n') {
+                        putchar('\n');
+                        line_start = true;
+                    }
+                    else if (isprint(ch) || ch=='\t') {
+                        putchar(ch);
+                    }
+                    else if (ch!='\r') {
+                        printf("\\x%02x", ch);
+                    }
+                }
+            }
+            offset += record_size(record.len);
+        }
+    }
+    if (!line_start) {
+        putchar('\n');
+    }
+}
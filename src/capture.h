@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_partition.h>
+
+
+/**
+ * Journal of serial output in a flash data partition.
+ *
+ * The partition is used as a circular log of sectors. Each sector starts
+ * with a header holding an increasing sequence number and the boot count,
+ * followed by records of serial data stamped with the milliseconds since
+ * boot. The bridge loop only copies data into RAM; a low priority task
+ * erases each sector once and programs it in batches.
+ */
+class Capture {
+    public:
+        constexpr Capture(const char *label) :
+            m_label { label },
+            m_partition { nullptr },
+            m_enabled { false },
+            m_task { nullptr },
+            m_fifo { nullptr },
+            m_head { 0 },
+            m_tail { 0 },
+            m_record_buf { },
+            m_record_len { 0 },
+            m_record_time { 0 },
+            m_last_time { 0 },
+            m_image { nullptr },
+            m_image_len { 0 },
+            m_programmed { 0 },
+            m_sector { 0 },
+            m_sectors { 0 },
+            m_seq { 0 },
+            m_boot { 0 },
+            m_captured { 0 },
+            m_dropped { 0 }
+        {}
+
+        bool start();
+
+        /** Append serial data, never blocks. Data is dropped if the flash can't keep up */
+        void write(const uint8_t *data, size_t count);
+        /** Close the current record once the serial line has been idle for a while */
+        void poll();
+        /** Microseconds until poll() closes the current record, -1 if there is none */
+        int64_t wait() const;
+        /** Note an event between the data written so far and what follows, shown by dump() */
+        void mark(const char *text);
+
+        bool enabled() const { return m_enabled; }
+        /** Turn capture on or off, the setting is stored in NVS */
+        bool set_enabled(bool enable);
+
+        /** Print capture state to stdout */
+        void info() const;
+        /** Print the last kbytes of captured data to stdout, each line prefixed with its time */
+        void dump(size_t kbytes) const;
+
+    private:
+        static constexpr size_t RECORD_MAX { 1024 };
+        static constexpr size_t FIFO_SIZE { 16384 };
+        static constexpr size_t MARK_MAX { 160 };
+
+        const char *m_label;
+        const esp_partition_t *m_partition;
+        bool m_enabled;
+        TaskHandle_t m_task;
+
+        // Records waiting for the writer task, the bridge loop owns m_head and the task m_tail
+        uint8_t *m_fifo;
+        std::atomic<uint32_t> m_head;
+        std::atomic<uint32_t> m_tail;
+
+        // Record being filled by the bridge loop
+        uint8_t m_record_buf[RECORD_MAX];
+        size_t m_record_len;
+        uint32_t m_record_time;
+        uint32_t m_last_time;
+
+        // Sector being filled by the writer task
+        uint8_t *m_image;
+        size_t m_image_len;
+        size_t m_programmed;
+        size_t m_sector;
+        size_t m_sectors;
+        uint32_t m_seq;
+        uint32_t m_boot;
+
+        uint32_t m_captured;
+        uint32_t m_dropped;
+
+        void recover();
+        void close_record();
+        bool queue_record(const uint8_t *data, uint16_t len, uint32_t time);
+        void fifo_copy(uint32_t pos, void *dst, size_t len) const;
+        void flush();
+        void program();
+        static void task(void *arg);
+};
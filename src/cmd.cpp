@@ -1,5 +1,7 @@
 #include "cmd.h"
 
+#include <string.h>
+#include <stdlib.h>
 #include <freertos/FreeRTOS.h>
 #include <esp_log.h>
 #include <esp_console.h>
@@ -8,10 +10,66 @@
 
 #include "wifi.h"
 #include "globals.h"
+#include "trace.h"
 
 static constexpr const char *TAG = "cmd";
 
 
+/** -------------------------------------------------------------------------------
+ * Bridge selection
+ */
+
+// Serial, port and latency commands apply to the selected bridge
+static size_t selected_bridge = 0;
+
+static Bridge &bridge()
+{
+    return g_bridges[selected_bridge];
+}
+
+static struct {
+    struct arg_str *name;
+    struct arg_end *end;
+} bridge_select_args;
+
+static int bridge_select_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &bridge_select_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, bridge_select_args.end, argv[0]);
+        return 1;
+    }
+
+    const char *name = bridge_select_args.name->sval[0];
+    for (size_t i=0; i<BRIDGE_COUNT; i++) {
+        if (strcmp(g_bridges[i].name(), name)==0) {
+            selected_bridge = i;
+            ESP_LOGI(TAG, "Selected bridge %s", name);
+            return 0;
+        }
+    }
+    ESP_LOGE(TAG, "Unknown bridge %s", name);
+    for (const auto &bridge : g_bridges) {
+        printf("%s\n", bridge.name());
+    }
+    return 1;
+}
+
+static void register_bridge_select()
+{
+    bridge_select_args.name = arg_str1(nullptr, nullptr, "<name>", "Bridge name, uart1 or uart0");
+    bridge_select_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "bridge_select",
+        .help = "Select the bridge serial, port and latency commands apply to",
+        .hint = nullptr,
+        .func = bridge_select_cmd,
+        .argtable = &bridge_select_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
 /** -------------------------------------------------------------------------------
  * Serial settings
  */
@@ -36,7 +94,7 @@ static int serial_set_baud_cmd(int argc, char **argv) {
 
     ESP_LOGI(TAG, "Set serial baud to %d", baud);
 
-    if (!g_serial.set_baud(baud)) {
+    if (!bridge().serial().set_baud(baud)) {
         ESP_LOGI(TAG, "Set serial baud failed");
         return 1;
     }
@@ -62,7 +120,7 @@ static void register_serial_set_baud()
 
 
 static int serial_restore_cmd(int argc, char **argv) {
-    if (!g_serial.restore()) {
+    if (!bridge().serial().restore()) {
         ESP_LOGW(TAG, "Serial restore command failed");
         return 1;
     }
@@ -84,6 +142,978 @@ static void register_serial_restore()
 
 
 
+static int serial_stats_cmd(int argc, char **argv) {
+    const auto &counters = bridge().serial().counters();
+    printf("Receive path:    %s\n", bridge().serial().rx_dma() ? "DMA" : "UART driver");
+    printf("Profile:         %s, %u byte reads\n", bridge().serial().profile()==Serial::Profile::THROUGHPUT ? "throughput" : "latency", bridge().serial().read_chunk());
+    printf("Received:        %lu bytes\n", counters.rx_bytes);
+    printf("Transmitted:     %lu bytes%s\n", counters.tx_bytes, bridge().serial().tx_done() ? "" : ", sending");
+    printf("FIFO overflows:  %lu\n", counters.fifo_overflows);
+    printf("Buffer full:     %lu\n", counters.buffer_full);
+    printf("Framing errors:  %lu\n", counters.frame_errors);
+    printf("Parity errors:   %lu\n", counters.parity_errors);
+    printf("Breaks:          %lu\n", counters.breaks);
+    printf("Throttled:       %lu times%s\n", counters.throttles, bridge().serial().throttled() ? ", now" : "");
+    return 0;
+}
+
+static void register_serial_stats()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "serial_stats",
+        .help = "Show UART receive counters",
+        .hint = nullptr,
+        .func = &serial_stats_cmd,
+        .argtable = nullptr,
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static struct {
+    struct arg_str *profile;
+    struct arg_end *end;
+} profile_args;
+
+static int serial_profile_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &profile_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, profile_args.end, argv[0]);
+        return 1;
+    }
+
+    Serial::Profile profile;
+    auto name = profile_args.profile->sval[0];
+    if (strcmp(name, "latency")==0) {
+        profile = Serial::Profile::LATENCY;
+    }
+    else if (strcmp(name, "throughput")==0) {
+        profile = Serial::Profile::THROUGHPUT;
+    }
+    else {
+        ESP_LOGE(TAG, "Unknown profile '%s'", name);
+        return 1;
+    }
+
+    if (!bridge().serial().set_profile(profile)) {
+        ESP_LOGW(TAG, "Set serial profile failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Serial profile set to %s", name);
+    return 0;
+}
+
+static void register_serial_profile()
+{
+    profile_args.profile = arg_str1(nullptr, nullptr, "<latency|throughput>", "Receive profile");
+    profile_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "serial_profile",
+        .help = "Tune UART receive interrupts for latency or throughput, the driver buffer size applies after restart",
+        .hint = nullptr,
+        .func = serial_profile_cmd,
+        .argtable = &profile_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static struct {
+    struct arg_str *flow;
+    struct arg_end *end;
+} flow_args;
+
+static int serial_flow_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &flow_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, flow_args.end, argv[0]);
+        return 1;
+    }
+
+    Serial::FlowControl flow;
+    auto name = flow_args.flow->sval[0];
+    if (strcmp(name, "none")==0) {
+        flow = Serial::FlowControl::NONE;
+    }
+    else if (strcmp(name, "xonxoff")==0) {
+        flow = Serial::FlowControl::XONXOFF;
+    }
+    else if (strcmp(name, "hardware")==0) {
+        flow = Serial::FlowControl::HARDWARE;
+    }
+    else {
+        ESP_LOGE(TAG, "Unknown flow control '%s'", name);
+        return 1;
+    }
+
+    if (!bridge().serial().set_flow_control(flow)) {
+        ESP_LOGW(TAG, "Set flow control failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Flow control set to %s", name);
+    return 0;
+}
+
+static void register_serial_flow()
+{
+    flow_args.flow = arg_str1(nullptr, nullptr, "<none|xonxoff|hardware>", "Flow control");
+    flow_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "serial_flow",
+        .help = "Set serial flow control, so a slow client holds the target instead of losing data",
+        .hint = nullptr,
+        .func = serial_flow_cmd,
+        .argtable = &flow_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static struct {
+    struct arg_int *rts;
+    struct arg_int *cts;
+    struct arg_end *end;
+} flow_pins_args;
+
+static int serial_set_flow_pins_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &flow_pins_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, flow_pins_args.end, argv[0]);
+        return 1;
+    }
+
+    int rts = flow_pins_args.rts->ival[0];
+    int cts = flow_pins_args.cts->ival[0];
+    if (rts<GPIO_NUM_NC || rts>=GPIO_NUM_MAX || cts<GPIO_NUM_NC || cts>=GPIO_NUM_MAX) {
+        ESP_LOGE(TAG, "Invalid pins RTS %d, CTS %d", rts, cts);
+        return 1;
+    }
+
+    if (!bridge().serial().set_flow_pins(static_cast<gpio_num_t>(rts), static_cast<gpio_num_t>(cts))) {
+        ESP_LOGW(TAG, "Set flow control pins failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "RTS on GPIO %d, CTS on GPIO %d, restart to apply", rts, cts);
+    return 0;
+}
+
+static void register_serial_set_flow_pins()
+{
+    flow_pins_args.rts = arg_int1(nullptr, nullptr, "<rts>", "RTS GPIO, -1 for none");
+    flow_pins_args.cts = arg_int1(nullptr, nullptr, "<cts>", "CTS GPIO, -1 for none");
+    flow_pins_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "serial_set_flow_pins",
+        .help = "Set the GPIOs used for hardware flow control",
+        .hint = nullptr,
+        .func = serial_set_flow_pins_cmd,
+        .argtable = &flow_pins_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int serial_dma_on_cmd(int argc, char **argv) {
+    if (!bridge().serial().set_rx_dma(true)) {
+        ESP_LOGW(TAG, "Enable DMA receive failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "DMA receive enabled, restart to apply");
+    return 0;
+}
+
+static void register_serial_dma_on()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "serial_dma_on",
+        .help = "Receive serial data through UHCI DMA, for multi-megabaud links",
+        .hint = nullptr,
+        .func = serial_dma_on_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int serial_dma_off_cmd(int argc, char **argv) {
+    if (!bridge().serial().set_rx_dma(false)) {
+        ESP_LOGW(TAG, "Disable DMA receive failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "DMA receive disabled, restart to apply");
+    return 0;
+}
+
+static void register_serial_dma_off()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "serial_dma_off",
+        .help = "Receive serial data through the UART driver",
+        .hint = nullptr,
+        .func = serial_dma_off_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+
+/** -------------------------------------------------------------------------------
+ * Raw TCP server
+ */
+
+static struct {
+    struct arg_int *port;
+    struct arg_end *end;
+} raw_port_args;
+
+static int raw_set_port_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &raw_port_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, raw_port_args.end, argv[0]);
+        return 1;
+    }
+
+    int port = raw_port_args.port->ival[0];
+    if (port<0 || port>UINT16_MAX) {
+        ESP_LOGE(TAG, "Invalid port %d", port);
+        return 1;
+    }
+
+    if (!bridge().raw_server().set_port(port)) {
+        ESP_LOGW(TAG, "Set raw port failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Raw port set to %d, restart to apply", port);
+
+    return 0;
+}
+
+static void register_raw_set_port()
+{
+    raw_port_args.port = arg_int1(nullptr, nullptr, "<port>", "TCP port, 0 disables");
+    raw_port_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "raw_set_port",
+        .help = "Set port of the raw (no telnet) TCP server of the selected bridge",
+        .hint = nullptr,
+        .func = raw_set_port_cmd,
+        .argtable = &raw_port_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+
+static struct {
+    struct arg_int *port;
+    struct arg_end *end;
+} telnet_port_args;
+
+static int telnet_set_port_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &telnet_port_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, telnet_port_args.end, argv[0]);
+        return 1;
+    }
+
+    int port = telnet_port_args.port->ival[0];
+    if (port<0 || port>UINT16_MAX) {
+        ESP_LOGE(TAG, "Invalid port %d", port);
+        return 1;
+    }
+
+    if (!bridge().telnet_server().set_port(port)) {
+        ESP_LOGW(TAG, "Set telnet port failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Telnet port set to %d, restart to apply", port);
+
+    return 0;
+}
+
+static void register_telnet_set_port()
+{
+    telnet_port_args.port = arg_int1(nullptr, nullptr, "<port>", "TCP port, 0 disables");
+    telnet_port_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "telnet_set_port",
+        .help = "Set telnet port of the selected bridge, the first bridge keeps port 23",
+        .hint = nullptr,
+        .func = telnet_set_port_cmd,
+        .argtable = &telnet_port_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+
+/** -------------------------------------------------------------------------------
+ * Bridge metrics
+ */
+
+static int bridge_stats_cmd(int argc, char **argv) {
+    static char text[3072];
+    format_bridge_stats(text, sizeof(text));
+    fputs(text, stdout);
+    return 0;
+}
+
+static void register_bridge_stats()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "bridge_stats",
+        .help = "Show data path counters of the bridges",
+        .hint = nullptr,
+        .func = bridge_stats_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static void print_histogram(const char *name, const Histogram &histogram)
+{
+    auto summary = histogram.summary();
+    printf("%s: %lu chunks, p50 %lu us, p90 %lu us, p99 %lu us, max %lu us\n",
+        name, summary.count, summary.p50, summary.p90, summary.p99, summary.max);
+    for (size_t i=0; i<Histogram::BUCKETS; i++) {
+        auto count = histogram.bucket(i);
+        if (count==0) {
+            continue;
+        }
+        if (i==Histogram::BUCKETS-1) {
+            printf("  >%8lu us: %lu\n", Histogram::bucket_limit(i-1), count);
+        }
+        else {
+            printf("  <=%7lu us: %lu\n", Histogram::bucket_limit(i), count);
+        }
+    }
+}
+
+static int latency_stats_cmd(int argc, char **argv) {
+    print_histogram("Serial to client", bridge().metrics().serial_to_client_us);
+    print_histogram("Client to serial", bridge().serial().tx_latency());
+    return 0;
+}
+
+static void register_latency_stats()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "latency_stats",
+        .help = "Show latency histograms of serial to client and client to serial chunks",
+        .hint = nullptr,
+        .func = latency_stats_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int latency_reset_cmd(int argc, char **argv) {
+    bridge().metrics().serial_to_client_us.reset();
+    bridge().serial().tx_latency().reset();
+    return 0;
+}
+
+static void register_latency_reset()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "latency_reset",
+        .help = "Clear the latency histograms",
+        .hint = nullptr,
+        .func = latency_reset_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static struct {
+    struct arg_int *count;
+    struct arg_end *end;
+} trace_dump_args;
+
+static int trace_dump_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &trace_dump_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, trace_dump_args.end, argv[0]);
+        return 1;
+    }
+    int count = trace_dump_args.count->count ? trace_dump_args.count->ival[0] : TraceRing::SIZE;
+    if (count<=0 || count>static_cast<int>(TraceRing::SIZE)) {
+        count = TraceRing::SIZE;
+    }
+
+    // Copied out first, so decoding doesn't hold up the bridge
+    static TraceRecord records[TraceRing::SIZE];
+    auto copied = g_trace.snapshot(records, count);
+    char line[128];
+    for (size_t i=0; i<copied; i++) {
+        TraceRing::format(records[i], line, sizeof(line));
+        printf("%s\n", line);
+    }
+    if (TRACE_LEVEL==TRACE_LEVEL_NONE) {
+        printf("Trace points are not compiled in\n");
+    }
+    return 0;
+}
+
+static void register_trace_dump()
+{
+    trace_dump_args.count = arg_int0(nullptr, nullptr, "<count>", "Number of records, default all");
+    trace_dump_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "trace_dump",
+        .help = "Decode the newest data path trace records",
+        .hint = nullptr,
+        .func = trace_dump_cmd,
+        .argtable = &trace_dump_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int trace_clear_cmd(int argc, char **argv) {
+    g_trace.clear();
+    return 0;
+}
+
+static void register_trace_clear()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "trace_clear",
+        .help = "Forget the trace records so far",
+        .hint = nullptr,
+        .func = trace_clear_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static struct {
+    struct arg_int *port;
+    struct arg_end *end;
+} stats_port_args;
+
+static int stats_set_port_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &stats_port_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, stats_port_args.end, argv[0]);
+        return 1;
+    }
+
+    int port = stats_port_args.port->ival[0];
+    if (port<0 || port>UINT16_MAX) {
+        ESP_LOGE(TAG, "Invalid port %d", port);
+        return 1;
+    }
+
+    if (!g_stats_server.set_port(port)) {
+        ESP_LOGW(TAG, "Set stats port failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Stats port set to %d, restart to apply", port);
+
+    return 0;
+}
+
+static void register_stats_set_port()
+{
+    stats_port_args.port = arg_int1(nullptr, nullptr, "<port>", "TCP port, 0 disables");
+    stats_port_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "stats_set_port",
+        .help = "Set port of the TCP server that sends the bridge_stats text",
+        .hint = nullptr,
+        .func = stats_set_port_cmd,
+        .argtable = &stats_port_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+
+static struct {
+    struct arg_int *lines;
+    struct arg_end *end;
+} scrollback_args;
+
+static int scrollback_set_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &scrollback_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, scrollback_args.end, argv[0]);
+        return 1;
+    }
+
+    int lines = scrollback_args.lines->ival[0];
+    if (lines<-1) {
+        ESP_LOGE(TAG, "Invalid line count %d", lines);
+        return 1;
+    }
+
+    if (!set_scrollback_lines(lines)) {
+        ESP_LOGW(TAG, "Set scrollback failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Scrollback set to %d lines", lines);
+
+    return 0;
+}
+
+static void register_scrollback_set()
+{
+    scrollback_args.lines = arg_int1(nullptr, nullptr, "<lines>", "Lines replayed, 0 disables and -1 replays everything buffered");
+    scrollback_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "scrollback_set",
+        .help = "Set how much buffered serial output is replayed to new clients",
+        .hint = nullptr,
+        .func = scrollback_set_cmd,
+        .argtable = &scrollback_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+
+/** -------------------------------------------------------------------------------
+ * Output coalescing
+ */
+
+static struct {
+    struct arg_int *budget;
+    struct arg_int *size;
+    struct arg_end *end;
+} coalesce_args;
+
+static int coalesce_set_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &coalesce_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, coalesce_args.end, argv[0]);
+        return 1;
+    }
+
+    int budget = coalesce_args.budget->ival[0];
+    int size = coalesce_args.size->count ? coalesce_args.size->ival[0] : g_coalescer.size();
+    if (budget<0 || size<=0) {
+        ESP_LOGE(TAG, "Invalid budget %d us or size %d", budget, size);
+        return 1;
+    }
+
+    if (!g_coalescer.set_budget(budget, size)) {
+        ESP_LOGW(TAG, "Set coalescing failed");
+        return 1;
+    }
+    // The event loop may be sleeping until output held under the old budget is due
+    g_reactor.wake();
+    ESP_LOGI(TAG, "Output held for up to %d us or %d bytes", budget, size);
+    return 0;
+}
+
+static void register_coalesce_set()
+{
+    coalesce_args.budget = arg_int1(nullptr, nullptr, "<budget_us>", "Longest time output is held, 0 sends at once");
+    coalesce_args.size = arg_int0(nullptr, nullptr, "<bytes>", "Output sent as soon as this much is held, default one MSS");
+    coalesce_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "coalesce_set",
+        .help = "Set the latency budget for collecting serial output into larger TCP segments",
+        .hint = nullptr,
+        .func = coalesce_set_cmd,
+        .argtable = &coalesce_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int coalesce_stats_cmd(int argc, char **argv) {
+    const auto &stats = g_coalescer.stats();
+    auto flushes = stats.size_flushes + stats.budget_flushes + stats.interactive_flushes;
+    printf("Budget:          %lu us, %lu bytes\n", g_coalescer.budget_us(), g_coalescer.size());
+    printf("TCP_NODELAY:     %s\n", g_coalescer.nodelay() ? "on" : "off");
+    printf("Flushes:         %lu full, %lu budget, %lu interactive\n", stats.size_flushes, stats.budget_flushes, stats.interactive_flushes);
+    printf("Average flush:   %lu bytes\n", flushes ? stats.bytes/flushes : 0);
+    print_client_stats();
+    return 0;
+}
+
+static void register_coalesce_stats()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "coalesce_stats",
+        .help = "Show output coalescing settings and average segment sizes",
+        .hint = nullptr,
+        .func = coalesce_stats_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int tcp_nodelay_on_cmd(int argc, char **argv) {
+    if (!set_tcp_nodelay(true)) {
+        ESP_LOGW(TAG, "Enable TCP_NODELAY failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "TCP_NODELAY enabled");
+    return 0;
+}
+
+static void register_tcp_nodelay_on()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "tcp_nodelay_on",
+        .help = "Send client segments without waiting for ACKs (Nagle off)",
+        .hint = nullptr,
+        .func = tcp_nodelay_on_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int tcp_nodelay_off_cmd(int argc, char **argv) {
+    if (!set_tcp_nodelay(false)) {
+        ESP_LOGW(TAG, "Disable TCP_NODELAY failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "TCP_NODELAY disabled");
+    return 0;
+}
+
+static void register_tcp_nodelay_off()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "tcp_nodelay_off",
+        .help = "Let the TCP stack hold small segments until earlier ones are ACKed (Nagle on)",
+        .hint = nullptr,
+        .func = tcp_nodelay_off_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int telnet_compress_on_cmd(int argc, char **argv) {
+    bool ok = true;
+    for (auto &bridge : g_bridges) {
+        ok = bridge.telnet_server().set_compress(true) && ok;
+    }
+    if (!ok) {
+        ESP_LOGW(TAG, "Enable telnet compression failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Telnet compression offered to new clients");
+    return 0;
+}
+
+static void register_telnet_compress_on()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "telnet_compress_on",
+        .help = "Offer MCCP2 stream compression to telnet clients",
+        .hint = nullptr,
+        .func = telnet_compress_on_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int telnet_compress_off_cmd(int argc, char **argv) {
+    bool ok = true;
+    for (auto &bridge : g_bridges) {
+        ok = bridge.telnet_server().set_compress(false) && ok;
+    }
+    if (!ok) {
+        ESP_LOGW(TAG, "Disable telnet compression failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Telnet compression no longer offered");
+    return 0;
+}
+
+static void register_telnet_compress_off()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "telnet_compress_off",
+        .help = "Send telnet clients uncompressed data only",
+        .hint = nullptr,
+        .func = telnet_compress_off_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+
+/** -------------------------------------------------------------------------------
+ * Serial capture
+ */
+
+static int capture_on_cmd(int argc, char **argv) {
+    if (!g_capture.set_enabled(true)) {
+        ESP_LOGW(TAG, "Enable capture failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Capture enabled");
+    return 0;
+}
+
+static void register_capture_on()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "capture_on",
+        .help = "Start capturing serial output to flash, also after reboot",
+        .hint = nullptr,
+        .func = capture_on_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int capture_off_cmd(int argc, char **argv) {
+    if (!g_capture.set_enabled(false)) {
+        ESP_LOGW(TAG, "Disable capture failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Capture disabled");
+    return 0;
+}
+
+static void register_capture_off()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "capture_off",
+        .help = "Stop capturing serial output to flash",
+        .hint = nullptr,
+        .func = capture_off_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int capture_info_cmd(int argc, char **argv) {
+    g_capture.info();
+    return 0;
+}
+
+static void register_capture_info()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "capture_info",
+        .help = "Show serial capture state",
+        .hint = nullptr,
+        .func = capture_info_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static constexpr int CAPTURE_DUMP_DEFAULT_KB { 4 };
+
+static struct {
+    struct arg_int *kbytes;
+    struct arg_end *end;
+} capture_dump_args;
+
+static int capture_dump_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &capture_dump_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, capture_dump_args.end, argv[0]);
+        return 1;
+    }
+
+    int kbytes = capture_dump_args.kbytes->count ? capture_dump_args.kbytes->ival[0] : CAPTURE_DUMP_DEFAULT_KB;
+    if (kbytes<=0) {
+        ESP_LOGE(TAG, "Invalid size %d", kbytes);
+        return 1;
+    }
+    g_capture.dump(kbytes);
+    return 0;
+}
+
+static void register_capture_dump()
+{
+    capture_dump_args.kbytes = arg_int0(nullptr, nullptr, "<kbytes>", "Amount of the newest data to show, default 4");
+    capture_dump_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "capture_dump",
+        .help = "Show captured serial output, each line prefixed with boot number and seconds since boot",
+        .hint = nullptr,
+        .func = capture_dump_cmd,
+        .argtable = &capture_dump_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+/** -------------------------------------------------------------------------------
+ * Serial triggers
+ */
+
+/** Decode \\, \r, \n, \t, \e and \xHH escapes, returns the length or -1 */
+static int parse_pattern(const char *text, uint8_t *buf, size_t size)
+{
+    size_t len = 0;
+    while (*text) {
+        if (len==size) {
+            return -1;
+        }
+        auto ch = *text++;
+        if (ch=='\\') {
+            ch = *text++;
+            switch (ch) {
+                case '\\': break;
+                case 'r': ch = '\r'; break;
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'e': ch = '\x1b'; break;
+                case 'x': {
+                    char hex[3] { text[0], text[0] ? text[1] : '\0', '\0' };
+                    char *end;
+                    ch = strtoul(hex, &end, 16);
+                    if (end!=hex+2) {
+                        return -1;
+                    }
+                    text += 2;
+                    break;
+                }
+                default:
+                    return -1;
+            }
+        }
+        buf[len++] = ch;
+    }
+    return len;
+}
+
+
+static struct {
+    struct arg_str *pattern;
+    struct arg_lit *capture;
+    struct arg_lit *notify;
+    struct arg_int *gpio;
+    struct arg_end *end;
+} trigger_add_args;
+
+static int trigger_add_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &trigger_add_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, trigger_add_args.end, argv[0]);
+        return 1;
+    }
+
+    uint8_t pattern[TriggerEngine::PATTERN_MAX];
+    int len = parse_pattern(trigger_add_args.pattern->sval[0], pattern, sizeof(pattern));
+    if (len<=0) {
+        ESP_LOGE(TAG, "Invalid pattern, at most %u bytes", TriggerEngine::PATTERN_MAX);
+        return 1;
+    }
+    uint8_t actions = TriggerEngine::COUNT;
+    actions |= trigger_add_args.capture->count ? TriggerEngine::CAPTURE : 0;
+    actions |= trigger_add_args.notify->count ? TriggerEngine::NOTIFY : 0;
+    actions |= trigger_add_args.gpio->count ? TriggerEngine::GPIO : 0;
+    int gpio = trigger_add_args.gpio->count ? trigger_add_args.gpio->ival[0] : -1;
+
+    auto index = g_triggers.add(pattern, len, actions, gpio);
+    if (index<0) {
+        ESP_LOGW(TAG, "Add trigger failed");
+        return 1;
+    }
+    ESP_LOGI(TAG, "Trigger %d added", index);
+    return 0;
+}
+
+static void register_trigger_add()
+{
+    trigger_add_args.pattern = arg_str1(nullptr, nullptr, "<pattern>", "Text to match, with \\r \\n \\t \\e \\xHH escapes");
+    trigger_add_args.capture = arg_lit0("c", "capture", "Mark the match in the capture");
+    trigger_add_args.notify = arg_lit0("n", "notify", "Tell telnet clients");
+    trigger_add_args.gpio = arg_int0("g", "gpio", "<gpio>", "Toggle this GPIO");
+    trigger_add_args.end = arg_end(4);
+
+    const esp_console_cmd_t cmd = {
+        .command = "trigger_add",
+        .help = "Watch the serial output for a pattern, matches are counted",
+        .hint = nullptr,
+        .func = trigger_add_cmd,
+        .argtable = &trigger_add_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static struct {
+    struct arg_int *index;
+    struct arg_end *end;
+} trigger_remove_args;
+
+static int trigger_remove_cmd(int argc, char **argv) {
+    int nerrors = arg_parse(argc, argv, (void **) &trigger_remove_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, trigger_remove_args.end, argv[0]);
+        return 1;
+    }
+
+    int index = trigger_remove_args.index->ival[0];
+    if (index<0 || !g_triggers.remove(index)) {
+        ESP_LOGE(TAG, "No trigger %d", index);
+        return 1;
+    }
+    ESP_LOGI(TAG, "Trigger %d removed", index);
+    return 0;
+}
+
+static void register_trigger_remove()
+{
+    trigger_remove_args.index = arg_int1(nullptr, nullptr, "<index>", "Trigger number from trigger_list");
+    trigger_remove_args.end = arg_end(2);
+
+    const esp_console_cmd_t cmd = {
+        .command = "trigger_remove",
+        .help = "Stop watching for a pattern",
+        .hint = nullptr,
+        .func = trigger_remove_cmd,
+        .argtable = &trigger_remove_args
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
+static int trigger_list_cmd(int argc, char **argv) {
+    g_triggers.list();
+    return 0;
+}
+
+static void register_trigger_list()
+{
+    const esp_console_cmd_t cmd = {
+        .command = "trigger_list",
+        .help = "Show the patterns watched for, their actions and match counts",
+        .hint = nullptr,
+        .func = trigger_list_cmd,
+        .argtable = nullptr
+    };
+    ESP_ERROR_CHECK( esp_console_cmd_register(&cmd) );
+}
+
+
 /** -------------------------------------------------------------------------------
  * Wifi commands
  */
@@ -241,6 +1271,35 @@ void register_cmd()
     register_wifi_set_country();
     register_wifi_restore();
     register_wifi_info();
+    register_bridge_select();
     register_serial_set_baud();
     register_serial_restore();
+    register_serial_stats();
+    register_serial_profile();
+    register_serial_flow();
+    register_serial_set_flow_pins();
+    register_serial_dma_on();
+    register_serial_dma_off();
+    register_raw_set_port();
+    register_telnet_set_port();
+    register_bridge_stats();
+    register_latency_stats();
+    register_latency_reset();
+    register_trace_dump();
+    register_trace_clear();
+    register_stats_set_port();
+    register_scrollback_set();
+    register_coalesce_set();
+    register_coalesce_stats();
+    register_tcp_nodelay_on();
+    register_tcp_nodelay_off();
+    register_telnet_compress_on();
+    register_telnet_compress_off();
+    register_capture_on();
+    register_capture_off();
+    register_capture_info();
+    register_capture_dump();
+    register_trigger_add();
+    register_trigger_remove();
+    register_trigger_list();
 }
@@ -0,0 +1,136 @@
+#include "coalesce.h"
+
+#include <esp_log.h>
+#include <nvs.h>
+#include <sdkconfig.h>
+
+
+static constexpr const char* TAG = "coalesce";
+
+static constexpr uint32_t    COALESCE_DEFAULT_BUDGET_US { 1000 };
+static constexpr uint32_t    COALESCE_DEFAULT_SIZE { CONFIG_LWIP_TCP_MSS };
+// The first bytes after an idle line are sent at once, they are likely an echo
+static constexpr size_t      COALESCE_INTERACTIVE_BYTES { 16 };
+
+static constexpr const char *COALESCE_NVS_NAMESPACE { "coalesce" };
+static constexpr const char *COALESCE_NVS_BUDGET    { "budget_us" };
+static constexpr const char *COALESCE_NVS_SIZE      { "size" };
+static constexpr const char *COALESCE_NVS_NODELAY   { "nodelay" };
+
+
+void Coalescer::start()
+{
+    m_budget_us = COALESCE_DEFAULT_BUDGET_US;
+    m_size = COALESCE_DEFAULT_SIZE;
+    m_nodelay = true;
+
+    nvs_handle_t handle;
+    if (nvs_open(COALESCE_NVS_NAMESPACE, NVS_READONLY, &handle)==ESP_OK) {
+        uint32_t value;
+        if (nvs_get_u32(handle, COALESCE_NVS_BUDGET, &value)==ESP_OK) {
+            m_budget_us = value;
+        }
+        if (nvs_get_u32(handle, COALESCE_NVS_SIZE, &value)==ESP_OK) {
+            m_size = value;
+        }
+        if (nvs_get_u32(handle, COALESCE_NVS_NODELAY, &value)==ESP_OK) {
+            m_nodelay = value!=0;
+        }
+        nvs_close(handle);
+    }
+    ESP_LOGI(TAG, "Output coalescing %lu us / %lu bytes, nodelay %s", m_budget_us, m_size, m_nodelay ? "on" : "off");
+}
+
+
+bool Coalescer::flush(uint32_t &counter)
+{
+    counter++;
+    m_stats.bytes += m_held;
+    m_held = 0;
+    return true;
+}
+
+
+bool Coalescer::add(size_t count, int64_t now)
+{
+    if (now-m_last_data >= m_budget_us) {
+        m_burst = 0;
+    }
+    m_burst += count;
+    m_last_data = now;
+    if (m_held==0) {
+        m_held_since = now;
+    }
+    m_held += count;
+
+    if (m_budget_us==0) {
+        return flush(m_stats.budget_flushes);
+    }
+    if (m_held >= m_size) {
+        return flush(m_stats.size_flushes);
+    }
+    if (m_burst<=COALESCE_INTERACTIVE_BYTES) {
+        return flush(m_stats.interactive_flushes);
+    }
+    return false;
+}
+
+
+bool Coalescer::expire(int64_t now)
+{
+    if (m_held==0 || now-m_held_since < m_budget_us) {
+        return false;
+    }
+    return flush(m_stats.budget_flushes);
+}
+
+
+int64_t Coalescer::wait(int64_t now) const
+{
+    if (m_held==0) {
+        return -1;
+    }
+    auto due = m_held_since + m_budget_us;
+    return due > now ? due-now : 0;
+}
+
+
+bool Coalescer::store(const char *key, uint32_t value)
+{
+    nvs_handle_t handle;
+    auto res = nvs_open(COALESCE_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+    res = nvs_set_u32(handle, key, value);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS %s: err=%d", key, res);
+        nvs_close(handle);
+        return false;
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    return true;
+}
+
+
+bool Coalescer::set_budget(uint32_t budget_us, uint32_t size)
+{
+    if (!store(COALESCE_NVS_BUDGET, budget_us) || !store(COALESCE_NVS_SIZE, size)) {
+        return false;
+    }
+    m_budget_us = budget_us;
+    m_size = size;
+    return true;
+}
+
+
+bool Coalescer::set_nodelay(bool nodelay)
+{
+    if (!store(COALESCE_NVS_NODELAY, nodelay)) {
+        return false;
+    }
+    m_nodelay = nodelay;
+    return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+ * Decides when serial output is handed to the client sockets.
+ *
+ * New output is held until a full segment has collected or the oldest held
+ * byte has waited for the latency budget, so a fast serial stream is sent in
+ * large TCP segments. The first few bytes after an idle line, such as the
+ * echo of a keystroke, are sent at once. Times are in microseconds.
+ */
+class Coalescer {
+    public:
+        struct Stats {
+            uint32_t size_flushes;
+            uint32_t budget_flushes;
+            uint32_t interactive_flushes;
+            uint32_t bytes;
+        };
+
+        constexpr Coalescer() :
+            m_budget_us { 0 },
+            m_size { 0 },
+            m_nodelay { true },
+            m_held { 0 },
+            m_held_since { 0 },
+            m_last_data { 0 },
+            m_burst { 0 },
+            m_stats { }
+        {}
+
+        /** Load the settings from NVS */
+        void start();
+
+        /** Account count bytes of new output, true if the held output should be sent now */
+        bool add(size_t count, int64_t now);
+        /** True if held output has waited for the budget and should be sent now */
+        bool expire(int64_t now);
+        /** Time until held output is due, -1 if nothing is held */
+        int64_t wait(int64_t now) const;
+
+        /** Store the latency budget and segment size, a budget of 0 sends everything at once */
+        bool set_budget(uint32_t budget_us, uint32_t size);
+        uint32_t budget_us() const { return m_budget_us; }
+        uint32_t size() const { return m_size; }
+
+        /** Store whether client sockets disable Nagle's algorithm */
+        bool set_nodelay(bool nodelay);
+        bool nodelay() const { return m_nodelay; }
+
+        const Stats &stats() const { return m_stats; }
+
+    private:
+        uint32_t m_budget_us;
+        uint32_t m_size;
+        bool m_nodelay;
+
+        size_t m_held;
+        int64_t m_held_since;
+        int64_t m_last_data;
+        // Bytes since the line was last idle for the budget
+        size_t m_burst;
+        Stats m_stats;
+
+        bool flush(uint32_t &counter);
+        bool store(const char *key, uint32_t value);
+};
@@ -0,0 +1,290 @@
+#include "deflate.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+
+#include "broadcast.h"
+
+static constexpr const char* TAG = "deflate";
+
+static constexpr uint32_t HASH_BITS { 10 };
+static constexpr uint32_t HASH_SIZE { 1<<HASH_BITS };
+static constexpr uint32_t MIN_MATCH { 3 };
+static constexpr uint32_t MAX_MATCH { 258 };
+static constexpr uint32_t ADLER_MOD { 65521 };
+
+// zlib header: deflate with a 32K window, no dictionary, check bits
+static constexpr uint32_t ZLIB_HEADER { 0x78 | 0x01<<8 };
+// Block header bits, BFINAL then BTYPE 01 (fixed Huffman codes)
+static constexpr uint32_t BLOCK_FIXED { 0x2 };
+static constexpr uint32_t BLOCK_FIXED_FINAL { 0x3 };
+static constexpr uint16_t END_OF_BLOCK { 256 };
+
+
+/** Huffman codes are sent most significant bit first, the bit writer is LSB first */
+static constexpr uint16_t reverse(uint16_t code, uint8_t len)
+{
+    uint16_t reversed = 0;
+    for (uint8_t i=0; i<len; i++) {
+        reversed = reversed<<1 | (code>>i & 1);
+    }
+    return reversed;
+}
+
+
+/** RFC 1951 3.2.6: fixed literal/length codes, reversed for the bit writer */
+struct FixedCodes {
+    uint16_t bits[288];
+    uint8_t len[288];
+
+    constexpr FixedCodes() : bits { }, len { }
+    {
+        for (uint16_t symbol=0; symbol<288; symbol++) {
+            if (symbol<144) {
+                bits[symbol] = reverse(0x30+symbol, 8);
+                len[symbol] = 8;
+            }
+            else if (symbol<256) {
+                bits[symbol] = reverse(0x190+symbol-144, 9);
+                len[symbol] = 9;
+            }
+            else if (symbol<280) {
+                bits[symbol] = reverse(symbol-256, 7);
+                len[symbol] = 7;
+            }
+            else {
+                bits[symbol] = reverse(0xc0+symbol-280, 8);
+                len[symbol] = 8;
+            }
+        }
+    }
+};
+
+static constexpr FixedCodes FIXED_CODES {};
+
+
+static inline uint32_t hash(uint8_t a, uint8_t b, uint8_t c)
+{
+    return ((a | b<<8 | c<<16)*2654435761u) >> (32-HASH_BITS);
+}
+
+
+bool Deflate::start()
+{
+    if (!m_hash) {
+        m_hash = static_cast<uint32_t*>(malloc(HASH_SIZE*sizeof(uint32_t)));
+        if (!m_hash) {
+            ESP_LOGE(TAG, "Unable to allocate compression state");
+            return false;
+        }
+    }
+    // Stale entries are harmless, every match is checked against the ring
+    memset(m_hash, 0, HASH_SIZE*sizeof(uint32_t));
+    m_bits = 0;
+    m_bit_count = 0;
+    m_in_block = false;
+    m_adler_a = 1;
+    m_adler_b = 0;
+    put_bits(ZLIB_HEADER, 16);
+    return true;
+}
+
+
+void Deflate::stop()
+{
+    free(m_hash);
+    m_hash = nullptr;
+}
+
+
+size_t Deflate::drain(uint8_t *out)
+{
+    size_t n = 0;
+    while (m_bit_count>=8) {
+        out[n++] = m_bits;
+        m_bits >>= 8;
+        m_bit_count -= 8;
+    }
+    return n;
+}
+
+
+size_t Deflate::align(uint8_t *out)
+{
+    auto n = drain(out);
+    if (m_bit_count) {
+        out[n++] = m_bits;
+        m_bits = 0;
+        m_bit_count = 0;
+    }
+    return n;
+}
+
+
+void Deflate::begin_block()
+{
+    if (!m_in_block) {
+        put_bits(BLOCK_FIXED, 3);
+        m_in_block = true;
+    }
+}
+
+
+void Deflate::put_symbol(uint16_t symbol)
+{
+    put_bits(FIXED_CODES.bits[symbol], FIXED_CODES.len[symbol]);
+}
+
+
+void Deflate::put_length(uint32_t length)
+{
+    // RFC 1951 3.2.5: codes 257..284 cover 3..257 in groups of four, doubling in size
+    auto x = length-MIN_MATCH;
+    if (x==MAX_MATCH-MIN_MATCH) {
+        put_symbol(285);
+        return;
+    }
+    if (x<8) {
+        put_symbol(257+x);
+        return;
+    }
+    uint32_t top = 31-__builtin_clz(x);
+    uint32_t extra = top-2;
+    put_symbol(257 + 4*(top-1) + (x>>extra & 3));
+    put_bits(x & ((1<<extra)-1), extra);
+}
+
+
+void Deflate::put_distance(uint32_t distance)
+{
+    // Codes 0..3 are distances 1..4, then two codes per power of two
+    auto x = distance-1;
+    uint32_t code = x;
+    uint32_t extra = 0;
+    if (x>=4) {
+        uint32_t top = 31-__builtin_clz(x);
+        extra = top-1;
+        code = 2*top + (x>>extra & 1);
+    }
+    put_bits(reverse(code, 5), 5);
+    put_bits(x & ((1<<extra)-1), extra);
+}
+
+
+void Deflate::checksum(uint8_t byte)
+{
+    m_adler_a += byte;
+    if (m_adler_a>=ADLER_MOD) {
+        m_adler_a -= ADLER_MOD;
+    }
+    m_adler_b += m_adler_a;
+    if (m_adler_b>=ADLER_MOD) {
+        m_adler_b -= ADLER_MOD;
+    }
+}
+
+
+/**
+ * Greedy matching with one candidate per hash slot. The candidate is only
+ * used if it lies within the window, at or after from, and the ring still
+ * holds it; the bytes are then compared, so a stale or colliding slot
+ * costs a compare but never produces a wrong match.
+ */
+size_t Deflate::compress(const BroadcastRing &ring, uint32_t &pos, uint32_t end, uint32_t from, uint8_t *out, size_t size)
+{
+    auto n = drain(out);
+    while (pos!=end && n+RESERVE<=size) {
+        begin_block();
+        uint32_t avail = end-pos;
+        uint32_t length = 0;
+        uint32_t distance = 0;
+        if (avail>=MIN_MATCH) {
+            auto slot = hash(ring.at(pos), ring.at(pos+1), ring.at(pos+2));
+            auto candidate = m_hash[slot];
+            m_hash[slot] = pos;
+            distance = pos-candidate;
+            if (distance-1<WINDOW && static_cast<int32_t>(candidate-from)>=0 && ring.valid(candidate)) {
+                auto limit = avail<MAX_MATCH ? avail : MAX_MATCH;
+                while (length<limit && ring.at(candidate+length)==ring.at(pos+length)) {
+                    length++;
+                }
+            }
+        }
+
+        if (length>=MIN_MATCH) {
+            put_length(length);
+            n += drain(out+n);
+            put_distance(distance);
+            checksum(ring.at(pos));
+            for (uint32_t i=1; i<length; i++) {
+                // Later positions in the match are candidates for what follows
+                if (avail-i>=MIN_MATCH) {
+                    m_hash[hash(ring.at(pos+i), ring.at(pos+i+1), ring.at(pos+i+2))] = pos+i;
+                }
+                checksum(ring.at(pos+i));
+            }
+            pos += length;
+        }
+        else {
+            auto byte = ring.at(pos);
+            put_symbol(byte);
+            checksum(byte);
+            pos++;
+        }
+        n += drain(out+n);
+    }
+    return n;
+}
+
+
+size_t Deflate::literals(const uint8_t *data, size_t &count, uint8_t *out, size_t size)
+{
+    auto n = drain(out);
+    size_t taken = 0;
+    while (taken<count && n+RESERVE<=size) {
+        begin_block();
+        put_symbol(data[taken]);
+        checksum(data[taken]);
+        taken++;
+        n += drain(out+n);
+    }
+    count = taken;
+    return n;
+}
+
+
+/** Close the block and add an empty stored block, which ends on a byte boundary */
+size_t Deflate::flush(uint8_t *out)
+{
+    if (!m_in_block && m_bit_count==0) {
+        return 0;
+    }
+    if (m_in_block) {
+        put_symbol(END_OF_BLOCK);
+        m_in_block = false;
+    }
+    put_bits(0, 3);
+    auto n = align(out);
+    static const uint8_t STORED_EMPTY[] { 0x00, 0x00, 0xff, 0xff };
+    memcpy(out+n, STORED_EMPTY, sizeof(STORED_EMPTY));
+    return n+sizeof(STORED_EMPTY);
+}
+
+
+size_t Deflate::finish(uint8_t *out)
+{
+    if (m_in_block) {
+        put_symbol(END_OF_BLOCK);
+        m_in_block = false;
+    }
+    put_bits(BLOCK_FIXED_FINAL, 3);
+    put_symbol(END_OF_BLOCK);
+    auto n = align(out);
+    uint32_t adler = m_adler_b<<16 | m_adler_a;
+    out[n++] = adler>>24;
+    out[n++] = adler>>16;
+    out[n++] = adler>>8;
+    out[n++] = adler;
+    return n;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+class BroadcastRing;
+
+
+/**
+ * Streaming zlib (RFC 1950/1951) compressor for telnet compression (MCCP2).
+ *
+ * Only the fixed Huffman codes are used, so nothing is built or sent per
+ * block, and matches are found through a hash of the last position seen
+ * for each 3 byte prefix. The history is not copied: matches are read back
+ * from the ring the data comes from, up to WINDOW bytes behind, so a stream
+ * costs the hash table and a few words of state.
+ */
+class Deflate {
+    public:
+        static constexpr uint32_t WINDOW { 4096 };
+        // Output room kept free by compress() and literals(), enough for one
+        // more symbol and a flush or the end of the stream
+        static constexpr size_t RESERVE { 16 };
+
+        constexpr Deflate() :
+            m_hash { nullptr },
+            m_bits { 0 },
+            m_bit_count { 0 },
+            m_in_block { false },
+            m_adler_a { 1 },
+            m_adler_b { 0 }
+        {}
+
+        /** Allocate the hash table and begin a stream, its header goes out with the first output */
+        bool start();
+        void stop();
+
+        /**
+         * Compress ring data from pos up to end into out, advancing pos.
+         * Matches reach back no further than from, the first position of the
+         * ring data the peer has received on this stream without anything else
+         * in between. Returns the bytes written.
+         */
+        size_t compress(const BroadcastRing &ring, uint32_t &pos, uint32_t end, uint32_t from, uint8_t *out, size_t size);
+        /** Compress count bytes as literals, count is set to the bytes taken */
+        size_t literals(const uint8_t *data, size_t &count, uint8_t *out, size_t size);
+        /** Sync flush: the peer can decode everything so far. Writes at most RESERVE bytes */
+        size_t flush(uint8_t *out);
+        /** End the stream with the checksum. Writes at most RESERVE bytes */
+        size_t finish(uint8_t *out);
+
+    private:
+        uint32_t *m_hash;
+        uint32_t m_bits;
+        uint8_t m_bit_count;
+        bool m_in_block;
+        uint32_t m_adler_a;
+        uint32_t m_adler_b;
+
+        void put_bits(uint32_t bits, uint8_t count)
+        {
+            m_bits |= bits<<m_bit_count;
+            m_bit_count += count;
+        }
+        size_t drain(uint8_t *out);
+        size_t align(uint8_t *out);
+        void begin_block();
+        void put_symbol(uint16_t symbol);
+        void put_length(uint32_t length);
+        void put_distance(uint32_t distance);
+        void checksum(uint8_t byte);
+};
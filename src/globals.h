@@ -1,7 +1,33 @@
 #pragma once
 
+#include "bridge.h"
 #include "serial.h"
 #include "telnet.h"
+#include "capture.h"
+#include "coalesce.h"
+#include "reactor.h"
+#include "metrics.h"
+#include "trigger.h"
+#include "web.h"
 
-extern Serial g_serial;
-extern TelnetServer g_telnet_server;
+// One bridge per UART, the first also feeds capture, triggers and the web terminal
+extern Bridge g_bridges[];
+extern const size_t BRIDGE_COUNT;
+extern TelnetServer g_stats_server;
+extern Capture g_capture;
+extern Coalescer g_coalescer;
+// Event loop of app_main, the bridges register their descriptors with it
+extern Reactor g_reactor;
+extern TriggerEngine g_triggers;
+extern WebTerminal g_web_terminal;
+
+/** Store the number of lines replayed to new clients, 0 disables replay and -1 replays all buffered output */
+bool set_scrollback_lines(int32_t lines);
+/** Store TCP_NODELAY for client sockets and apply it to the connected clients */
+bool set_tcp_nodelay(bool nodelay);
+/** Send the held output of every bridge to its clients */
+void flush_clients();
+/** Print send statistics of the connected clients of every bridge to stdout */
+void print_client_stats();
+/** Format the bridge metrics as text, returns the length like snprintf() */
+size_t format_bridge_stats(char *buf, size_t size);
@@ -6,12 +6,25 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <esp_log.h>
+#include <nvs.h>
 #include <nvs_flash.h>
 #include <esp_vfs_dev.h>
+#include <esp_vfs_eventfd.h>
+#include <esp_timer.h>
+#include <sdkconfig.h>
 
+#include "bridge.h"
 #include "serial.h"
 #include "wifi.h"
 #include "telnet.h"
+#include "broadcast.h"
+#include "capture.h"
+#include "coalesce.h"
+#include "metrics.h"
+#include "trace.h"
+#include "trigger.h"
+#include "web.h"
+#include "assets.h"
 #include "console.h"
 #include "globals.h"
 
@@ -23,66 +36,142 @@ extern "C" {
 static constexpr const char *TAG = "main";
 
 
-Serial g_serial(UART_NUM_1, GPIO_NUM_2, GPIO_NUM_3);
-TelnetServer g_telnet_server(23);
+/**
+ * The UARTs served, each on its own ports and with its own buffers. The
+ * console is on the USB Serial/JTAG port, which leaves UART0 (D6/D7) free
+ * for a second target; it is off until a port is set with telnet_set_port.
+ */
+static constexpr BridgeConfig BRIDGE_CONFIGS[] {
+    { "uart1", UART_NUM_1, GPIO_NUM_2, GPIO_NUM_3, "serial", 23, nullptr, 2323, "raw_port", 16384 },
+    { "uart0", UART_NUM_0, GPIO_NUM_21, GPIO_NUM_20, "serial0", 0, "uart0_port", 0, "uart0_raw_port", 8192 },
+};
 
-static TelnetConnection telnet_client;
+Bridge g_bridges[] { Bridge(BRIDGE_CONFIGS[0]), Bridge(BRIDGE_CONFIGS[1]) };
+const size_t BRIDGE_COUNT { sizeof(g_bridges)/sizeof(g_bridges[0]) };
+// Capture, triggers and the web terminal belong to the first bridge
+static Bridge &primary { g_bridges[0] };
 
+// Sends the bridge metrics as text and closes
+TelnetServer g_stats_server(2324, true, "stats_port");
+Capture g_capture("storage");
+Coalescer g_coalescer;
+Reactor g_reactor;
+TriggerEngine g_triggers;
+WebAssets g_web_assets("assets");
+WebTerminal g_web_terminal(80, g_web_assets);
 
-static void on_serial_data()
-{
-    static uint8_t buf[64];
+static constexpr size_t STATS_TEXT_SIZE { 3072 };
 
-    auto len = g_serial.read(buf, sizeof(buf));
-    if (len>0) {
-        //ESP_LOGI(TAG, "SER %d read", len);
-        if (telnet_client) {
-            telnet_client.write(buf, len);
-        }
+
+bool set_tcp_nodelay(bool nodelay)
+{
+    if (!g_coalescer.set_nodelay(nodelay)) {
+        return false;
+    }
+    for (auto &bridge : g_bridges) {
+        bridge.set_nodelay(nodelay);
     }
+    return true;
 }
 
-static void on_telnet_client_data()
+
+void print_client_stats()
 {
-    static uint8_t buf[64];
-    auto len = telnet_client.read(buf, sizeof(buf));
-    if (len<0) {
-        ESP_LOGW(TAG, "Closing telnet client");
-        telnet_client.close();
-        return;
+    for (const auto &bridge : g_bridges) {
+        bridge.print_client_stats();
     }
-    else if (len>0) {
-        //ESP_LOGI(TAG, "TEL %d read", len);
-        g_serial.write(buf, len);
+}
+
+
+void flush_clients()
+{
+    for (auto &bridge : g_bridges) {
+        bridge.flush();
     }
 }
 
 
-static void on_telnet_window_size(uint16_t width, uint16_t height)
+static void on_serial_output(const uint8_t *data, size_t len)
 {
+    g_capture.write(data, len);
+    g_triggers.scan(data, len);
+}
 
+
+static void on_trigger_notice(const char *text, size_t len)
+{
+    primary.notice(text, len);
 }
 
 
-static void on_telnet_connection()
+/** The first bridge as it always was, the keys of the others prefixed with their name */
+size_t format_bridge_stats(char *buf, size_t size)
 {
-    TelnetConnection client;
+    static char text[STATS_TEXT_SIZE/2];
+    size_t len = 0;
+    for (size_t i=0; i<BRIDGE_COUNT && len+1<size; i++) {
+        auto &bridge = g_bridges[i];
+        if (i==0) {
+            len = bridge.format_stats(buf, size);
+            len = len<size ? len : size-1;
+            continue;
+        }
+        if (!bridge.running()) {
+            continue;
+        }
+        auto count = bridge.format_stats(text, sizeof(text));
+        count = count<sizeof(text) ? count : sizeof(text)-1;
+        for (const char *line=text; line<text+count && len+1<size; ) {
+            auto eol = static_cast<const char*>(memchr(line, '\n', text+count-line));
+            auto line_len = eol ? eol+1-line : text+count-line;
+            auto res = snprintf(buf+len, size-len, "%s.%.*s", bridge.name(), static_cast<int>(line_len), line);
+            len += res<0 ? 0 : res;
+            len = len<size ? len : size-1;
+            line += line_len;
+        }
+    }
+    return len;
+}
 
-    if (!g_telnet_server.accept(client))
-        return;
 
-    if (telnet_client) {
-        ESP_LOGW(TAG, "Telnet busy");
-        // We already hav a connection - reject connection
-        const char msg[] = "Busy\n";
-        client.write((const uint8_t*)msg, strlen(msg));
-        client.close();
+static void on_stats_connection(void *arg, int fd, uint8_t events)
+{
+    TelnetConnection client;
+    if (!g_stats_server.accept(client)) {
         return;
     }
+    static char text[STATS_TEXT_SIZE];
+    auto len = format_bridge_stats(text, sizeof(text));
+    client.write(reinterpret_cast<const uint8_t*>(text), len<sizeof(text) ? len : sizeof(text)-1);
+    client.close();
+}
 
-    ESP_LOGW(TAG, "Client connected");
-    telnet_client = client;
-    telnet_client.set_window_size_cb(on_telnet_window_size);
+
+static void on_web_event(void *arg, int fd, uint8_t events)
+{
+    WebTerminal::Event event;
+    // Input waits in the event queue while the UART transmit buffer is full
+    while (primary.serial().write_space()>=WebTerminal::EVENT_DATA_MAX && g_web_terminal.next(event)) {
+        switch (event.type) {
+            case WebTerminal::EventType::OPEN:
+                if (!primary.open_websocket(event.fd)) {
+                    g_web_terminal.close(event.fd);
+                }
+                break;
+            case WebTerminal::EventType::INPUT:
+                primary.client_input(primary.find_websocket(event.fd), event.data, event.len);
+                break;
+            case WebTerminal::EventType::CLOSE: {
+                auto idx = primary.find_websocket(event.fd);
+                // Gone already if the bridge ended the session
+                if (idx>=0) {
+                    primary.close_client(idx);
+                }
+                ::close(event.fd);
+                break;
+            }
+        }
+    }
 }
 
 
@@ -101,6 +190,9 @@ static void board_init()
 
     esp_vfs_dev_uart_register();
 
+    esp_vfs_eventfd_config_t eventfd_config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK( esp_vfs_eventfd_register(&eventfd_config) );
+
 }
 
 
@@ -112,7 +204,11 @@ void app_main(void)
 
 
     // Start delay...
+    #if CONFIG_IDF_TARGET_LINUX
+    constexpr uint START_DELAY { 0 };
+    #else
     constexpr uint START_DELAY { 10 };
+    #endif
     for (uint i=0; i<START_DELAY; i++) {
         ESP_LOGI(TAG, "Starting in %u sec ...", START_DELAY-i);
         vTaskDelay(pdMS_TO_TICKS(1000));
@@ -132,55 +228,72 @@ void app_main(void)
     esp_partition_iterator_release(it);
 
 
-    while (!g_serial.start()) {
+    g_coalescer.start();
+    if (!g_reactor.start()) {
+        ESP_LOGE(TAG, "Unable to start the event loop");
+        return;
+    }
+    if (!g_capture.start()) {
+        ESP_LOGW(TAG, "Serial capture not available");
+    }
+    g_triggers.set_notify_cb(on_trigger_notice);
+    if (!g_triggers.start()) {
+        ESP_LOGW(TAG, "Serial triggers not available");
+    }
+    primary.set_data_cb(on_serial_output);
+    while (!primary.start()) {
         vTaskDelay(pdMS_TO_TICKS(2000));
-        ESP_LOGW(TAG, "Retrying serial open");
+        ESP_LOGW(TAG, "Retrying %s start", primary.name());
+    }
+    for (size_t i=1; i<BRIDGE_COUNT; i++) {
+        if (!g_bridges[i].start()) {
+            ESP_LOGW(TAG, "Bridge %s not available", g_bridges[i].name());
+        }
     }
-    while (!g_telnet_server.start()) {
+    while (!g_stats_server.start()) {
         vTaskDelay(pdMS_TO_TICKS(2000));
-        ESP_LOGW(TAG, "Retrying telnet open");
+        ESP_LOGW(TAG, "Retrying stats open");
+    }
+    if (g_stats_server.fd()>=0) {
+        g_reactor.add(g_stats_server.fd(), on_stats_connection, nullptr);
+    }
+    if (!g_web_terminal.start()) {
+        ESP_LOGW(TAG, "Web terminal not available");
+    }
+    if (g_web_terminal.fd()>=0) {
+        g_reactor.add(g_web_terminal.fd(), on_web_event, nullptr);
     }
-    int max_fd = MAX(g_serial.fd(), g_telnet_server.fd());
-
     console_init();
 
-    int s;
-    fd_set rfds;
-    struct timeval tv = {
-        .tv_sec = 0,
-        .tv_usec = 10000,
-    };
     while (true) {
-        FD_ZERO(&rfds);
-        FD_SET(g_serial.fd(), &rfds);
-        FD_SET(g_telnet_server.fd(), &rfds);
-        if (telnet_client) {
-            FD_SET(telnet_client.fd(), &rfds);
+        for (auto &bridge : g_bridges) {
+            bridge.update_events();
+        }
+        if (g_web_terminal.fd()>=0) {
+            g_reactor.set_events(g_web_terminal.fd(), primary.serial().write_space()>=WebTerminal::EVENT_DATA_MAX ? Reactor::READ : 0);
         }
 
-        s = select(MAX(max_fd, telnet_client.fd())+1, &rfds, nullptr, nullptr, &tv);
+        // Sleep until there is work, or until held output or the open capture record is due
+        auto timeout = g_coalescer.wait(esp_timer_get_time());
+        auto capture_timeout = g_capture.wait();
+        if (timeout<0 || (capture_timeout>=0 && capture_timeout<timeout)) {
+            timeout = capture_timeout;
+        }
+        g_reactor.run(timeout);
 
-        if (s < 0) {
-            ESP_LOGE(TAG, "Select failed: errno %d", errno);
-        } 
-        else if (s == 0) {
-            //ESP_LOGI(TAG, "Timeout has been reached and nothing has been received");
+        if (g_coalescer.expire(esp_timer_get_time())) {
+            flush_clients();
         }
-        else {
-            if (FD_ISSET(g_serial.fd(), &rfds)) {
-                on_serial_data();
-            }
-            if (FD_ISSET(g_telnet_server.fd(), &rfds)) {
-                on_telnet_connection();
-            }
-            if (FD_ISSET(telnet_client.fd(), &rfds)) {
-                on_telnet_client_data();
-            }
+        g_capture.poll();
+        for (auto &bridge : g_bridges) {
+            bridge.poll();
         }
-        taskYIELD();
     }
 
-    g_telnet_server.stop();
-    g_serial.stop();
+    g_web_terminal.stop();
+    g_stats_server.stop();
+    for (auto &bridge : g_bridges) {
+        bridge.stop();
+    }
+    g_reactor.stop();
 }
-
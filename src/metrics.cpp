@@ -0,0 +1,41 @@
+#include "metrics.h"
+
+
+Histogram::Summary Histogram::summary() const
+{
+    uint32_t counts[BUCKETS];
+    Summary summary = { };
+    for (size_t i=0; i<BUCKETS; i++) {
+        counts[i] = bucket(i);
+        summary.count += counts[i];
+    }
+    if (m_max_generation.get()==m_generation.load(std::memory_order_relaxed)) {
+        summary.max = m_max.get();
+    }
+    if (summary.count==0) {
+        return summary;
+    }
+
+    uint32_t *percentiles[] { &summary.p50, &summary.p90, &summary.p99 };
+    const uint32_t shares[] { 50, 90, 99 };
+    uint32_t seen = 0;
+    size_t p = 0;
+    for (size_t i=0; i<BUCKETS && p<3; i++) {
+        seen += counts[i];
+        // Rank of the percentile rounded up, so p99 of a few samples is the largest one
+        while (p<3 && static_cast<uint64_t>(seen)*100 >= static_cast<uint64_t>(summary.count)*shares[p]) {
+            auto limit = bucket_limit(i);
+            *percentiles[p++] = limit<summary.max ? limit : summary.max;
+        }
+    }
+    return summary;
+}
+
+
+void Histogram::reset()
+{
+    for (size_t i=0; i<BUCKETS; i++) {
+        m_base[i].set(m_buckets[i].get());
+    }
+    m_generation.store(m_generation.load(std::memory_order_relaxed)+1, std::memory_order_release);
+}
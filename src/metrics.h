@@ -0,0 +1,212 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+
+/**
+ * Counter with a single writing task. An increment is a plain load and
+ * store, without a lock or atomic read-modify-write (the ESP32-C3 has no
+ * atomic instructions, those would take a critical section). Readers in
+ * other tasks see the old or the new value, never a torn one.
+ */
+class Counter {
+    public:
+        constexpr Counter() : m_value { 0 } {}
+
+        void add(uint32_t n = 1) { m_value.store(m_value.load(std::memory_order_relaxed)+n, std::memory_order_relaxed); }
+        void set(uint32_t value) { m_value.store(value, std::memory_order_relaxed); }
+        uint32_t get() const { return m_value.load(std::memory_order_relaxed); }
+
+    private:
+        std::atomic<uint32_t> m_value;
+};
+
+
+/**
+ * 64 bit single writer counter made of two words. The writer only touches
+ * the high word on a carry and bumps a sequence number around it, so
+ * readers retry in the rare case that they saw the two words mid-carry.
+ */
+class Counter64 {
+    public:
+        constexpr Counter64() : m_lo { 0 }, m_hi { 0 }, m_seq { 0 } {}
+
+        void add(uint32_t n)
+        {
+            auto lo = m_lo.load(std::memory_order_relaxed);
+            auto sum = lo+n;
+            if (sum<lo) {
+                auto seq = m_seq.load(std::memory_order_relaxed);
+                m_seq.store(seq+1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                m_hi.store(m_hi.load(std::memory_order_relaxed)+1, std::memory_order_relaxed);
+                m_lo.store(sum, std::memory_order_relaxed);
+                m_seq.store(seq+2, std::memory_order_release);
+                return;
+            }
+            m_lo.store(sum, std::memory_order_relaxed);
+        }
+
+        uint64_t get() const
+        {
+            uint32_t seq, hi, lo;
+            do {
+                seq = m_seq.load(std::memory_order_acquire);
+                hi = m_hi.load(std::memory_order_relaxed);
+                lo = m_lo.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+            } while ((seq & 1) || seq!=m_seq.load(std::memory_order_relaxed));
+            return (static_cast<uint64_t>(hi)<<32) | lo;
+        }
+
+    private:
+        std::atomic<uint32_t> m_lo;
+        std::atomic<uint32_t> m_hi;
+        std::atomic<uint32_t> m_seq;
+};
+
+
+/**
+ * Latency histogram with power of two buckets in microseconds: bucket 0
+ * holds 0, bucket i holds 2^(i-1) up to 2^i-1, the last bucket everything
+ * above. Samples are added by one task, like Counter. Another task can
+ * read and reset it: a reset takes a copy of the buckets as the new zero.
+ */
+class Histogram {
+    public:
+        static constexpr size_t BUCKETS { 24 };
+
+        struct Summary {
+            uint32_t count;
+            uint32_t p50;
+            uint32_t p90;
+            uint32_t p99;
+            uint32_t max;
+        };
+
+        constexpr Histogram() :
+            m_buckets { },
+            m_base { },
+            m_max { },
+            m_max_generation { },
+            m_generation { 0 }
+        {}
+
+        void record(uint32_t us)
+        {
+            size_t i = us ? 32-__builtin_clz(us) : 0;
+            m_buckets[i<BUCKETS ? i : BUCKETS-1].add();
+            // The first sample after a reset restarts the maximum
+            auto generation = m_generation.load(std::memory_order_acquire);
+            if (generation!=m_max_generation.get() || us>m_max.get()) {
+                m_max.set(us);
+                m_max_generation.set(generation);
+            }
+        }
+
+        /** Samples in bucket i since the last reset */
+        uint32_t bucket(size_t i) const { return m_buckets[i].get()-m_base[i].get(); }
+        /** Largest value bucket i holds */
+        static uint32_t bucket_limit(size_t i) { return i<BUCKETS-1 ? (1u<<i)-1 : UINT32_MAX; }
+
+        /** Percentiles are the upper limit of their bucket, at most the maximum */
+        Summary summary() const;
+        void reset();
+
+    private:
+        Counter m_buckets[BUCKETS];
+        // Written by the task that resets
+        Counter m_base[BUCKETS];
+        Counter m_max;
+        Counter m_max_generation;
+        std::atomic<uint32_t> m_generation;
+};
+
+
+/**
+ * Arrival times of chunks in a byte stream, passed from the task that
+ * writes the stream to the one that reads it. A chunk is identified by the
+ * stream position (a wrapping byte count) of its end. Stamps are dropped
+ * while the queue is full, the data is then timed by a later chunk.
+ */
+template<size_t N>
+class StampQueue {
+    public:
+        constexpr StampQueue() : m_end { }, m_time { }, m_head { 0 }, m_tail { 0 } {}
+
+        /** Data up to end arrived at time_us, from the writing task */
+        void push(uint32_t end, uint32_t time_us)
+        {
+            auto head = m_head.load(std::memory_order_relaxed);
+            if (head-m_tail.load(std::memory_order_acquire) >= N) {
+                return;
+            }
+            m_end[head%N] = end;
+            m_time[head%N] = time_us;
+            m_head.store(head+1, std::memory_order_release);
+        }
+
+        /** Call fn(time_us) for the chunks that end at or before pos and drop them, from the reading task */
+        template<typename F>
+        void pop(uint32_t pos, F fn)
+        {
+            auto tail = m_tail.load(std::memory_order_relaxed);
+            auto head = m_head.load(std::memory_order_acquire);
+            for (; tail!=head && static_cast<int32_t>(m_end[tail%N]-pos) <= 0; tail++) {
+                fn(m_time[tail%N]);
+            }
+            m_tail.store(tail, std::memory_order_release);
+        }
+
+        /** Arrival time of the oldest chunk not dropped yet */
+        bool front(uint32_t &time_us) const
+        {
+            auto tail = m_tail.load(std::memory_order_relaxed);
+            if (tail==m_head.load(std::memory_order_acquire)) {
+                return false;
+            }
+            time_us = m_time[tail%N];
+            return true;
+        }
+
+    private:
+        uint32_t m_end[N];
+        uint32_t m_time[N];
+        std::atomic<uint32_t> m_head;
+        std::atomic<uint32_t> m_tail;
+};
+
+
+/**
+ * Data path counters of the bridge, all written by the bridge loop. UART
+ * line errors are counted by the serial receive task, see Serial::counters().
+ */
+struct BridgeMetrics {
+    // Serial to network
+    Counter64 serial_read_bytes;
+    Counter serial_reads;
+    Counter iac_escapes;
+    Counter64 send_bytes;
+    Counter sends;
+    // Sends the socket only took part of, and the time clients then spent waiting for room
+    Counter short_sends;
+    Counter64 blocked_us;
+    // Data taken and produced by the compressor of clients that use MCCP2
+    Counter64 compress_in_bytes;
+    Counter64 compress_out_bytes;
+
+    // Network to serial
+    Counter64 client_read_bytes;
+    Counter client_reads;
+    Counter64 serial_write_bytes;
+    Counter serial_writes;
+
+    Counter connects;
+    Counter rejects;
+    Counter disconnects;
+
+    // From the serial receive task picking up a chunk to a send() that completes it
+    Histogram serial_to_client_us;
+};
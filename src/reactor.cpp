@@ -0,0 +1,175 @@
+#include "reactor.h"
+
+#include <unistd.h>
+#include <sys/errno.h>
+#include <esp_log.h>
+#include <esp_vfs_eventfd.h>
+
+static constexpr const char *TAG = "reactor";
+
+
+bool Reactor::start()
+{
+    if (m_wake_fd>=0) {
+        return true;
+    }
+    m_wake_fd = eventfd(0, 0);
+    if (m_wake_fd<0) {
+        ESP_LOGE(TAG, "Unable to create wake-up eventfd: errno %d", errno);
+        return false;
+    }
+    return add(m_wake_fd, on_wake, this);
+}
+
+
+void Reactor::stop()
+{
+    if (m_wake_fd>=0) {
+        remove(m_wake_fd);
+        ::close(m_wake_fd);
+        m_wake_fd = -1;
+    }
+}
+
+
+Reactor::Entry *Reactor::find(int fd)
+{
+    for (size_t i=0; i<m_count; i++) {
+        if (m_entries[i].fd==fd) {
+            return &m_entries[i];
+        }
+    }
+    return nullptr;
+}
+
+
+bool Reactor::add(int fd, handler_t handler, void *arg, uint8_t events)
+{
+    if (fd<0 || fd>=FD_SETSIZE || find(fd)) {
+        ESP_LOGE(TAG, "Invalid or duplicate descriptor %d", fd);
+        return false;
+    }
+    if (m_count==MAX_HANDLERS) {
+        ESP_LOGE(TAG, "No room for descriptor %d", fd);
+        return false;
+    }
+    m_entries[m_count++] = { fd, 0, handler, arg, m_pass };
+    if (fd>m_max_fd) {
+        m_max_fd = fd;
+    }
+    set_events(fd, events);
+    return true;
+}
+
+
+void Reactor::set_events(int fd, uint8_t events)
+{
+    auto entry = find(fd);
+    if (!entry || entry->events==events) {
+        return;
+    }
+    entry->events = events;
+    if (events & READ) {
+        FD_SET(fd, &m_rfds);
+    }
+    else {
+        FD_CLR(fd, &m_rfds);
+    }
+    if (events & WRITE) {
+        FD_SET(fd, &m_wfds);
+    }
+    else {
+        FD_CLR(fd, &m_wfds);
+    }
+}
+
+
+void Reactor::remove(int fd)
+{
+    auto entry = find(fd);
+    if (!entry) {
+        return;
+    }
+    set_events(fd, 0);
+    // The loop in run() may be past this entry, it is dropped once the pass ends
+    entry->fd = -1;
+    if (!m_dispatching) {
+        compact();
+    }
+}
+
+
+void Reactor::compact()
+{
+    size_t count = 0;
+    m_max_fd = -1;
+    for (size_t i=0; i<m_count; i++) {
+        if (m_entries[i].fd<0) {
+            continue;
+        }
+        m_entries[count++] = m_entries[i];
+        if (m_entries[i].fd>m_max_fd) {
+            m_max_fd = m_entries[i].fd;
+        }
+    }
+    m_count = count;
+}
+
+
+void Reactor::wake()
+{
+    uint64_t value = 1;
+    ::write(m_wake_fd, &value, sizeof(value));
+}
+
+
+void Reactor::on_wake(void *arg, int fd, uint8_t events)
+{
+    uint64_t value;
+    ::read(fd, &value, sizeof(value));
+}
+
+
+bool Reactor::run(int64_t timeout_us)
+{
+    fd_set rfds = m_rfds;
+    fd_set wfds = m_wfds;
+    struct timeval tv;
+    if (timeout_us>=0) {
+        tv.tv_sec = timeout_us/1000000;
+        tv.tv_usec = timeout_us%1000000;
+    }
+
+    auto s = select(m_max_fd+1, &rfds, &wfds, nullptr, timeout_us>=0 ? &tv : nullptr);
+    if (s<0) {
+        if (errno==EINTR) {
+            return true;
+        }
+        ESP_LOGE(TAG, "Select failed: errno %d", errno);
+        return false;
+    }
+
+    // A descriptor closed by a handler may be reused by one added after it
+    // in the same pass, which must not see the old descriptor's events
+    m_pass++;
+    m_dispatching = true;
+    for (size_t i=0; i<m_count && s>0; i++) {
+        auto &entry = m_entries[i];
+        if (entry.fd<0 || entry.pass==m_pass) {
+            continue;
+        }
+        uint8_t events = (FD_ISSET(entry.fd, &rfds) ? READ : 0) | (FD_ISSET(entry.fd, &wfds) ? WRITE : 0);
+        if (!events) {
+            continue;
+        }
+        s -= (events & READ ? 1 : 0) + (events & WRITE ? 1 : 0);
+        // An earlier handler may have changed what the descriptor waits for
+        events &= entry.events;
+        if (events) {
+            entry.handler(entry.arg, entry.fd, events);
+        }
+    }
+    m_dispatching = false;
+    compact();
+    return true;
+}
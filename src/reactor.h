@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <sys/select.h>
+
+
+/**
+ * Event loop of the bridge task.
+ *
+ * Descriptors are registered once with a handler and the events wanted,
+ * and their owners change the events as their state changes, so a pass
+ * only copies the select sets. run() blocks until a descriptor is ready,
+ * the timeout passes or another task calls wake(), then calls the
+ * handlers of the ready descriptors.
+ */
+class Reactor {
+    public:
+        static constexpr uint8_t READ { 1 };
+        static constexpr uint8_t WRITE { 2 };
+        static constexpr size_t MAX_HANDLERS { 32 };
+
+        typedef void (*handler_t)(void *arg, int fd, uint8_t events);
+
+        constexpr Reactor() :
+            m_entries { },
+            m_count { 0 },
+            m_rfds { },
+            m_wfds { },
+            m_max_fd { -1 },
+            m_wake_fd { -1 },
+            m_pass { 0 },
+            m_dispatching { false }
+        {}
+
+        /** Create the wake-up eventfd, the eventfd VFS must be registered */
+        bool start();
+        void stop();
+
+        /** Call handler when fd is ready for events. A descriptor added by a handler waits for the next pass */
+        bool add(int fd, handler_t handler, void *arg, uint8_t events = READ);
+        /** Change the events wanted, 0 keeps the descriptor registered but ignored */
+        void set_events(int fd, uint8_t events);
+        /** Forget fd, before it is closed. Handlers may remove any descriptor */
+        void remove(int fd);
+
+        /** Make run() return soon, from any task */
+        void wake();
+        /** Wait up to timeout_us for events, -1 waits for as long as it takes, and dispatch them */
+        bool run(int64_t timeout_us);
+
+    private:
+        struct Entry {
+            int fd;
+            uint8_t events;
+            handler_t handler;
+            void *arg;
+            // Pass the entry was added in, it is skipped for the rest of that pass
+            uint32_t pass;
+        };
+
+        Entry m_entries[MAX_HANDLERS];
+        size_t m_count;
+        fd_set m_rfds;
+        fd_set m_wfds;
+        int m_max_fd;
+        int m_wake_fd;
+        uint32_t m_pass;
+        bool m_dispatching;
+
+        Entry *find(int fd);
+        void compact();
+        static void on_wake(void *arg, int fd, uint8_t events);
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/**
+ * Word-at-a-time (SWAR) scanners for the telnet special bytes.
+ *
+ * Words are the native register width: 32 bit on the ESP32-C3 RISC-V core,
+ * 64 bit on the host. Unaligned heads and tails, and the word containing
+ * a hit, are handled one byte at a time.
+ */
+
+using scan_word_t = uintptr_t;
+
+static constexpr scan_word_t SCAN_ONES  { static_cast<scan_word_t>(~static_cast<scan_word_t>(0)) / 0xff };
+static constexpr scan_word_t SCAN_HIGHS { SCAN_ONES * 0x80 };
+
+
+/** Non-zero if any byte of v is 0x00 */
+static inline scan_word_t scan_has_zero(scan_word_t v)
+{
+    return (v - SCAN_ONES) & ~v & SCAN_HIGHS;
+}
+
+
+template<typename Special, typename WordHit>
+static inline size_t scan_bytes(const uint8_t *buf, size_t len, Special special, WordHit word_hit)
+{
+    const uint8_t *p = buf;
+    const uint8_t *end = buf+len;
+
+    while (p<end && (reinterpret_cast<uintptr_t>(p) & (sizeof(scan_word_t)-1))) {
+        if (special(*p)) return p-buf;
+        p++;
+    }
+    while (static_cast<size_t>(end-p) >= sizeof(scan_word_t)) {
+        scan_word_t v;
+        memcpy(&v, p, sizeof(v));
+        if (word_hit(v)) break;
+        p += sizeof(scan_word_t);
+    }
+    while (p<end) {
+        if (special(*p)) return p-buf;
+        p++;
+    }
+    return len;
+}
+
+
+/** Offset of the first 0xFF in buf, or len if there is none */
+static inline size_t scan_iac(const uint8_t *buf, size_t len)
+{
+    return scan_bytes(buf, len,
+        [](uint8_t ch) { return ch==0xff; },
+        [](scan_word_t v) { return scan_has_zero(~v); });
+}
+
+
+/** Offset of the first 0xFF or 0x00 in buf, or len if there is none */
+static inline size_t scan_iac_nul(const uint8_t *buf, size_t len)
+{
+    return scan_bytes(buf, len,
+        [](uint8_t ch) { return ch==0xff || ch==0x00; },
+        [](scan_word_t v) { return scan_has_zero(v) | scan_has_zero(~v); });
+}
@@ -2,34 +2,112 @@
 
 #include <string.h>
 #include <stdio.h>
-#include <sys/fcntl.h>
+#include <iterator>
 #include <sys/errno.h>
 #include <sys/unistd.h>
 #include <freertos/FreeRTOS.h>
 #include <esp_log.h>
-#include <esp_vfs.h>
-#include <esp_vfs_dev.h>
+#include <esp_timer.h>
+#include <esp_vfs_eventfd.h>
 #include <driver/uart.h>
 #include <driver/gpio.h>
 #include <nvs.h>
+#include <sdkconfig.h>
+#if CONFIG_UART_ISR_IN_IRAM
+#include <esp_intr_alloc.h>
+#endif
 
 
 static constexpr const char* TAG = "serial";
 
-static constexpr int         SERIAL_RX_BUF_SIZE { 1024 };
 static constexpr int         SERIAL_DEFAULT_BAUD_RATE { 1500000 };
 
-static constexpr const char *SERIAL_NVS_NAMESPACE { "serial" };
 static constexpr const char *SERIAL_NVS_BAUD      { "baud" };
+static constexpr const char *SERIAL_NVS_RX_DMA    { "rx_dma" };
+static constexpr const char *SERIAL_NVS_PROFILE   { "profile" };
+static constexpr const char *SERIAL_NVS_FLOW      { "flow" };
+static constexpr const char *SERIAL_NVS_RTS_PIN   { "rts_pin" };
+static constexpr const char *SERIAL_NVS_CTS_PIN   { "cts_pin" };
 
-bool Serial::start()
+// Keep the UART interrupt running while the flash cache is disabled
+#if CONFIG_UART_ISR_IN_IRAM
+static constexpr int         SERIAL_INTR_FLAGS { ESP_INTR_FLAG_IRAM };
+#else
+static constexpr int         SERIAL_INTR_FLAGS { 0 };
+#endif
+
+// Stream buffers between the UART tasks and the network side
+static constexpr size_t      SERIAL_RX_STREAM_SIZE { 4096 };
+static constexpr size_t      SERIAL_TX_STREAM_SIZE { 2048 };
+// Driver TX ring, uart_write_bytes() returns once data is copied in
+static constexpr int         SERIAL_TX_RING_SIZE { 4096 };
+// Longest wait for the UART to finish sending before the transmit task checks its stream again
+static constexpr uint32_t    SERIAL_TX_DONE_WAIT_MS { 10 };
+static constexpr size_t      SERIAL_RX_CHUNK { 512 };
+static constexpr size_t      SERIAL_TX_CHUNK { 256 };
+static constexpr size_t      SERIAL_TX_WAKE_SPACE { 256 };
+// Receive stops once a chunk no longer fits the stream, and resumes when it has drained to a quarter
+static constexpr size_t      SERIAL_RX_HIGH_WATER { SERIAL_RX_STREAM_SIZE - SERIAL_RX_CHUNK };
+static constexpr size_t      SERIAL_RX_LOW_WATER { SERIAL_RX_STREAM_SIZE / 4 };
+static constexpr int         SERIAL_EVENT_QUEUE_LEN { 32 };
+static constexpr uint32_t    SERIAL_RX_IDLE_MS { 100 };
+static constexpr uint32_t    SERIAL_TASK_STACK { 3072 };
+// Both above the network loop, receive first so the UART is always drained
+static constexpr UBaseType_t SERIAL_RX_TASK_PRIORITY { 12 };
+static constexpr UBaseType_t SERIAL_TX_TASK_PRIORITY { 11 };
+
+// RX FIFO fill at which the hardware drops RTS or sends XOFF, and sends XON again
+static constexpr uint8_t     SERIAL_FLOW_CTRL_THRESH { 100 };
+static constexpr uint16_t    SERIAL_XON_THRESH  { 32 };
+static constexpr uint16_t    SERIAL_XOFF_THRESH { 100 };
+
+
+/**
+ * Receive settings for baud rates up to max_baud. The RX interrupt fires
+ * once the FIFO holds full_thresh bytes, or the line has been idle for
+ * timeout symbols.
+ */
+struct RxProfile {
+    uint32_t max_baud;
+    uint8_t  full_thresh;
+    uint8_t  timeout;
+    uint16_t ring_size;     // UART driver RX ring, applied when the driver is installed
+    uint16_t read_chunk;    // Bytes the bridge takes per read
+};
+
+// Interrupt on nearly every byte at low rates, the FIFO still has to absorb the ISR latency at high ones
+static constexpr RxProfile SERIAL_LATENCY_PROFILES[] {
+    {   19200,   1,  2, 1024,  64 },
+    {  115200,   8,  2, 1024,  64 },
+    {  921600,  32,  3, 2048, 256 },
+    { UINT32_MAX, 64, 4, 4096, 256 },
+};
+
+// Fill most of the 128 byte FIFO and wait a full word before reporting a pause
+static constexpr RxProfile SERIAL_THROUGHPUT_PROFILES[] {
+    {   19200,  32, 10, 1024, 256 },
+    {  115200,  64, 10, 2048, 256 },
+    {  921600,  96, 10, 4096, 512 },
+    { UINT32_MAX, 100, 10, 8192, 512 },
+};
+
+
+static const RxProfile &find_profile(Serial::Profile profile, uint32_t baud)
 {
-    if (!uart_is_driver_installed(m_port)) {
-        ESP_LOGI(TAG, "Installing UART Driver");
-        ESP_ERROR_CHECK( uart_driver_install(m_port, SERIAL_RX_BUF_SIZE*2, 0, 0, nullptr, 0) );
+    auto &table = profile==Serial::Profile::THROUGHPUT ? SERIAL_THROUGHPUT_PROFILES : SERIAL_LATENCY_PROFILES;
+    for (auto &entry: table) {
+        if (baud<=entry.max_baud) {
+            return entry;
+        }
     }
+    return table[std::size(table)-1];
+}
+
 
-    uart_config_t uart_config = {
+
+void Serial::load_config(uart_config_t &config)
+{
+    config = {
         .baud_rate = SERIAL_DEFAULT_BAUD_RATE,
         .data_bits = UART_DATA_8_BITS,
         .parity    = UART_PARITY_DISABLE,
@@ -39,79 +117,423 @@ bool Serial::start()
         .source_clk = UART_SCLK_DEFAULT,
     };
 
+    m_stored_flow_control = FlowControl::NONE;
+
     // Load settings from NVS
     nvs_handle_t handle;
-    auto err = nvs_open(SERIAL_NVS_NAMESPACE, NVS_READONLY, &handle);
+    auto err = nvs_open(m_nvs_namespace, NVS_READONLY, &handle);
     if (err == ESP_OK) {
         uint32_t value = SERIAL_DEFAULT_BAUD_RATE;
         if (nvs_get_u32(handle, SERIAL_NVS_BAUD, &value)==ESP_OK) {
-            uart_config.baud_rate = value;
+            config.baud_rate = value;
+        }
+        if (nvs_get_u32(handle, SERIAL_NVS_FLOW, &value)==ESP_OK) {
+            m_stored_flow_control = static_cast<FlowControl>(value);
         }
         nvs_close(handle);
     }
+}
+
+
+static uint32_t load_u32(const char *nvs_namespace, const char *key, uint32_t value)
+{
+    nvs_handle_t handle;
+    if (nvs_open(nvs_namespace, NVS_READONLY, &handle)==ESP_OK) {
+        nvs_get_u32(handle, key, &value);
+        nvs_close(handle);
+    }
+    return value;
+}
+
+
+static bool store_u32(const char *nvs_namespace, const char *key, uint32_t value)
+{
+    nvs_handle_t handle;
+    auto res = nvs_open(nvs_namespace, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+
+    res = nvs_set_u32(handle, key, value);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS %s: err=%d", key, res);
+        nvs_close(handle);
+        return false;
+    }
 
+    nvs_commit(handle);
+    nvs_close(handle);
+    return true;
+}
 
 
-    ESP_ERROR_CHECK(uart_param_config(m_port, &uart_config));
-    ESP_ERROR_CHECK(uart_set_pin(m_port, m_tx_pin, m_rx_pin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+bool Serial::apply_config(const uart_config_t &config)
+{
+    if (uart_param_config(m_port, &config)!=ESP_OK) {
+        ESP_LOGE(TAG, "Error configuring UART %d", m_port);
+        return false;
+    }
+    uart_set_line_inverse(m_port, UART_SIGNAL_INV_DISABLE);
+    apply_profile(config.baud_rate);
+    if (!set_flow_control(m_stored_flow_control, false)) {
+        set_flow_control(FlowControl::NONE, false);
+    }
+    m_break = false;
+    m_break_pending = false;
+    set_dtr(true);
+    set_rts(true);
+    return true;
+}
 
 
-    char dev[32];
-    sprintf(dev, "/dev/uart/%d", m_port);
+bool Serial::start()
+{
+    uart_config_t uart_config;
+    load_config(uart_config);
+    m_profile = static_cast<Profile>(load_u32(m_nvs_namespace, SERIAL_NVS_PROFILE, static_cast<uint32_t>(Profile::LATENCY)));
+    m_rts_pin = static_cast<gpio_num_t>(static_cast<int32_t>(load_u32(m_nvs_namespace, SERIAL_NVS_RTS_PIN, m_rts_pin)));
+    m_cts_pin = static_cast<gpio_num_t>(static_cast<int32_t>(load_u32(m_nvs_namespace, SERIAL_NVS_CTS_PIN, m_cts_pin)));
 
-    m_fd = open(dev,  O_RDWR|O_NONBLOCK);
-    if (m_fd<0) {
-        ESP_LOGE(TAG, "Cannot open serial '%s': errno %d", dev, errno);
+    if (!uart_is_driver_installed(m_port)) {
+        auto ring_size = find_profile(m_profile, uart_config.baud_rate).ring_size;
+        ESP_LOGI(TAG, "Installing UART Driver, %u byte RX ring", ring_size);
+        auto res = uart_driver_install(m_port, ring_size, SERIAL_TX_RING_SIZE, SERIAL_EVENT_QUEUE_LEN, &m_uart_queue, SERIAL_INTR_FLAGS);
+        if (res!=ESP_OK) {
+            ESP_LOGE(TAG, "Error installing UART %d driver: err=%d", m_port, res);
+            return false;
+        }
+    }
+
+    ESP_ERROR_CHECK(uart_set_pin(m_port, m_tx_pin, m_rx_pin, m_rts_pin, m_cts_pin));
+    if (!apply_config(uart_config)) {
         return false;
     }
-    else {
-        ESP_LOGI(TAG, "Opened serial device %s at %d", dev, uart_config.baud_rate);
+    ESP_LOGI(TAG, "UART %d started at %d", m_port, uart_config.baud_rate);
+
+    if (load_u32(m_nvs_namespace, SERIAL_NVS_RX_DMA, 0)) {
+#if SERIAL_RX_DMA_SUPPORTED
+        auto idle = find_profile(m_profile, uart_config.baud_rate).timeout;
+        if (!m_rx_dma.running() && !m_rx_dma.start(m_port, m_uart_queue, idle)) {
+            ESP_LOGW(TAG, "DMA receive unavailable, using the UART driver");
+        }
+#else
+        ESP_LOGW(TAG, "DMA receive not supported on this target");
+#endif
     }
 
+    m_running = true;
+    if (m_event_fd<0) {
+        m_event_fd = eventfd(0, EFD_SUPPORT_ISR);
+        if (m_event_fd<0) {
+            ESP_LOGE(TAG, "Cannot create serial event: errno %d", errno);
+            stop();
+            return false;
+        }
+    }
+    if (!m_rx_stream) {
+        m_rx_stream = xStreamBufferCreate(SERIAL_RX_STREAM_SIZE, 1);
+    }
+    if (!m_tx_stream) {
+        m_tx_stream = xStreamBufferCreate(SERIAL_TX_STREAM_SIZE, 1);
+    }
+    if (!m_rx_stream || !m_tx_stream) {
+        ESP_LOGE(TAG, "Cannot allocate serial stream buffers");
+        stop();
+        return false;
+    }
 
-    esp_vfs_dev_uart_use_driver(m_port);
-    esp_vfs_dev_uart_port_set_rx_line_endings(m_port, ESP_LINE_ENDINGS_LF);
-    esp_vfs_dev_uart_port_set_tx_line_endings(m_port, ESP_LINE_ENDINGS_LF);
+    if (!m_rx_task && xTaskCreate(rx_task, "serial_rx", SERIAL_TASK_STACK, this, SERIAL_RX_TASK_PRIORITY, &m_rx_task)!=pdPASS) {
+        ESP_LOGE(TAG, "Cannot create serial receive task");
+        m_rx_task = nullptr;
+        stop();
+        return false;
+    }
+    if (!m_tx_task && xTaskCreate(tx_task, "serial_tx", SERIAL_TASK_STACK, this, SERIAL_TX_TASK_PRIORITY, &m_tx_task)!=pdPASS) {
+        ESP_LOGE(TAG, "Cannot create serial transmit task");
+        m_tx_task = nullptr;
+        stop();
+        return false;
+    }
 
     return true;
 }
 
 void Serial::stop()
 {
-    if (m_fd>=0) {
-        close(m_fd);
-        m_fd = -1;
+    // The tasks see the flag and end themselves
+    m_running = false;
+}
+
+
+void Serial::notify()
+{
+    uint64_t value = 1;
+    ::write(m_event_fd, &value, sizeof(value));
+}
+
+
+bool Serial::throttle()
+{
+    auto used = SERIAL_RX_STREAM_SIZE - xStreamBufferSpacesAvailable(m_rx_stream);
+    if (!m_throttled && used > SERIAL_RX_HIGH_WATER) {
+        m_throttled = true;
+        m_counters.throttles++;
+        // Leave the data in the FIFO, so the hardware flow control holds the target.
+        // DMA stops by itself when no buffer is given back.
+        if (m_flow_control!=FlowControl::NONE && !rx_dma()) {
+            uart_disable_rx_intr(m_port);
+        }
     }
+    else if (m_throttled && used <= SERIAL_RX_LOW_WATER) {
+        m_throttled = false;
+        if (!rx_dma()) {
+            uart_enable_rx_intr(m_port);
+        }
+    }
+    return m_throttled;
 }
 
 
+void Serial::forward(const uint8_t *data, size_t len)
+{
+    m_counters.rx_bytes += len;
+    // Waits while the network side is behind, the driver or DMA keeps buffering meanwhile
+    xStreamBufferSend(m_rx_stream, data, len, portMAX_DELAY);
+    m_rx_stamps.push(m_counters.rx_bytes, m_rx_event_time);
+    notify();
+}
+
 
-ssize_t Serial::read(uint8_t *buf, size_t count)
+void Serial::receive()
 {
-    return ::read(m_fd, buf, count);
+#if SERIAL_RX_DMA_SUPPORTED
+    const uint8_t *data;
+    size_t count;
+    while (m_rx_dma.running() && !throttle() && m_rx_dma.next(data, count)) {
+        if (count>0) {
+            forward(data, count);
+        }
+        m_rx_dma.release();
+    }
+#endif
+
+    // Also empties what the driver held when DMA took over
+    uint8_t buf[SERIAL_RX_CHUNK];
+    size_t buffered = 0;
+    while (!throttle() && uart_get_buffered_data_len(m_port, &buffered)==ESP_OK && buffered>0) {
+        auto len = uart_read_bytes(m_port, buf, buffered<sizeof(buf) ? buffered : sizeof(buf), 0);
+        if (len<=0) {
+            break;
+        }
+        forward(buf, len);
+    }
 }
 
-bool Serial::write(const uint8_t *buf, size_t count)
+
+void Serial::rx_loop()
 {
-    while (count) {
-        auto res = ::write(m_fd, buf, count);
-        if (res<=0) {
-            ESP_LOGW(TAG, "Error writing %u bytes to serial: errno=%d", count, errno);
-            return false;
+    uart_event_t event;
+
+    while (m_running) {
+        auto received = xQueueReceive(m_uart_queue, &event, pdMS_TO_TICKS(SERIAL_RX_IDLE_MS));
+        // Data is timed from here, the closest the task gets to the interrupt
+        m_rx_event_time = esp_timer_get_time();
+        if (received!=pdTRUE) {
+            // Data events are lost if the queue fills up while we wait for the network
+            receive();
+            continue;
+        }
+
+        switch (event.type) {
+            case UART_DATA:
+                receive();
+                break;
+            case UART_FIFO_OVF:
+                m_counters.fifo_overflows++;
+                m_line_errors |= LINE_OVERRUN_ERROR;
+                receive();
+                break;
+            case UART_BUFFER_FULL:
+                m_counters.buffer_full++;
+                m_line_errors |= LINE_OVERRUN_ERROR;
+                receive();
+                break;
+            case UART_BREAK:
+                m_counters.breaks++;
+                m_line_errors |= LINE_BREAK_DETECT;
+                break;
+            case UART_FRAME_ERR:
+                m_counters.frame_errors++;
+                m_line_errors |= LINE_FRAMING_ERROR;
+                break;
+            case UART_PARITY_ERR:
+                m_counters.parity_errors++;
+                m_line_errors |= LINE_PARITY_ERROR;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+
+void Serial::tx_loop()
+{
+    uint8_t buf[SERIAL_TX_CHUNK];
+    uint32_t written = m_tx_queued;
+
+    while (m_running) {
+        if (m_tx_purge.exchange(false)) {
+            // Only this task may read the stream, discarded data counts as sent
+            while (auto len = xStreamBufferReceive(m_tx_stream, buf, sizeof(buf), 0)) {
+                written += len;
+            }
+            m_tx_stamps.pop(written, [](uint32_t) {});
+        }
+
+        // Keep checking for transmit done while the UART is still sending
+        auto wait = m_tx_drained==written ? pdMS_TO_TICKS(1000) : 0;
+        auto len = xStreamBufferReceive(m_tx_stream, buf, sizeof(buf), wait);
+        if (len>0) {
+            // The network side may be holding back input until there is room.
+            // Space is taken after the receive: measured before, a write in
+            // between could leave the loop waiting for a wake-up that never comes.
+            if (xStreamBufferSpacesAvailable(m_tx_stream) < SERIAL_TX_WAKE_SPACE+len) {
+                notify();
+            }
+            if (uart_write_bytes(m_port, buf, len)<0) {
+                ESP_LOGW(TAG, "Error writing %u bytes to serial", len);
+            }
+            written += len;
+            m_counters.tx_bytes += len;
+            uint32_t now = esp_timer_get_time();
+            m_tx_stamps.pop(written, [&](uint32_t time_us) {
+                m_tx_latency.record(now-time_us);
+            });
+        }
+
+        if (m_tx_drained!=written && xStreamBufferIsEmpty(m_tx_stream)
+            && uart_wait_tx_done(m_port, pdMS_TO_TICKS(SERIAL_TX_DONE_WAIT_MS))==ESP_OK) {
+            m_tx_drained = written;
+            if (m_break_pending) {
+                notify();
+            }
         }
-        buf+=res;
-        count-=res;
     }
-    return true;
 }
 
 
-bool Serial::set_baud(uint32_t baud)
+void Serial::rx_task(void *arg)
+{
+    auto self = static_cast<Serial*>(arg);
+    self->rx_loop();
+    self->m_rx_task = nullptr;
+    vTaskDelete(nullptr);
+}
+
+
+void Serial::tx_task(void *arg)
+{
+    auto self = static_cast<Serial*>(arg);
+    self->tx_loop();
+    self->m_tx_task = nullptr;
+    vTaskDelete(nullptr);
+}
+
+
+
+ssize_t Serial::read(uint8_t *buf, size_t count, uint32_t *stamp)
+{
+    auto len = xStreamBufferReceive(m_rx_stream, buf, count, 0);
+    if (len>0 && stamp) {
+        // The first byte belongs to the oldest chunk that ends after the read position
+        m_rx_stamps.pop(m_rx_read, [](uint32_t) {});
+        if (!m_rx_stamps.front(*stamp)) {
+            *stamp = esp_timer_get_time();
+        }
+    }
+    m_rx_read += len;
+    if (xStreamBufferIsEmpty(m_rx_stream)) {
+        // Clear the wake-up, and set it again if the receive task got in between
+        uint64_t value;
+        ::read(m_event_fd, &value, sizeof(value));
+        if (!xStreamBufferIsEmpty(m_rx_stream)) {
+            notify();
+        }
+    }
+    if (m_throttled && SERIAL_RX_STREAM_SIZE-xStreamBufferSpacesAvailable(m_rx_stream) <= SERIAL_RX_LOW_WATER) {
+        // Let the receive task resume right away
+        uart_event_t event = { };
+        event.type = UART_DATA;
+        xQueueSend(m_uart_queue, &event, 0);
+    }
+    return len;
+}
+
+size_t Serial::write(const uint8_t *buf, size_t count)
+{
+    auto res = xStreamBufferSend(m_tx_stream, buf, count, 0);
+    m_tx_queued += res;
+    if (res>0) {
+        m_tx_stamps.push(m_tx_queued, esp_timer_get_time());
+    }
+    return res;
+}
+
+
+void Serial::poll()
+{
+    if (m_break_pending && tx_done()) {
+        m_break_pending = false;
+        apply_break(true);
+    }
+}
+
+
+size_t Serial::write_space() const
+{
+    return xStreamBufferSpacesAvailable(m_tx_stream);
+}
+
+
+void Serial::apply_profile(uint32_t baud)
+{
+    auto &entry = find_profile(m_profile, baud);
+    uart_set_rx_full_threshold(m_port, entry.full_thresh);
+    uart_set_rx_timeout(m_port, entry.timeout);
+#if SERIAL_RX_DMA_SUPPORTED
+    if (m_rx_dma.running()) {
+        m_rx_dma.set_idle_symbols(entry.timeout);
+    }
+#endif
+    m_read_chunk = entry.read_chunk;
+}
+
+
+bool Serial::set_profile(Profile profile, bool persist)
+{
+    m_profile = profile;
+    apply_profile(baud());
+    if (!persist) {
+        return true;
+    }
+    return store_u32(m_nvs_namespace, SERIAL_NVS_PROFILE, static_cast<uint32_t>(profile));
+}
+
+
+bool Serial::set_baud(uint32_t baud, bool persist)
 {
     auto res = uart_set_baudrate(m_port, baud);
     if (res==ESP_OK) {
+        apply_profile(baud);
+        if (!persist) {
+            ESP_LOGI(TAG, "Baud rate set to %lu (not stored)", baud);
+            return true;
+        }
+
         nvs_handle_t handle;
-        res = nvs_open(SERIAL_NVS_NAMESPACE, NVS_READWRITE, &handle);
+        res = nvs_open(m_nvs_namespace, NVS_READWRITE, &handle);
         if (res != ESP_OK) {
             ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
             return false;
@@ -138,15 +560,229 @@ bool Serial::set_baud(uint32_t baud)
 }
 
 
+uint32_t Serial::baud() const
+{
+    uint32_t baud = 0;
+    uart_get_baudrate(m_port, &baud);
+    return baud;
+}
+
+
+bool Serial::set_data_bits(uart_word_length_t bits)
+{
+    auto res = uart_set_word_length(m_port, bits);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error setting data bits to %d: err=%d", bits, res);
+        return false;
+    }
+    return true;
+}
+
+
+uart_word_length_t Serial::data_bits() const
+{
+    uart_word_length_t bits = UART_DATA_8_BITS;
+    uart_get_word_length(m_port, &bits);
+    return bits;
+}
+
+
+bool Serial::set_parity(uart_parity_t parity)
+{
+    auto res = uart_set_parity(m_port, parity);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error setting parity to %d: err=%d", parity, res);
+        return false;
+    }
+    return true;
+}
+
+
+uart_parity_t Serial::parity() const
+{
+    uart_parity_t parity = UART_PARITY_DISABLE;
+    uart_get_parity(m_port, &parity);
+    return parity;
+}
+
+
+bool Serial::set_stop_bits(uart_stop_bits_t bits)
+{
+    auto res = uart_set_stop_bits(m_port, bits);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error setting stop bits to %d: err=%d", bits, res);
+        return false;
+    }
+    return true;
+}
+
+
+uart_stop_bits_t Serial::stop_bits() const
+{
+    uart_stop_bits_t bits = UART_STOP_BITS_1;
+    uart_get_stop_bits(m_port, &bits);
+    return bits;
+}
+
+
+bool Serial::set_flow_control(FlowControl flow, bool persist)
+{
+    int hw = UART_HW_FLOWCTRL_DISABLE;
+    if (flow==FlowControl::HARDWARE) {
+        if (m_rts_pin==GPIO_NUM_NC && m_cts_pin==GPIO_NUM_NC) {
+            ESP_LOGE(TAG, "Hardware flow control needs RTS or CTS pins");
+            return false;
+        }
+        hw = (m_rts_pin!=GPIO_NUM_NC ? UART_HW_FLOWCTRL_RTS : 0) | (m_cts_pin!=GPIO_NUM_NC ? UART_HW_FLOWCTRL_CTS : 0);
+    }
+    auto res = uart_set_hw_flow_ctrl(m_port, static_cast<uart_hw_flowcontrol_t>(hw), SERIAL_FLOW_CTRL_THRESH);
+    if (res==ESP_OK) {
+        res = uart_set_sw_flow_ctrl(m_port, flow==FlowControl::XONXOFF, SERIAL_XON_THRESH, SERIAL_XOFF_THRESH);
+    }
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error setting flow control to %d: err=%d", static_cast<int>(flow), res);
+        return false;
+    }
+    m_flow_control = flow;
+    if (!persist) {
+        return true;
+    }
+    if (!store_u32(m_nvs_namespace, SERIAL_NVS_FLOW, static_cast<uint32_t>(flow))) {
+        return false;
+    }
+    m_stored_flow_control = flow;
+    return true;
+}
+
+
+bool Serial::set_flow_pins(gpio_num_t rts_pin, gpio_num_t cts_pin)
+{
+    return store_u32(m_nvs_namespace, SERIAL_NVS_RTS_PIN, static_cast<uint32_t>(rts_pin))
+        && store_u32(m_nvs_namespace, SERIAL_NVS_CTS_PIN, static_cast<uint32_t>(cts_pin));
+}
+
+
+bool Serial::set_break(bool enable)
+{
+    if (enable && !tx_done()) {
+        // Started by poll() once the queued data is out, rather than corrupting it
+        m_break_pending = true;
+        m_break = true;
+        return true;
+    }
+    return apply_break(enable);
+}
+
+
+bool Serial::apply_break(bool enable)
+{
+    m_break_pending = false;
+    // Holding TX inverted keeps the line at space for as long as the break lasts
+    auto res = uart_set_line_inverse(m_port, enable ? UART_SIGNAL_TXD_INV : UART_SIGNAL_INV_DISABLE);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Error setting break: err=%d", res);
+        return false;
+    }
+    m_break = enable;
+    return true;
+}
+
+
+bool Serial::set_dtr(bool enable)
+{
+    // Signals are active low
+    if (uart_set_dtr(m_port, enable ? 0 : 1)!=ESP_OK) {
+        return false;
+    }
+    m_dtr = enable;
+    return true;
+}
+
+
+bool Serial::set_rts(bool enable)
+{
+    // Fails while the hardware flow control owns RTS
+    if (uart_set_rts(m_port, enable ? 0 : 1)!=ESP_OK) {
+        return false;
+    }
+    m_rts = enable;
+    return true;
+}
+
+
+void Serial::purge_rx()
+{
+    uart_flush_input(m_port);
+#if SERIAL_RX_DMA_SUPPORTED
+    if (m_rx_dma.running()) {
+        // The flush turns the driver receive interrupts back on
+        uart_disable_rx_intr(m_port);
+    }
+#endif
+    uint8_t buf[64];
+    while (read(buf, sizeof(buf))>0) {
+    }
+}
+
+
+void Serial::purge_tx()
+{
+    // Data already handed to the driver can't be taken back.
+    // The transmit task empties the stream, it is the only reader allowed
+    m_tx_purge = true;
+}
+
+
+uint8_t Serial::line_state()
+{
+    // Errors are latched by the receive task until they have been reported
+    uint8_t state = m_line_errors.exchange(0);
+
+    size_t buffered = 0;
+    uart_get_buffered_data_len(m_port, &buffered);
+    if (buffered>0 || !xStreamBufferIsEmpty(m_rx_stream)) {
+        state |= LINE_DATA_READY;
+    }
+    return state;
+}
+
+
+bool Serial::set_rx_dma(bool enable)
+{
+    return store_u32(m_nvs_namespace, SERIAL_NVS_RX_DMA, enable ? 1 : 0);
+}
+
+
+bool Serial::rx_dma() const
+{
+#if SERIAL_RX_DMA_SUPPORTED
+    return m_rx_dma.running();
+#else
+    return false;
+#endif
+}
+
+
+bool Serial::reload()
+{
+    uart_config_t uart_config;
+    load_config(uart_config);
+    if (!apply_config(uart_config)) {
+        return false;
+    }
+    ESP_LOGI(TAG, "Settings reloaded, baud %d", uart_config.baud_rate);
+    return true;
+}
+
+
 bool Serial::restore()
 {
     nvs_handle_t handle;
-    auto res = nvs_open(SERIAL_NVS_NAMESPACE, NVS_READWRITE, &handle);
-    if (res != ESP_OK) {
+    auto res = nvs_open(m_nvs_namespace, NVS_READWRITE, &handle);
+    if (res == ESP_OK) {
         nvs_erase_all(handle);
         nvs_commit(handle);
         nvs_close(handle);
     }
-    uart_set_baudrate(m_port, SERIAL_DEFAULT_BAUD_RATE);
-    return true;
+    return reload();
 }
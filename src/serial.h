@@ -2,41 +2,235 @@
 
 #include <cstdint>
 #include <unistd.h>
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/stream_buffer.h>
+#include <freertos/queue.h>
 #include <driver/uart.h>
 #include <driver/gpio.h>
 
+#include "serial_dma.h"
+#include "metrics.h"
 
+
+/**
+ * UART side of the bridge. A receive task and a transmit task move data 
+ * between the UART and a stream buffer each, so the network side never 
+ * waits on the UART and the UART is drained while the network is busy.
+ * Transmit data goes on through the driver TX ring, so a large paste
+ * drains at line rate while the bridge loop carries on.
+ * The receive task is driven by the UART driver event queue, and can take
+ * its data from the UHCI DMA instead of the driver where supported.
+ *
+ * When the network side falls behind, the receive stream fills up and the
+ * receive task stops taking data from the UART until it has drained to a
+ * low watermark. With flow control the UART FIFO then fills and the
+ * hardware drops RTS or sends XOFF, so the target waits instead of data
+ * being lost.
+ */
 class Serial {
     public:
-        constexpr Serial(uart_port_t port, gpio_num_t tx_pin, gpio_num_t rx_pin) :
+        enum class FlowControl : uint8_t {
+            NONE,
+            XONXOFF,
+            HARDWARE,
+        };
+
+        /** Receive tuning: react to each byte quickly, or take fewer interrupts */
+        enum class Profile : uint8_t {
+            LATENCY,
+            THROUGHPUT,
+        };
+
+        // Largest read_chunk() of any profile
+        static constexpr size_t READ_CHUNK_MAX { 512 };
+
+        // 16550 style line status bits, as reported by line_state()
+        static constexpr uint8_t LINE_DATA_READY     { 0x01 };
+        static constexpr uint8_t LINE_OVERRUN_ERROR  { 0x02 };
+        static constexpr uint8_t LINE_PARITY_ERROR   { 0x04 };
+        static constexpr uint8_t LINE_FRAMING_ERROR  { 0x08 };
+        static constexpr uint8_t LINE_BREAK_DETECT   { 0x10 };
+
+        // Written by the receive task, except tx_bytes which the transmit task writes
+        struct Counters {
+            uint32_t rx_bytes;
+            uint32_t fifo_overflows;
+            uint32_t buffer_full;
+            uint32_t breaks;
+            uint32_t frame_errors;
+            uint32_t parity_errors;
+            uint32_t throttles;
+            uint32_t tx_bytes;
+        };
+
+        /** Settings are stored in the NVS namespace given, one per UART */
+        constexpr Serial(uart_port_t port, gpio_num_t tx_pin, gpio_num_t rx_pin, gpio_num_t rts_pin = GPIO_NUM_NC, gpio_num_t cts_pin = GPIO_NUM_NC, const char *nvs_namespace = "serial") :
             m_port { port },
             m_tx_pin { tx_pin },
             m_rx_pin { rx_pin },
-            m_fd { -1 }
+            m_rts_pin { rts_pin },
+            m_cts_pin { cts_pin },
+            m_nvs_namespace { nvs_namespace },
+            m_running { false },
+            m_uart_queue { nullptr },
+            m_event_fd { -1 },
+            m_rx_stream { nullptr },
+            m_tx_stream { nullptr },
+            m_rx_task { nullptr },
+            m_tx_task { nullptr },
+            m_counters { },
+            m_line_errors { 0 },
+            m_throttled { false },
+            m_tx_queued { 0 },
+            m_tx_drained { 0 },
+            m_tx_purge { false },
+            m_rx_event_time { 0 },
+            m_rx_read { 0 },
+            m_rx_stamps { },
+            m_tx_stamps { },
+            m_tx_latency { },
+            m_profile { Profile::LATENCY },
+            m_read_chunk { READ_CHUNK_MAX },
+            m_flow_control { FlowControl::NONE },
+            m_stored_flow_control { FlowControl::NONE },
+            m_break { false },
+            m_break_pending { false },
+            m_dtr { true },
+            m_rts { true }
         {}
 
         bool start();
         void stop();
 
-        ssize_t read(uint8_t *buf, size_t count);
-        bool write(const uint8_t *buf, size_t count);
+        /** Take received data, never blocks. stamp is set to the time the receive task picked up the first byte */
+        ssize_t read(uint8_t *buf, size_t count, uint32_t *stamp = nullptr);
+        /** Queue data for transmission, never blocks. Returns the number of bytes queued, up to write_space() */
+        size_t write(const uint8_t *buf, size_t count);
+        size_t write_space() const;
+        /** Everything queued has left the UART */
+        bool tx_done() const { return m_tx_drained==m_tx_queued; }
+
+        /** Readable while received data is waiting, when transmit space has been freed, or on transmit done */
+        int fd() const { return m_event_fd; }
+        /** Carry out requests waiting for transmit done, called from the bridge loop */
+        void poll();
+        /** Bytes the bridge should take per read at the current baud rate */
+        size_t read_chunk() const { return m_read_chunk; }
 
-        int fd() const { return m_fd; }
+        /** Set baud rate, and store it in NVS if persist is set */
+        bool set_baud(uint32_t baud, bool persist = true);
+        uint32_t baud() const;
 
-        bool set_baud(uint32_t baud);
+        bool set_data_bits(uart_word_length_t bits);
+        uart_word_length_t data_bits() const;
+        bool set_parity(uart_parity_t parity);
+        uart_parity_t parity() const;
+        bool set_stop_bits(uart_stop_bits_t bits);
+        uart_stop_bits_t stop_bits() const;
+        /** Set flow control, and store it in NVS if persist is set. Hardware flow control needs RTS or CTS pins */
+        bool set_flow_control(FlowControl flow, bool persist = true);
+        FlowControl flow_control() const { return m_flow_control; }
+        /** Store the RTS and CTS pins, GPIO_NUM_NC for none */
+        bool set_flow_pins(gpio_num_t rts_pin, gpio_num_t cts_pin);
+        gpio_num_t rts_pin() const { return m_rts_pin; }
+        gpio_num_t cts_pin() const { return m_cts_pin; }
+        /** Receive is paused until the network side catches up */
+        bool throttled() const { return m_throttled; }
+        /** A break starts once the data queued before it has been sent */
+        bool set_break(bool enable);
+        bool get_break() const { return m_break; }
+        bool set_dtr(bool enable);
+        bool dtr() const { return m_dtr; }
+        bool set_rts(bool enable);
+        bool rts() const { return m_rts; }
 
+        /** Discard received data not yet read by the bridge */
+        void purge_rx();
+        /** Discard data queued for transmission */
+        void purge_tx();
+
+        /** Line status bits, errors seen since the last call are reported once */
+        uint8_t line_state();
+        const Counters &counters() const { return m_counters; }
+        /** From write() to the transmit task handing the data to the driver */
+        Histogram &tx_latency() { return m_tx_latency; }
+
+        /** Select the receive profile, stored in NVS if persist is set */
+        bool set_profile(Profile profile, bool persist = true);
+        Profile profile() const { return m_profile; }
+
+        /** Select DMA receive, stored in NVS and applied on the next start */
+        bool set_rx_dma(bool enable);
+        /** True while receiving through DMA */
+        bool rx_dma() const;
+
+        /** Re-apply the stored settings, dropping temporary changes */
+        bool reload();
         bool restore();
 
     private:
+        // Chunks in flight in each stream buffer that are timed
+        static constexpr size_t SERIAL_STAMP_COUNT { 32 };
+
         const uart_port_t m_port;
         const gpio_num_t m_tx_pin;
         const gpio_num_t m_rx_pin;
+        gpio_num_t m_rts_pin;
+        gpio_num_t m_cts_pin;
+        const char *m_nvs_namespace;
+
+        bool m_running;
+        QueueHandle_t m_uart_queue;
+        int m_event_fd;
+        StreamBufferHandle_t m_rx_stream;
+        StreamBufferHandle_t m_tx_stream;
+        TaskHandle_t m_rx_task;
+        TaskHandle_t m_tx_task;
+        Counters m_counters;
+        std::atomic<uint8_t> m_line_errors;
+        std::atomic<bool> m_throttled;
+        // Bytes queued by write(), and bytes the transmit task has seen leave the UART
+        std::atomic<uint32_t> m_tx_queued;
+        std::atomic<uint32_t> m_tx_drained;
+        std::atomic<bool> m_tx_purge;
+        // Chunk times for latency, read position is only used by the bridge side
+        uint32_t m_rx_event_time;
+        uint32_t m_rx_read;
+        StampQueue<SERIAL_STAMP_COUNT> m_rx_stamps;
+        StampQueue<SERIAL_STAMP_COUNT> m_tx_stamps;
+        Histogram m_tx_latency;
+        Profile m_profile;
+        size_t m_read_chunk;
+#if SERIAL_RX_DMA_SUPPORTED
+        SerialDma m_rx_dma;
+#endif
+
+        FlowControl m_flow_control;
+        FlowControl m_stored_flow_control;
+        bool m_break;
+        // Read by the transmit task to decide if transmit done needs a wake-up
+        std::atomic<bool> m_break_pending;
+        bool m_dtr;
+        bool m_rts;
 
-        int m_fd;
+        void load_config(uart_config_t &config);
+        bool apply_config(const uart_config_t &config);
+        bool apply_break(bool enable);
+        void apply_profile(uint32_t baud);
 
+        void notify();
+        bool throttle();
+        void forward(const uint8_t *data, size_t len);
+        void receive();
+        void rx_loop();
+        void tx_loop();
+        static void rx_task(void *arg);
+        static void tx_task(void *arg);
 };
 
 void serial_init();
 
 int serial_open();
-void serial_close(int fd);
\ No newline at end of file
+void serial_close(int fd);
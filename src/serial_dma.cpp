@@ -0,0 +1,161 @@
+#include "serial_dma.h"
+
+#if SERIAL_RX_DMA_SUPPORTED
+
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_heap_caps.h>
+#include <esp_private/periph_ctrl.h>
+#include <hal/uhci_ll.h>
+#include <hal/uart_ll.h>
+
+
+static constexpr const char* TAG = "serial_dma";
+
+// 8 KB of buffers, 16 ms at 5 Mbaud
+static constexpr size_t   DMA_BUF_COUNT { 8 };
+static constexpr size_t   DMA_BUF_SIZE { 1024 };
+static constexpr uint32_t DMA_BITS_PER_SYMBOL { 10 };
+
+
+bool SerialDma::start(uart_port_t port, QueueHandle_t events, uint8_t idle_symbols)
+{
+    m_port = port;
+    m_events = events;
+
+    // Descriptors and buffers must be in internal RAM the DMA can reach
+    m_desc = static_cast<dma_descriptor_t*>(heap_caps_calloc(DMA_BUF_COUNT, sizeof(dma_descriptor_t), MALLOC_CAP_DMA));
+    m_buf = static_cast<uint8_t*>(heap_caps_malloc(DMA_BUF_COUNT*DMA_BUF_SIZE, MALLOC_CAP_DMA));
+    if (!m_desc || !m_buf) {
+        ESP_LOGE(TAG, "Unable to allocate DMA buffers");
+        stop();
+        return false;
+    }
+    for (size_t i=0; i<DMA_BUF_COUNT; i++) {
+        auto &desc = m_desc[i];
+        desc.dw0.size = DMA_BUF_SIZE;
+        desc.dw0.length = 0;
+        desc.dw0.suc_eof = 0;
+        desc.dw0.owner = DMA_DESCRIPTOR_BUFFER_OWNER_DMA;
+        desc.buffer = m_buf + i*DMA_BUF_SIZE;
+        desc.next = &m_desc[(i+1)%DMA_BUF_COUNT];
+    }
+    m_next = 0;
+    m_eof = nullptr;
+
+    // UHCI without SLIP framing, a packet ends when the line is idle or a buffer is full
+    periph_module_enable(PERIPH_UHCI0_MODULE);
+    periph_module_reset(PERIPH_UHCI0_MODULE);
+    auto uhci = &UHCI0;
+    uhci_ll_init(uhci);
+    uhci_ll_attach_uart_port(uhci, port);
+    uhci_ll_set_eof_mode(uhci, UHCI_RX_IDLE_EOF | UHCI_RX_LEN_EOF);
+    uhci->pkt_thres.thrs = DMA_BUF_SIZE;
+    set_idle_symbols(idle_symbols);
+
+    gdma_channel_alloc_config_t channel_config = {
+        .sibling_chan = nullptr,
+        .direction = GDMA_CHANNEL_DIRECTION_RX,
+        .flags = { },
+    };
+    auto res = gdma_new_channel(&channel_config, &m_channel);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Unable to allocate DMA channel: err=%d", res);
+        m_channel = nullptr;
+        stop();
+        return false;
+    }
+    gdma_connect(m_channel, GDMA_MAKE_TRIGGER(GDMA_TRIG_PERIPH_UHCI, 0));
+
+    // The DMA stops at a buffer that hasn't been given back yet, the UART
+    // FIFO (and hardware flow control) then holds the line until it has
+    gdma_strategy_config_t strategy = {
+        .owner_check = true,
+        .auto_update_desc = true,
+    };
+    gdma_apply_strategy(m_channel, &strategy);
+
+    gdma_rx_event_callbacks_t callbacks = { };
+    callbacks.on_recv_eof = on_eof;
+    res = gdma_register_rx_event_callbacks(m_channel, &callbacks, this);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Unable to register DMA interrupt: err=%d", res);
+        stop();
+        return false;
+    }
+
+    // The driver keeps the error interrupts, but must not read the FIFO any more
+    uart_disable_rx_intr(port);
+    gdma_start(m_channel, reinterpret_cast<intptr_t>(m_desc));
+
+    ESP_LOGI(TAG, "UART %d receiving through DMA, %u x %u bytes", port, DMA_BUF_COUNT, DMA_BUF_SIZE);
+    return true;
+}
+
+
+void SerialDma::set_idle_symbols(uint8_t symbols)
+{
+    UART_LL_GET_HW(m_port)->idle_conf.rx_idle_thrhd = symbols*DMA_BITS_PER_SYMBOL;
+}
+
+
+void SerialDma::stop()
+{
+    if (m_channel) {
+        gdma_stop(m_channel);
+        gdma_disconnect(m_channel);
+        gdma_del_channel(m_channel);
+        m_channel = nullptr;
+        periph_module_disable(PERIPH_UHCI0_MODULE);
+        uart_enable_rx_intr(m_port);
+    }
+    heap_caps_free(m_desc);
+    heap_caps_free(m_buf);
+    m_desc = nullptr;
+    m_buf = nullptr;
+}
+
+
+bool SerialDma::next(const uint8_t *&data, size_t &len) const
+{
+    if (!m_eof.load()) {
+        return false;
+    }
+    // Every buffer up to the last EOF has been closed
+    const auto &desc = m_desc[m_next];
+    data = static_cast<const uint8_t*>(desc.buffer);
+    len = desc.dw0.length;
+    return true;
+}
+
+
+void SerialDma::release()
+{
+    auto desc = &m_desc[m_next];
+    desc->dw0.length = 0;
+    desc->dw0.suc_eof = 0;
+    desc->dw0.owner = DMA_DESCRIPTOR_BUFFER_OWNER_DMA;
+    m_next = (m_next+1)%DMA_BUF_COUNT;
+
+    // Caught up, unless the interrupt has closed another buffer meanwhile
+    auto expected = desc;
+    m_eof.compare_exchange_strong(expected, nullptr);
+
+    // Restarts the DMA if it was waiting for this buffer
+    gdma_append(m_channel);
+}
+
+
+bool IRAM_ATTR SerialDma::on_eof(gdma_channel_handle_t channel, gdma_event_data_t *event, void *arg)
+{
+    auto self = static_cast<SerialDma*>(arg);
+    self->m_eof = reinterpret_cast<dma_descriptor_t*>(event->rx_eof_desc_addr);
+
+    uart_event_t data = { };
+    data.type = UART_DATA;
+    BaseType_t woken = pdFALSE;
+    xQueueSendFromISR(self->m_events, &data, &woken);
+    return woken==pdTRUE;
+}
+
+#endif
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <sdkconfig.h>
+
+#if CONFIG_IDF_TARGET_ESP32C3
+#define SERIAL_RX_DMA_SUPPORTED 1
+#else
+#define SERIAL_RX_DMA_SUPPORTED 0
+#endif
+
+#if SERIAL_RX_DMA_SUPPORTED
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <driver/uart.h>
+#include <esp_private/gdma.h>
+#include <hal/dma_types.h>
+
+
+/**
+ * UART receive through UHCI and GDMA. UHCI takes bytes from the UART RX
+ * FIFO and GDMA writes them into a ring of descriptors owned by this class,
+ * so the CPU is no longer needed for every FIFO threshold.
+ *
+ * A buffer is closed when it is full or the line goes idle. The EOF
+ * interrupt, in IRAM, posts a UART_DATA event to the driver event queue, so
+ * the receive task handles DMA data the same way as driver data.
+ */
+class SerialDma {
+    public:
+        constexpr SerialDma() :
+            m_port { UART_NUM_0 },
+            m_events { nullptr },
+            m_channel { nullptr },
+            m_desc { nullptr },
+            m_buf { nullptr },
+            m_next { 0 },
+            m_eof { nullptr }
+        {}
+
+        /** Take over UART receive from the driver, events are posted to the driver queue */
+        bool start(uart_port_t port, QueueHandle_t events, uint8_t idle_symbols);
+        /** Idle line time that closes a buffer */
+        void set_idle_symbols(uint8_t symbols);
+        bool running() const { return m_channel!=nullptr; }
+
+        /** Oldest completed buffer, if any. Only called from the receive task */
+        bool next(const uint8_t *&data, size_t &len) const;
+        /** Give the buffer returned by next() back to the DMA */
+        void release();
+
+    private:
+        uart_port_t m_port;
+        QueueHandle_t m_events;
+        gdma_channel_handle_t m_channel;
+        dma_descriptor_t *m_desc;
+        uint8_t *m_buf;
+        size_t m_next;
+        // Last buffer closed by the DMA, cleared once the receive task has caught up
+        std::atomic<dma_descriptor_t*> m_eof;
+
+        void stop();
+        static bool on_eof(gdma_channel_handle_t channel, gdma_event_data_t *event, void *arg);
+};
+
+#endif
@@ -1,18 +1,26 @@
 #include "telnet.h"
 
 #include <string.h>
+#include <stdlib.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <freertos/stream_buffer.h>
 #include <esp_log.h>
 #include <esp_vfs_eventfd.h>
+#include <esp_timer.h>
 
 #include <lwip/err.h>
 #include <lwip/sockets.h>
 #include <lwip/sys.h>
 #include <lwip/netdb.h>
+#include <nvs.h>
+#include <sdkconfig.h>
 
 #include "serial.h"
+#include "scan.h"
+#include "broadcast.h"
+#include "metrics.h"
+#include "trace.h"
 
 //#define DUMP_INPUT
 //#define DUMP_OUTPUT
@@ -23,6 +31,15 @@ static constexpr int KEEPALIVE_IDLE     { 5 };
 static constexpr int KEEPALIVE_INTERVAL { 5 };
 static constexpr int KEEPALIVE_COUNT    { 3 };
 
+static constexpr const char *TELNET_NVS_NAMESPACE { "telnet" };
+static constexpr const char *TELNET_NVS_COMPRESS { "compress" };
+
+// RFC 6455 frame header: final fragment of a binary message, 16 bit length follows
+static constexpr uint8_t WS_FIN_BINARY { 0x82 };
+static constexpr uint8_t WS_LEN_16 { 126 };
+// A frame with its 4 byte header fits one TCP segment
+static constexpr size_t WS_FRAME_MAX { CONFIG_LWIP_TCP_MSS-4 };
+
 
 
 // RFC 854 : https://tools.ietf.org/html/rfc854
@@ -43,6 +60,8 @@ static constexpr uint8_t TELNET_DO = 0xfd;                  // Indicates the req
 static constexpr uint8_t TELNET_DONT = 0xfe;                // Indicates the demand that the other party stop performing, or confirmation that you are no longer expecting the other party to perform, the indicated option.
 static constexpr uint8_t TELNET_IAC = 0xff;                 // Data Byte 255.
 
+/** https://tools.ietf.org/html/rfc856 */
+static constexpr uint8_t TELNET_OPT_BINARY              = 0x00;
 /** https://tools.ietf.org/html/rfc857 */
 static constexpr uint8_t TELNET_OPT_ECHO                = 0x01;
 /** https://tools.ietf.org/html/rfc858 */
@@ -65,11 +84,146 @@ static constexpr uint8_t TELNET_OPT_X_DISPLAY_LOCATION  = 0x23;
 static constexpr uint8_t TELNET_OPT_TUID                = 0x26;
 /** https://tools.ietf.org/html/rfc1572 */
 static constexpr uint8_t TELNET_OPT_ENVIRONMENT         = 0x27;
+/** https://tools.ietf.org/html/rfc2217 */
+static constexpr uint8_t TELNET_OPT_COM_PORT            = 0x2c;
+/** https://tintin.mudhalla.net/protocols/mccp/ */
+static constexpr uint8_t TELNET_OPT_COMPRESS2           = 0x56;
+
+
+// RFC 2217 client to server commands. The server answers with command + COM_PORT_SERVER
+static constexpr uint8_t COM_PORT_SIGNATURE             = 0;
+static constexpr uint8_t COM_PORT_SET_BAUDRATE          = 1;
+static constexpr uint8_t COM_PORT_SET_DATASIZE          = 2;
+static constexpr uint8_t COM_PORT_SET_PARITY            = 3;
+static constexpr uint8_t COM_PORT_SET_STOPSIZE          = 4;
+static constexpr uint8_t COM_PORT_SET_CONTROL           = 5;
+static constexpr uint8_t COM_PORT_NOTIFY_LINESTATE      = 6;
+static constexpr uint8_t COM_PORT_NOTIFY_MODEMSTATE     = 7;
+static constexpr uint8_t COM_PORT_FLOWCONTROL_SUSPEND   = 8;
+static constexpr uint8_t COM_PORT_FLOWCONTROL_RESUME    = 9;
+static constexpr uint8_t COM_PORT_SET_LINESTATE_MASK    = 10;
+static constexpr uint8_t COM_PORT_SET_MODEMSTATE_MASK   = 11;
+static constexpr uint8_t COM_PORT_PURGE_DATA            = 12;
+static constexpr uint8_t COM_PORT_SERVER                = 100;
+
+// SET-PARITY values
+static constexpr uint8_t COM_PORT_PARITY_REQUEST        = 0;
+static constexpr uint8_t COM_PORT_PARITY_NONE           = 1;
+static constexpr uint8_t COM_PORT_PARITY_ODD            = 2;
+static constexpr uint8_t COM_PORT_PARITY_EVEN           = 3;
+
+// SET-STOPSIZE values
+static constexpr uint8_t COM_PORT_STOPSIZE_REQUEST      = 0;
+static constexpr uint8_t COM_PORT_STOPSIZE_1            = 1;
+static constexpr uint8_t COM_PORT_STOPSIZE_2            = 2;
+static constexpr uint8_t COM_PORT_STOPSIZE_1_5          = 3;
+
+// SET-CONTROL values
+static constexpr uint8_t COM_PORT_FLOW_REQUEST          = 0;
+static constexpr uint8_t COM_PORT_FLOW_NONE             = 1;
+static constexpr uint8_t COM_PORT_FLOW_XONXOFF          = 2;
+static constexpr uint8_t COM_PORT_FLOW_HARDWARE         = 3;
+static constexpr uint8_t COM_PORT_BREAK_REQUEST         = 4;
+static constexpr uint8_t COM_PORT_BREAK_ON              = 5;
+static constexpr uint8_t COM_PORT_BREAK_OFF             = 6;
+static constexpr uint8_t COM_PORT_DTR_REQUEST           = 7;
+static constexpr uint8_t COM_PORT_DTR_ON                = 8;
+static constexpr uint8_t COM_PORT_DTR_OFF               = 9;
+static constexpr uint8_t COM_PORT_RTS_REQUEST           = 10;
+static constexpr uint8_t COM_PORT_RTS_ON                = 11;
+static constexpr uint8_t COM_PORT_RTS_OFF               = 12;
+static constexpr uint8_t COM_PORT_INBOUND_FLOW_REQUEST  = 13;
+static constexpr uint8_t COM_PORT_INBOUND_FLOW_NONE     = 14;
+static constexpr uint8_t COM_PORT_INBOUND_FLOW_XONXOFF  = 15;
+static constexpr uint8_t COM_PORT_INBOUND_FLOW_HARDWARE = 16;
+
+// PURGE-DATA values
+static constexpr uint8_t COM_PORT_PURGE_RX              = 1;
+static constexpr uint8_t COM_PORT_PURGE_TX              = 2;
+static constexpr uint8_t COM_PORT_PURGE_BOTH            = 3;
+
+// Modem lines are not wired, report carrier, DSR and CTS as always present
+static constexpr uint8_t COM_PORT_MODEM_STATE           = 0xb0;
+
+static constexpr const char COM_PORT_SIGNATURE_TEXT[]   = "wifi-serial";
+
+
+
+void TelnetServer::load_settings()
+{
+    // Compression is offered by default, clients that don't know it refuse
+    m_compress = !m_raw;
+    nvs_handle_t handle;
+    if (nvs_open(TELNET_NVS_NAMESPACE, NVS_READONLY, &handle)==ESP_OK) {
+        uint32_t value;
+        if (m_nvs_key && nvs_get_u32(handle, m_nvs_key, &value)==ESP_OK) {
+            m_port = value;
+        }
+        if (!m_raw && nvs_get_u32(handle, TELNET_NVS_COMPRESS, &value)==ESP_OK) {
+            m_compress = value!=0;
+        }
+        nvs_close(handle);
+    }
+}
+
 
+bool TelnetServer::set_port(uint16_t port)
+{
+    if (!m_nvs_key) {
+        ESP_LOGE(TAG, "Port of this server is fixed");
+        return false;
+    }
+    nvs_handle_t handle;
+    auto res = nvs_open(TELNET_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+    res = nvs_set_u32(handle, m_nvs_key, port);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS port: err=%d", res);
+        nvs_close(handle);
+        return false;
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    return true;
+}
+
+
+bool TelnetServer::set_compress(bool compress)
+{
+    if (m_raw) {
+        ESP_LOGE(TAG, "A raw server has no telnet options");
+        return false;
+    }
+    nvs_handle_t handle;
+    auto res = nvs_open(TELNET_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+    res = nvs_set_u32(handle, TELNET_NVS_COMPRESS, compress);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS compress: err=%d", res);
+        nvs_close(handle);
+        return false;
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    m_compress = compress;
+    return true;
+}
 
 
 bool TelnetServer::start() 
 {
+    load_settings();
+    if (m_port==0) {
+        ESP_LOGI(TAG, "Server disabled");
+        return true;
+    }
+
     int addr_family = AF_INET;
     int ip_protocol = 0;
     struct sockaddr_storage dest_addr;
@@ -85,7 +239,7 @@ bool TelnetServer::start()
     m_server_fd = socket(addr_family, SOCK_STREAM, ip_protocol);
     if (m_server_fd < 0) {
         ESP_LOGE(TAG, "Unable to create socket: errno %d", errno);
-        return -1;
+        return false;
     }
     int opt = 1;
     setsockopt(m_server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
@@ -151,12 +305,21 @@ bool TelnetServer::accept(TelnetConnection &connection)
         inet_ntoa_r(((struct sockaddr_in *)&source_addr)->sin_addr, addr_str, sizeof(addr_str) - 1);
     }
 
-    ESP_LOGI(TAG, "Client connected ip address: %s", addr_str);
+    ESP_LOGI(TAG, "Client connected ip address: %s%s", addr_str, m_raw ? " (raw)" : "");
 
-    // Negotiation
     connection.set(sock);
+    connection.m_raw = m_raw;
+    if (m_raw) {
+        return true;
+    }
+
+    // Negotiation
 
     if (!connection.write_command(TELNET_WILL, TELNET_OPT_ECHO)) { connection.close(); return false; }
+    if (m_compress) {
+        connection.m_compress_offered = true;
+        if (!connection.write_command(TELNET_WILL, TELNET_OPT_COMPRESS2)) { connection.close(); return false; }
+    }
 
     return true;    
 }
@@ -167,12 +330,43 @@ TelnetConnection &TelnetConnection::operator=(TelnetConnection &other)
 {
     close();
     m_fd = other.m_fd;
+    m_raw = other.m_raw;
     m_iac = other.m_iac;
     m_state = other.m_state;
     if (other.m_subnegotiation_sz) {
         memcpy(m_subnegotiation_buf, other.m_subnegotiation_buf, other.m_subnegotiation_sz);
     }
     m_subnegotiation_sz = other.m_subnegotiation_sz;
+    m_binary = other.m_binary;
+    m_serial = other.m_serial;
+    m_com_port = other.m_com_port;
+    m_com_port_changed = other.m_com_port_changed;
+    m_suspended = other.m_suspended;
+    m_linestate_mask = other.m_linestate_mask;
+    m_modemstate_mask = other.m_modemstate_mask;
+    m_linestate = other.m_linestate;
+    m_ring = other.m_ring;
+    m_metrics = other.m_metrics;
+    m_cursor = other.m_cursor;
+    m_live = other.m_live;
+    m_iac_half = other.m_iac_half;
+    m_dropped = other.m_dropped;
+    m_blocked = other.m_blocked;
+    m_blocked_since = other.m_blocked_since;
+    m_websocket = other.m_websocket;
+    memcpy(m_frame_header, other.m_frame_header, sizeof(m_frame_header));
+    m_header_len = other.m_header_len;
+    m_header_sent = other.m_header_sent;
+    m_frame_left = other.m_frame_left;
+    m_compress_offered = other.m_compress_offered;
+    m_deflate = other.m_deflate;
+    m_zout = other.m_zout;
+    m_zout_len = other.m_zout_len;
+    m_zout_sent = other.m_zout_sent;
+    m_zfrom = other.m_zfrom;
+    m_zstart = other.m_zstart;
+    m_segments = other.m_segments;
+    m_sent = other.m_sent;
     other.reset();
     return *this;
 }
@@ -184,12 +378,50 @@ void TelnetConnection::set(int fd)
     m_fd = fd;
 }
 
+
+void TelnetConnection::attach_websocket(int fd)
+{
+    set(fd);
+    m_raw = true;
+    m_websocket = true;
+}
+
 void TelnetConnection::reset()
 {
     m_fd = -1;
+    m_raw = false;
     m_iac = false;
     m_state = STATE_NONE;
     m_subnegotiation_sz = 0;
+    m_binary = false;
+    m_serial = nullptr;
+    m_com_port = false;
+    m_com_port_changed = false;
+    m_suspended = false;
+    m_linestate_mask = 0;
+    m_modemstate_mask = 0xff;
+    m_linestate = 0;
+    m_ring = nullptr;
+    m_metrics = nullptr;
+    m_cursor = 0;
+    m_live = 0;
+    m_iac_half = false;
+    m_dropped = 0;
+    m_blocked = false;
+    m_blocked_since = 0;
+    m_websocket = false;
+    m_header_len = 0;
+    m_header_sent = 0;
+    m_frame_left = 0;
+    m_compress_offered = false;
+    m_deflate = Deflate();
+    m_zout = nullptr;
+    m_zout_len = 0;
+    m_zout_sent = 0;
+    m_zfrom = 0;
+    m_zstart = 0;
+    m_segments = 0;
+    m_sent = 0;
     m_window_size_cb = nullptr;
     m_terminal_cb = nullptr;
 }
@@ -199,15 +431,427 @@ void TelnetConnection::reset()
 
 void TelnetConnection::close()
 {
-    if (m_fd>=0) {
+    if (m_com_port_changed && m_serial) {
+        // Settings made through RFC 2217 only last for the session
+        m_serial->reload();
+    }
+    // The socket of a WebSocket belongs to the HTTP server
+    if (m_fd>=0 && !m_websocket) {
         shutdown(m_fd, SHUT_RDWR);
         ::close(m_fd);
     }
+    m_deflate.stop();
+    free(m_zout);
     reset();
 }
 
 
-bool TelnetConnection::write_raw(const uint8_t *buf, size_t count)
+/**
+ * A ring send that stopped between the two bytes of an escaped 0xFF leaves
+ * the client half way through a pair. Send the second byte before anything
+ * else goes out, so the client doesn't read the next byte as a command.
+ */
+bool TelnetConnection::complete_iac()
+{
+    static const uint8_t iac { TELNET_IAC };
+    m_iac_half = false;
+    m_cursor++;
+    return write_raw(&iac, 1);
+}
+
+
+void TelnetConnection::attach(BroadcastRing *ring, uint32_t start, BridgeMetrics *metrics)
+{
+    m_ring = ring;
+    m_metrics = metrics;
+    m_cursor = start;
+    m_live = ring->head();
+    m_iac_half = false;
+}
+
+
+bool TelnetConnection::blocked() const
+{
+    return m_ring && !m_suspended && m_blocked;
+}
+
+
+uint32_t TelnetConnection::backlog() const
+{
+    if (!m_ring) {
+        return 0;
+    }
+    // Until the replay has been sent, only data that arrived after attach counts
+    if (static_cast<int32_t>(m_cursor-m_live) < 0) {
+        return m_ring->head()-m_live;
+    }
+    return m_ring->head()-m_cursor;
+}
+
+
+bool TelnetConnection::pump()
+{
+    if (!m_ring || m_suspended) {
+        return true;
+    }
+
+    if (m_iac_half) {
+        static const uint8_t iac { TELNET_IAC };
+        auto res = send(m_fd, &iac, 1, MSG_DONTWAIT);
+        if (res < 0) {
+            if (errno==EAGAIN || errno==EWOULDBLOCK) {
+                set_blocked(true);
+                return true;
+            }
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        m_iac_half = false;
+        m_cursor++;
+    }
+
+    if (!m_ring->valid(m_cursor)) {
+        // Fell further behind than the ring holds, skip to the oldest data
+        auto next = m_ring->sync_point(m_ring->oldest());
+        TRACE_W(TraceEvent::CLIENT_LAGGING, m_fd, next-m_cursor);
+        m_dropped += next-m_cursor;
+        m_cursor = next;
+        // The skipped data is not history the client can refer back to
+        m_zfrom = next;
+        m_zstart = next;
+    }
+
+    if (m_zout) {
+        return pump_compressed();
+    }
+
+    bool partial;
+    do {
+        struct iovec iov[3];
+        size_t header = 0;
+        auto iovcnt = m_websocket ? websocket_iov(iov, header) : m_ring->peek(m_cursor, iov);
+        if (iovcnt==0) {
+            set_blocked(false);
+            return true;
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        auto res = sendmsg(m_fd, &msg, MSG_DONTWAIT);
+        if (res < 0) {
+            if (errno==EAGAIN || errno==EWOULDBLOCK) {
+                set_blocked(true);
+                return true;
+            }
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        size_t total = 0;
+        for (size_t i=0; i<iovcnt; i++) {
+            total += iov[i].iov_len;
+        }
+        partial = static_cast<size_t>(res) < total;
+        m_segments++;
+        m_metrics->sends.add();
+        if (partial) {
+            m_metrics->short_sends.add();
+        }
+
+        if (m_websocket) {
+            // Frame header bytes are not ring data
+            auto count = static_cast<size_t>(res) < header ? res : header;
+            m_header_sent += count;
+            res -= count;
+            m_frame_left -= res;
+        }
+        m_sent += res;
+        m_metrics->send_bytes.add(res);
+
+        if (m_ring->escaped()) {
+            // An odd trailing run of 0xFF means the last pair was split
+            size_t run = 0;
+            while (run < static_cast<size_t>(res) && m_ring->at(m_cursor+res-1-run)==TELNET_IAC) {
+                run++;
+            }
+            bool odd = (run & 1)!=0;
+            m_iac_half = run==static_cast<size_t>(res) ? m_iac_half!=odd : odd;
+        }
+
+        record_latency(m_cursor, m_cursor+res);
+        m_cursor += res;
+        // A frame is at most one segment, carry on with the next one
+    } while (m_websocket && !partial);
+    set_blocked(partial || m_iac_half);
+
+    return true;
+}
+
+
+/** Latency of the live chunks a send completed, replayed data doesn't count */
+void TelnetConnection::record_latency(uint32_t from, uint32_t to)
+{
+    uint32_t now = 0;
+    m_ring->stamped(from, to, [&](uint32_t end, uint32_t time_us) {
+        if (static_cast<int32_t>(end-m_live) > 0) {
+            now = now ? now : static_cast<uint32_t>(esp_timer_get_time());
+            m_metrics->serial_to_client_us.record(now-time_us);
+        }
+    });
+}
+
+
+/**
+ * Serial output goes to a WebSocket as binary frames of up to one segment,
+ * with the payload sent straight from the ring. A frame that was only partly
+ * sent is finished before the next one starts. If the client lagged and
+ * skipped ahead meanwhile, the rest of the frame is filled from the new
+ * position, so the stream of frames stays intact.
+ */
+size_t TelnetConnection::websocket_iov(struct iovec iov[3], size_t &header)
+{
+    struct iovec data[2];
+    auto count = m_ring->peek(m_cursor, data);
+    if (count==0) {
+        return 0;
+    }
+    if (m_frame_left==0) {
+        size_t len = data[0].iov_len + (count>1 ? data[1].iov_len : 0);
+        len = len<WS_FRAME_MAX ? len : WS_FRAME_MAX;
+        m_frame_header[0] = WS_FIN_BINARY;
+        if (len<WS_LEN_16) {
+            m_frame_header[1] = len;
+            m_header_len = 2;
+        }
+        else {
+            m_frame_header[1] = WS_LEN_16;
+            m_frame_header[2] = len>>8;
+            m_frame_header[3] = len;
+            m_header_len = 4;
+        }
+        m_header_sent = 0;
+        m_frame_left = len;
+    }
+
+    size_t iovcnt = 0;
+    header = m_header_len-m_header_sent;
+    if (header) {
+        iov[iovcnt++] = { m_frame_header+m_header_sent, header };
+    }
+    size_t left = m_frame_left;
+    for (size_t i=0; i<count && left; i++) {
+        auto len = data[i].iov_len<left ? data[i].iov_len : left;
+        iov[iovcnt++] = { data[i].iov_base, len };
+        left -= len;
+    }
+    return iovcnt;
+}
+
+
+/**
+ * Once the client has agreed to MCCP2, everything after IAC SB 86 IAC SE
+ * is one zlib stream. Ring data is compressed a segment at a time into
+ * m_zout; the stream is flushed whenever it catches up with the ring head,
+ * which pump() reaches at the coalescing boundaries, so the client can show
+ * each burst as soon as it arrives.
+ */
+bool TelnetConnection::start_compress()
+{
+    if (m_zout) {
+        return true;
+    }
+    if (!m_ring) {
+        return false;
+    }
+    auto zout = static_cast<uint8_t*>(malloc(COMPRESS_OUT_SIZE));
+    if (!zout || !m_deflate.start()) {
+        ESP_LOGW(TAG, "No memory for compression");
+        free(zout);
+        m_deflate.stop();
+        return false;
+    }
+    static const uint8_t COMPRESS_START[] { TELNET_OPT_COMPRESS2 };
+    if (!write_subnegotiation(COMPRESS_START, sizeof(COMPRESS_START))) {
+        free(zout);
+        m_deflate.stop();
+        return false;
+    }
+    m_zout = zout;
+    m_zout_len = 0;
+    m_zout_sent = 0;
+    m_zfrom = m_cursor;
+    m_zstart = m_cursor;
+    return true;
+}
+
+
+/** End the zlib stream, the client goes back to plain data */
+bool TelnetConnection::stop_compress()
+{
+    if (!m_zout) {
+        return true;
+    }
+    bool ok = send_compressed(0);
+    if (ok) {
+        m_zout_len = m_deflate.finish(m_zout);
+        ok = send_compressed(0);
+    }
+    m_deflate.stop();
+    free(m_zout);
+    m_zout = nullptr;
+    return ok;
+}
+
+
+bool TelnetConnection::pump_compressed()
+{
+    while (true) {
+        if (!send_compressed(MSG_DONTWAIT)) {
+            return false;
+        }
+        if (m_zout_len) {
+            set_blocked(true);
+            return true;
+        }
+        auto head = m_ring->head();
+        if (m_cursor==head) {
+            set_blocked(false);
+            return true;
+        }
+        compress_ring(head);
+    }
+}
+
+
+/**
+ * Compress ring data into the empty output buffer. Commands are written
+ * between buffers, so a buffer never ends between the two bytes of an
+ * escaped 0xFF: there is room left to take the second one.
+ */
+void TelnetConnection::compress_ring(uint32_t head)
+{
+    static constexpr size_t PAIR_ROOM { 8 };
+    m_zfrom = m_cursor;
+    auto len = m_deflate.compress(*m_ring, m_cursor, head, m_zstart, m_zout, COMPRESS_OUT_SIZE-PAIR_ROOM);
+    if (m_cursor!=head && m_ring->escaped()) {
+        // Buffers start on a pair boundary, an odd trailing run of 0xFF splits a pair
+        uint32_t run = 0;
+        while (m_cursor-run!=m_zfrom && m_ring->at(m_cursor-1-run)==TELNET_IAC) {
+            run++;
+        }
+        if (run & 1) {
+            len += m_deflate.compress(*m_ring, m_cursor, m_cursor+1, m_zstart, m_zout+len, COMPRESS_OUT_SIZE-len);
+        }
+    }
+    if (m_cursor==head) {
+        len += m_deflate.flush(m_zout+len);
+    }
+    m_metrics->compress_in_bytes.add(m_cursor-m_zfrom);
+    m_metrics->compress_out_bytes.add(len);
+    m_zout_len = len;
+    m_zout_sent = 0;
+}
+
+
+/**
+ * Send the rest of the compressed output. With MSG_DONTWAIT it may stay
+ * unfinished, which leaves m_zout_len set; false is only for errors.
+ */
+bool TelnetConnection::send_compressed(int flags)
+{
+    while (m_zout_sent<m_zout_len) {
+        auto res = send(m_fd, m_zout+m_zout_sent, m_zout_len-m_zout_sent, flags);
+        if (res < 0 && (flags & MSG_DONTWAIT) && (errno==EAGAIN || errno==EWOULDBLOCK)) {
+            return true;
+        }
+        if (res <= 0) {
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        m_segments++;
+        m_metrics->sends.add();
+        m_metrics->send_bytes.add(res);
+        m_zout_sent += res;
+        if (m_zout_sent<m_zout_len) {
+            m_metrics->short_sends.add();
+            if (flags & MSG_DONTWAIT) {
+                return true;
+            }
+        }
+    }
+    // The ring data of the buffer has reached the client
+    record_latency(m_zfrom, m_cursor);
+    m_sent += m_cursor-m_zfrom;
+    m_zfrom = m_cursor;
+    m_zout_len = 0;
+    m_zout_sent = 0;
+    return true;
+}
+
+
+/**
+ * Writes from outside the ring, commands and the like, go into the stream
+ * as literals after the ring data already compressed, and are flushed at
+ * once. As they are not ring data, later matches can't reach back past them.
+ */
+bool TelnetConnection::write_compressed(const struct iovec *iov, size_t iovcnt)
+{
+    if (!send_compressed(0)) {
+        return false;
+    }
+    for (size_t i=0; i<iovcnt; i++) {
+        auto data = static_cast<const uint8_t*>(iov[i].iov_base);
+        size_t left = iov[i].iov_len;
+        while (left > 0) {
+            size_t count = left;
+            auto len = m_deflate.literals(data, count, m_zout+m_zout_len, COMPRESS_OUT_SIZE-m_zout_len);
+            m_metrics->compress_in_bytes.add(count);
+            m_metrics->compress_out_bytes.add(len);
+            m_zout_len += len;
+            data += count;
+            left -= count;
+            if (left > 0 && !send_compressed(0)) {
+                return false;
+            }
+        }
+    }
+    auto len = m_deflate.flush(m_zout+m_zout_len);
+    m_metrics->compress_out_bytes.add(len);
+    m_zout_len += len;
+    m_zstart = m_cursor;
+    return send_compressed(0);
+}
+
+
+void TelnetConnection::set_blocked(bool blocked)
+{
+    if (blocked==m_blocked) {
+        return;
+    }
+    // The clock is only read when a client starts or stops waiting
+    auto now = esp_timer_get_time();
+    if (blocked) {
+        m_blocked_since = now;
+    }
+    else {
+        m_metrics->blocked_us.add(now-m_blocked_since);
+    }
+    m_blocked = blocked;
+}
+
+
+bool TelnetConnection::set_nodelay(bool nodelay)
+{
+    int value = nodelay ? 1 : 0;
+    if (setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value))<0) {
+        ESP_LOGW(TAG, "Unable to set TCP_NODELAY: errno %d", errno);
+        return false;
+    }
+    return true;
+}
+
+
+bool TelnetConnection::send_all(const uint8_t *buf, size_t count)
 {
     while (count > 0) {
         auto res = send(m_fd, buf, count, 0);
@@ -223,75 +867,144 @@ bool TelnetConnection::write_raw(const uint8_t *buf, size_t count)
 }
 
 
-
-bool TelnetConnection::write(const uint8_t *buf, size_t count)
+bool TelnetConnection::write_raw(const uint8_t *buf, size_t count)
 {
-    uint8_t buffer[count*2];
-    uint8_t *obuf = buffer;
-    size_t olen = 0;
-
-    while (count) {
-        *(obuf++) = *buf;
-        if (*buf==TELNET_IAC) {
-            ESP_LOGI(TAG, "Padding!!");
-            *(obuf++) = *buf;
-            olen++;
-        }
-        buf++;
-        olen++;
-        count--;
+    if (m_zout) {
+        struct iovec iov { const_cast<uint8_t*>(buf), count };
+        return write_compressed(&iov, 1);
+    }
+    if (m_iac_half && !complete_iac()) {
+        return false;
     }
-    #if DUMP_OUTPUT
+    return send_all(buf, count);
+}
+
+
+bool TelnetConnection::write_iov(struct iovec *iov, size_t iovcnt)
+{
+    #ifdef DUMP_OUTPUT
     printf("> ");
-    for (int i=0; i<olen; i++) {
-        printf("%02x ", buffer[i]);
+    for (size_t i=0; i<iovcnt; i++) {
+        for (size_t j=0; j<iov[i].iov_len; j++) {
+            printf("%02x ", static_cast<const uint8_t*>(iov[i].iov_base)[j]);
+        }
     }
     printf("\n");
     #endif
-    return write_raw(buffer, olen);
-}
 
+    if (m_zout) {
+        return write_compressed(iov, iovcnt);
+    }
+    if (m_iac_half && !complete_iac()) {
+        return false;
+    }
 
-bool TelnetConnection::write_command(uint8_t command, uint8_t value)
-{
-    uint8_t CMD[] { TELNET_IAC, command, value };
-    return write_raw(CMD, sizeof(CMD));
+    struct msghdr msg = {};
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        auto res = sendmsg(m_fd, &msg, 0);
+        if (res <= 0) {
+            ESP_LOGE(TAG, "Error occurred during sending: errno %d", errno);
+            return false;
+        }
+        // Skip the fragments that went out completely, and trim a partial one
+        while (iovcnt > 0 && static_cast<size_t>(res) >= iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + res;
+            iov->iov_len -= res;
+        }
+    }
+
+    return true;
 }
 
 
-bool TelnetConnection::write_subnegotiation(const uint8_t *data, size_t len)
+/**
+ * Send prefix + IAC escaped data + suffix without copying the data.
+ * Plain spans are referenced in place, and each run of 0xFF bytes becomes 
+ * a single fragment pointing into a constant run of doubled IACs. At most
+ * WRITE_IOV_MAX fragments are kept on the stack, regardless of the size.
+ */
+bool TelnetConnection::write_escaped(const uint8_t *prefix, size_t prefix_len, const uint8_t *buf, size_t count, const uint8_t *suffix, size_t suffix_len)
 {
-    uint8_t buffer[len*2+4];
-    uint8_t *obuf = buffer;
-    size_t olen = 0;
-    *(obuf++) = TELNET_IAC;
-    *(obuf++) = TELNET_SB;
-    olen+=2;
-    while (len) {
-        if ((*data)==TELNET_IAC) {
-            *(obuf++) = *data;
-            olen+=2;
+    static const uint8_t IAC_RUN[] { 
+        TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC,
+        TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC,
+        TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC,
+        TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC, TELNET_IAC,
+    };
+    struct iovec iov[WRITE_IOV_MAX];
+    size_t iovcnt = 0;
+
+    if (prefix_len) {
+        iov[iovcnt++] = { const_cast<uint8_t*>(prefix), prefix_len };
+    }
+
+    const uint8_t *end = buf+count;
+    while (buf < end) {
+        auto iac = buf + scan_iac(buf, end-buf);
+        if (iac==end) {
+            iov[iovcnt++] = { const_cast<uint8_t*>(buf), static_cast<size_t>(end-buf) };
+            buf = end;
         }
         else {
-            *(obuf++) = *data;
-            olen++;
+            if (iac > buf) {
+                iov[iovcnt++] = { const_cast<uint8_t*>(buf), static_cast<size_t>(iac-buf) };
+            }
+            // Every 0xFF in the run is sent twice
+            size_t run = 1;
+            while (iac+run < end && iac[run]==TELNET_IAC && run < sizeof(IAC_RUN)/2) {
+                run++;
+            }
+            iov[iovcnt++] = { const_cast<uint8_t*>(IAC_RUN), run*2 };
+            buf = iac+run;
+        }
+
+        // Keep room for the next span + escape pair and the suffix
+        if (iovcnt > WRITE_IOV_MAX-3 && buf < end) {
+            if (!write_iov(iov, iovcnt)) {
+                return false;
+            }
+            iovcnt = 0;
         }
-        data++;
-        len--;
     }
-    *(obuf++) = TELNET_IAC;
-    *(obuf++) = TELNET_SE;
-    olen+=2;
 
-    #if 0
-    printf("SB> ");
-    for (int i=0; i<olen; i++) {
-        printf("%02x ", buffer[i]);
+    if (suffix_len) {
+        iov[iovcnt++] = { const_cast<uint8_t*>(suffix), suffix_len };
     }
-    printf("\n");
-    #endif
 
-    return write_raw(buffer, olen);
+    return iovcnt==0 || write_iov(iov, iovcnt);
+}
+
+
+bool TelnetConnection::write(const uint8_t *buf, size_t count)
+{
+    if (m_raw) {
+        return write_raw(buf, count);
+    }
+    return write_escaped(nullptr, 0, buf, count, nullptr, 0);
+}
+
+
+bool TelnetConnection::write_command(uint8_t command, uint8_t value)
+{
+    TRACE_I(TraceEvent::TELNET_SEND_COMMAND, m_fd, command<<8 | value);
+    uint8_t CMD[] { TELNET_IAC, command, value };
+    return write_raw(CMD, sizeof(CMD));
+}
+
+
+bool TelnetConnection::write_subnegotiation(const uint8_t *data, size_t len)
+{
+    static const uint8_t SB_BEGIN[] { TELNET_IAC, TELNET_SB };
+    static const uint8_t SB_END[] { TELNET_IAC, TELNET_SE };
+    TRACE_I(TraceEvent::TELNET_SEND_COMMAND, m_fd, TELNET_SB<<8 | (len ? data[0] : 0));
+    return write_escaped(SB_BEGIN, sizeof(SB_BEGIN), data, len, SB_END, sizeof(SB_END));
 }
 
 
@@ -327,11 +1040,255 @@ void TelnetConnection::process_terminal_type(const uint8_t *data, size_t len)
 }
 
 
+bool TelnetConnection::write_com_port(uint8_t command, const uint8_t *value, size_t len)
+{
+    uint8_t buffer[2+COM_PORT_VALUE_MAX];
+    if (len>COM_PORT_VALUE_MAX) {
+        len = COM_PORT_VALUE_MAX;
+    }
+    buffer[0] = TELNET_OPT_COM_PORT;
+    buffer[1] = COM_PORT_SERVER + command;
+    memcpy(buffer+2, value, len);
+    return write_subnegotiation(buffer, 2+len);
+}
+
+
+uint8_t TelnetConnection::process_com_port_control(uint8_t value)
+{
+    auto flow_value = [this](uint8_t base) {
+        switch (m_serial->flow_control()) {
+            case Serial::FlowControl::XONXOFF:  return static_cast<uint8_t>(base+1);
+            case Serial::FlowControl::HARDWARE: return static_cast<uint8_t>(base+2);
+            default:                            return base;
+        }
+    };
+
+    switch (value) {
+        case COM_PORT_FLOW_NONE:
+        case COM_PORT_INBOUND_FLOW_NONE:
+            m_com_port_changed = true;
+            m_serial->set_flow_control(Serial::FlowControl::NONE, false);
+            break;
+        case COM_PORT_FLOW_XONXOFF:
+        case COM_PORT_INBOUND_FLOW_XONXOFF:
+            m_com_port_changed = true;
+            m_serial->set_flow_control(Serial::FlowControl::XONXOFF, false);
+            break;
+        case COM_PORT_FLOW_HARDWARE:
+        case COM_PORT_INBOUND_FLOW_HARDWARE:
+            m_com_port_changed = true;
+            m_serial->set_flow_control(Serial::FlowControl::HARDWARE, false);
+            break;
+        case COM_PORT_BREAK_ON:
+        case COM_PORT_BREAK_OFF:
+            m_com_port_changed = true;
+            m_serial->set_break(value==COM_PORT_BREAK_ON);
+            break;
+        case COM_PORT_DTR_ON:
+        case COM_PORT_DTR_OFF:
+            m_com_port_changed = true;
+            m_serial->set_dtr(value==COM_PORT_DTR_ON);
+            break;
+        case COM_PORT_RTS_ON:
+        case COM_PORT_RTS_OFF:
+            m_com_port_changed = true;
+            m_serial->set_rts(value==COM_PORT_RTS_ON);
+            break;
+        case COM_PORT_FLOW_REQUEST:
+        case COM_PORT_BREAK_REQUEST:
+        case COM_PORT_DTR_REQUEST:
+        case COM_PORT_RTS_REQUEST:
+        case COM_PORT_INBOUND_FLOW_REQUEST:
+            break;
+        default:
+            ESP_LOGW(TAG, "< Client unsupported COM port control %u", value);
+            return value;
+    }
+
+    // Answer with the resulting state of the group the value belongs to
+    if (value<=COM_PORT_FLOW_HARDWARE) {
+        return flow_value(COM_PORT_FLOW_NONE);
+    }
+    else if (value<=COM_PORT_BREAK_OFF) {
+        return m_serial->get_break() ? COM_PORT_BREAK_ON : COM_PORT_BREAK_OFF;
+    }
+    else if (value<=COM_PORT_DTR_OFF) {
+        return m_serial->dtr() ? COM_PORT_DTR_ON : COM_PORT_DTR_OFF;
+    }
+    else if (value<=COM_PORT_RTS_OFF) {
+        return m_serial->rts() ? COM_PORT_RTS_ON : COM_PORT_RTS_OFF;
+    }
+    return flow_value(COM_PORT_INBOUND_FLOW_NONE);
+}
+
+
+void TelnetConnection::process_com_port(const uint8_t *data, size_t len)
+{
+    if (len<2 || !m_serial) {
+        ESP_LOGW(TAG, "< Client invalid COM port command");
+        return;
+    }
+    uint8_t command = data[1];
+    const uint8_t *value = data+2;
+    size_t value_len = len-2;
+
+    switch (command) {
+        case COM_PORT_SIGNATURE: {
+            if (value_len==0) {
+                write_com_port(command, reinterpret_cast<const uint8_t*>(COM_PORT_SIGNATURE_TEXT), sizeof(COM_PORT_SIGNATURE_TEXT)-1);
+            }
+            break;
+        }
+        case COM_PORT_SET_BAUDRATE: {
+            if (value_len!=4) break;
+            uint32_t baud = (static_cast<uint32_t>(value[0]) << 24) | (static_cast<uint32_t>(value[1]) << 16) | (static_cast<uint32_t>(value[2]) << 8) | value[3];
+            if (baud) {
+                ESP_LOGI(TAG, "< Client set baud %lu", baud);
+                m_com_port_changed = true;
+                m_serial->set_baud(baud, false);
+            }
+            baud = m_serial->baud();
+            uint8_t reply[] { static_cast<uint8_t>(baud >> 24), static_cast<uint8_t>(baud >> 16), static_cast<uint8_t>(baud >> 8), static_cast<uint8_t>(baud) };
+            write_com_port(command, reply, sizeof(reply));
+            break;
+        }
+        case COM_PORT_SET_DATASIZE: {
+            if (value_len!=1) break;
+            if (value[0]>=5 && value[0]<=8) {
+                m_com_port_changed = true;
+                m_serial->set_data_bits(static_cast<uart_word_length_t>(UART_DATA_5_BITS + value[0]-5));
+            }
+            uint8_t reply = 5 + (m_serial->data_bits() - UART_DATA_5_BITS);
+            write_com_port(command, &reply, 1);
+            break;
+        }
+        case COM_PORT_SET_PARITY: {
+            if (value_len!=1) break;
+            switch (value[0]) {
+                case COM_PORT_PARITY_NONE: m_com_port_changed = true; m_serial->set_parity(UART_PARITY_DISABLE); break;
+                case COM_PORT_PARITY_ODD:  m_com_port_changed = true; m_serial->set_parity(UART_PARITY_ODD); break;
+                case COM_PORT_PARITY_EVEN: m_com_port_changed = true; m_serial->set_parity(UART_PARITY_EVEN); break;
+                case COM_PORT_PARITY_REQUEST: break;
+                default: ESP_LOGW(TAG, "< Client unsupported parity %u", value[0]); break;
+            }
+            uint8_t reply;
+            switch (m_serial->parity()) {
+                case UART_PARITY_ODD:  reply = COM_PORT_PARITY_ODD; break;
+                case UART_PARITY_EVEN: reply = COM_PORT_PARITY_EVEN; break;
+                default:               reply = COM_PORT_PARITY_NONE; break;
+            }
+            write_com_port(command, &reply, 1);
+            break;
+        }
+        case COM_PORT_SET_STOPSIZE: {
+            if (value_len!=1) break;
+            switch (value[0]) {
+                case COM_PORT_STOPSIZE_1:   m_com_port_changed = true; m_serial->set_stop_bits(UART_STOP_BITS_1); break;
+                case COM_PORT_STOPSIZE_2:   m_com_port_changed = true; m_serial->set_stop_bits(UART_STOP_BITS_2); break;
+                case COM_PORT_STOPSIZE_1_5: m_com_port_changed = true; m_serial->set_stop_bits(UART_STOP_BITS_1_5); break;
+                default: break;
+            }
+            uint8_t reply;
+            switch (m_serial->stop_bits()) {
+                case UART_STOP_BITS_2:   reply = COM_PORT_STOPSIZE_2; break;
+                case UART_STOP_BITS_1_5: reply = COM_PORT_STOPSIZE_1_5; break;
+                default:                 reply = COM_PORT_STOPSIZE_1; break;
+            }
+            write_com_port(command, &reply, 1);
+            break;
+        }
+        case COM_PORT_SET_CONTROL: {
+            if (value_len!=1) break;
+            uint8_t reply = process_com_port_control(value[0]);
+            write_com_port(command, &reply, 1);
+            break;
+        }
+        case COM_PORT_NOTIFY_LINESTATE: {
+            uint8_t reply = m_serial->line_state() & m_linestate_mask;
+            write_com_port(command, &reply, 1);
+            break;
+        }
+        case COM_PORT_NOTIFY_MODEMSTATE: {
+            uint8_t reply = COM_PORT_MODEM_STATE & m_modemstate_mask;
+            write_com_port(command, &reply, 1);
+            break;
+        }
+        case COM_PORT_FLOWCONTROL_SUSPEND:
+            m_suspended = true;
+            break;
+        case COM_PORT_FLOWCONTROL_RESUME:
+            m_suspended = false;
+            break;
+        case COM_PORT_SET_LINESTATE_MASK: {
+            if (value_len!=1) break;
+            m_linestate_mask = value[0];
+            write_com_port(command, &m_linestate_mask, 1);
+            break;
+        }
+        case COM_PORT_SET_MODEMSTATE_MASK: {
+            if (value_len!=1) break;
+            m_modemstate_mask = value[0];
+            write_com_port(command, &m_modemstate_mask, 1);
+            uint8_t state = COM_PORT_MODEM_STATE & m_modemstate_mask;
+            write_com_port(COM_PORT_NOTIFY_MODEMSTATE, &state, 1);
+            break;
+        }
+        case COM_PORT_PURGE_DATA: {
+            if (value_len!=1) break;
+            if (value[0]==COM_PORT_PURGE_RX || value[0]==COM_PORT_PURGE_BOTH) {
+                m_serial->purge_rx();
+            }
+            if (value[0]==COM_PORT_PURGE_TX || value[0]==COM_PORT_PURGE_BOTH) {
+                m_serial->purge_tx();
+            }
+            write_com_port(command, value, 1);
+            break;
+        }
+        default:
+            ESP_LOGW(TAG, "< Client unsupported COM port command %u", command);
+            break;
+    }
+}
+
+
+void TelnetConnection::start_com_port()
+{
+    if (m_com_port) {
+        return;
+    }
+    m_com_port = true;
+
+    // A COM port is an 8 bit clean line, ask for binary in both directions.
+    // Input is taken as binary until the client refuses with WONT.
+    m_binary = true;
+    write_command(TELNET_DO, TELNET_OPT_BINARY);
+    write_command(TELNET_WILL, TELNET_OPT_BINARY);
+
+    // The modem lines never change, so this is the only notification sent
+    uint8_t state = COM_PORT_MODEM_STATE & m_modemstate_mask;
+    write_com_port(COM_PORT_NOTIFY_MODEMSTATE, &state, 1);
+}
+
+
+void TelnetConnection::poll_line_state()
+{
+    if (!m_com_port || !m_linestate_mask || !m_serial) {
+        return;
+    }
+    uint8_t state = m_serial->line_state() & m_linestate_mask;
+    if (state!=m_linestate) {
+        m_linestate = state;
+        write_com_port(COM_PORT_NOTIFY_LINESTATE, &state, 1);
+    }
+}
+
+
 void TelnetConnection::process_subnegotiation(const uint8_t *data, size_t len)
 {
     if (len<1) 
         return;
 
+    TRACE_I(TraceEvent::TELNET_RECV_COMMAND, m_fd, TELNET_SB<<8 | *data);
     switch (*data) {
         case TELNET_OPT_WINDOW_SIZE:
             process_window_size(data, len);
@@ -339,12 +1296,18 @@ void TelnetConnection::process_subnegotiation(const uint8_t *data, size_t len)
         case TELNET_OPT_TERMINAL_TYPE:
             process_terminal_type(data, len);
             break;
-        default: 
-            ESP_LOGW(TAG, "Unsupported subnegotiation %02x", *data);
-            for (int i=0; i<len; i++) {
-                printf("%02x ", data[i]);
+        case TELNET_OPT_COM_PORT:
+            process_com_port(data, len);
+            break;
+        default: {
+            // Length and the first bytes, starting with the option
+            uint32_t head = (len<0xff ? len : 0xff)<<24;
+            for (size_t i=0; i<len && i<3; i++) {
+                head |= data[i]<<(8*i);
             }
-            printf("\n");
+            TRACE_W(TraceEvent::TELNET_UNSUPPORTED_SUBNEGOTIATION, m_fd, head);
+            break;
+        }
     }
 }
 
@@ -354,28 +1317,36 @@ void TelnetConnection::process_subnegotiation(const uint8_t *data, size_t len)
 void TelnetConnection::process_do_command(uint8_t value)
 {
     switch (value) {
+        case TELNET_OPT_BINARY:
+            write_command(TELNET_WILL, TELNET_OPT_BINARY);
+            break;
         case TELNET_OPT_ECHO: 
-            ESP_LOGI(TAG, "< Client DO ECHO");
-            ESP_LOGI(TAG, "> Server WILL ECHO");
             write_command(TELNET_WILL, TELNET_OPT_ECHO);
             break;
         case TELNET_OPT_SUPPRESS_GO_AHEAD:
-            ESP_LOGI(TAG, "< Client DO suppress GA");
-            ESP_LOGI(TAG, "> Server WILL suppress GA");
             write_command(TELNET_WILL, TELNET_OPT_SUPPRESS_GO_AHEAD);
             break;
         case TELNET_OPT_STATUS:
-            ESP_LOGI(TAG, "< Client DO status");
-            ESP_LOGI(TAG, "> Server WON'T DO Status");
             write_command(TELNET_WONT, TELNET_OPT_STATUS);
             break;
+        case TELNET_OPT_COM_PORT:
+            if (m_serial) {
+                write_command(TELNET_WILL, TELNET_OPT_COM_PORT);
+            }
+            else {
+                write_command(TELNET_WONT, TELNET_OPT_COM_PORT);
+            }
+            break;
         case TELNET_OPT_TUID:
-            ESP_LOGI(TAG, "< Client DO TUID");
-            ESP_LOGI(TAG, "> Server WON'T DO TUID");
             write_command(TELNET_WONT, TELNET_OPT_TUID);
             break;
+        case TELNET_OPT_COMPRESS2:
+            // Only after our WILL, the client's DO is the agreement
+            if (!m_compress_offered || !start_compress()) {
+                write_command(TELNET_WONT, TELNET_OPT_COMPRESS2);
+            }
+            break;
         default: 
-            ESP_LOGI(TAG, "< Client DO unknown %02x", value);
             break;
     }
 }
@@ -384,44 +1355,38 @@ void TelnetConnection::process_do_command(uint8_t value)
 void TelnetConnection::process_will_command(uint8_t value)
 {
     switch (value) {
+        case TELNET_OPT_BINARY:
+            if (!m_binary) {
+                // Not an answer to our own DO
+                write_command(TELNET_DO, TELNET_OPT_BINARY);
+            }
+            m_binary = true;
+            break;
         case TELNET_OPT_SUPPRESS_GO_AHEAD:
-            ESP_LOGI(TAG, "< Client WILL suppress GA");
-            ESP_LOGI(TAG, "> Server DO suppress GA");
             write_command(TELNET_DO, TELNET_OPT_SUPPRESS_GO_AHEAD);
             break;
         case TELNET_OPT_TERMINAL_TYPE: 
-            ESP_LOGI(TAG, "< Client WILL Terminal type");
             if (m_terminal_cb) {
-                ESP_LOGI(TAG, "> Server get terminal type");
                 uint8_t cmd[] { TELNET_OPT_TERMINAL_TYPE, 1 };
                 write_subnegotiation(cmd, sizeof(cmd));
             }
             break;
-        case TELNET_OPT_TERMINAL_SPEED:
-            ESP_LOGI(TAG, "< Client WILL Terminal speed");
-            break;
-        case TELNET_OPT_REMOTE_FLOW_CONTROL:
-            ESP_LOGI(TAG, "< Client WILL Remote flow control");
-            break;
-        case TELNET_OPT_TERMINAL_LINEMODE:
-            ESP_LOGI(TAG, "< Client WILL Terminal line mode");
-            break;
-        case TELNET_OPT_X_DISPLAY_LOCATION:
-            ESP_LOGI(TAG, "< Client WILL X Display location");
-            break;
-        case TELNET_OPT_ENVIRONMENT:
-            ESP_LOGI(TAG, "< Client WILL Environment");
-            break;
         case TELNET_OPT_WINDOW_SIZE:
-            ESP_LOGI(TAG, "< Client WILL Window size");
             if (m_window_size_cb) {
-                ESP_LOGI(TAG, "> Server get window size");
                 write_command(TELNET_DO, TELNET_OPT_WINDOW_SIZE);
             }
             break;
+        case TELNET_OPT_COM_PORT:
+            if (m_serial) {
+                write_command(TELNET_DO, TELNET_OPT_COM_PORT);
+                start_com_port();
+            }
+            else {
+                write_command(TELNET_DONT, TELNET_OPT_COM_PORT);
+            }
+            break;
         
         default:
-            ESP_LOGI(TAG, "< Client WILL unknown %02x", value);
             break;
     }
 }
@@ -430,21 +1395,28 @@ void TelnetConnection::process_will_command(uint8_t value)
 
 void TelnetConnection::on_command(uint8_t command, uint8_t value)
 {
+    TRACE_I(TraceEvent::TELNET_RECV_COMMAND, m_fd, command<<8 | value);
     switch (command) {
         case TELNET_WILL:
             process_will_command(value);
             break;
         case TELNET_WONT:
-            ESP_LOGI(TAG, "Command: WONT  %02x", value);
+            if (value==TELNET_OPT_BINARY) {
+                m_binary = false;
+            }
+            else if (value==TELNET_OPT_COM_PORT) {
+                m_com_port = false;
+            }
             break;
         case TELNET_DO:
             process_do_command(value);
             break;
         case TELNET_DONT: 
-            ESP_LOGI(TAG, "Command: DON'T  %02x", value);
+            if (value==TELNET_OPT_COMPRESS2) {
+                stop_compress();
+            }
             break;
         default:
-            ESP_LOGI(TAG, "Command: %02x  %02x", command, value);
             break;
     }
 }
@@ -473,7 +1445,7 @@ void TelnetConnection::do_iac(uint8_t state)
             break;
         }
         default: {
-            ESP_LOGW(TAG, "Unexpected command: %02x", state);
+            TRACE_W(TraceEvent::TELNET_UNEXPECTED_COMMAND, m_fd, state);
             break;
         }
     }
@@ -482,11 +1454,20 @@ void TelnetConnection::do_iac(uint8_t state)
 
 
 
+/**
+ * Data is received straight into the caller's buffer and decoded in place;
+ * the output never runs ahead of the input. Plain runs are found with a 
+ * word-at-a-time scan and moved in bulk, only IAC sequences, subnegotiation
+ * and NUL bytes go through the state machine. NUL bytes are dropped unless 
+ * the client sends in binary mode (RFC 856). Raw connections skip decoding.
+ */
 ssize_t TelnetConnection::read(uint8_t *buf, size_t count)
 {
-    ssize_t rsz = 0;
-    uint8_t rbuf[count];
-    auto rc = recv(m_fd, rbuf, count, 0);
+    auto rc = recv(m_fd, buf, count, 0);
+    if (rc==0 && count>0) {
+        ESP_LOGI(TAG, "Client closed connection");
+        return -1;
+    }
     if (rc<0) {
         if (errno==ENOTCONN) {
             ESP_LOGI(TAG, "Client closed connection");
@@ -496,63 +1477,75 @@ ssize_t TelnetConnection::read(uint8_t *buf, size_t count)
         }
         return -1;
     }
-    #ifdef DUMP_INPUT
-    uint8_t *inb = buf;
-    #endif
-    for (ssize_t i=0; i<rc; i++) {
-        uint8_t ch = rbuf[i];
+    if (m_raw) {
+        return rc;
+    }
+
+    size_t rpos = 0;
+    size_t wpos = 0;
+    while (rpos<static_cast<size_t>(rc)) {
+        if (!m_iac && m_state==STATE_NONE) {
+            auto run = m_binary ? scan_iac(buf+rpos, rc-rpos) : scan_iac_nul(buf+rpos, rc-rpos);
+            if (run) {
+                if (wpos!=rpos) {
+                    memmove(buf+wpos, buf+rpos, run);
+                }
+                rpos += run;
+                wpos += run;
+                continue;
+            }
+        }
+
+        uint8_t ch = buf[rpos++];
         if (m_iac) {
             m_iac = false;
             if (ch!=TELNET_IAC) {
                 do_iac(ch);
                 continue;
             }
-            ESP_LOGW(TAG, "Double 0xFF");
+            TRACE_D(TraceEvent::TELNET_DOUBLE_IAC, m_fd, 0);
         }
-        switch (m_state) {
-            case TELNET_WILL:
-            case TELNET_WONT:
-            case TELNET_DO:
-            case TELNET_DONT: 
-                on_command(m_state, ch);
-                m_state = STATE_NONE;
+        else {
+            switch (m_state) {
+                case TELNET_WILL:
+                case TELNET_WONT:
+                case TELNET_DO:
+                case TELNET_DONT: 
+                    on_command(m_state, ch);
+                    m_state = STATE_NONE;
+                    continue;
+                default:
+                    break;
+            }
+            if (ch==TELNET_IAC) {
+                m_iac = true;
                 continue;
-            default:
-                break;
-        }
-        if (ch==TELNET_IAC) {
-            m_iac = true;
-            continue;
+            }
         }
         if (m_state==TELNET_SB) {
             if (m_subnegotiation_sz<SUBNEG_MAX) {
                 m_subnegotiation_buf[m_subnegotiation_sz++] = ch;
             }
             else {
-                ESP_LOGW(TAG, "Subnegotiation buffer overflow");
+                TRACE_W(TraceEvent::TELNET_SUBNEGOTIATION_OVERFLOW, m_fd, m_subnegotiation_sz);
                 m_subnegotiation_sz = 0;
                 m_state = STATE_NONE;
             }
         }
-        else {
-            if (ch!=0x00) {
-                *(buf++) = ch;
-                rsz++;
-            }
+        else if (ch!=0x00 || m_binary) {
+            buf[wpos++] = ch;
         }
     }
 
     #ifdef DUMP_INPUT
-    if (rsz>0) {
+    if (wpos>0) {
         printf("< ");
-        for (uint i=0; i<rsz; i++) {
-            printf("%02x ", inb[i]);
+        for (uint i=0; i<wpos; i++) {
+            printf("%02x ", buf[i]);
         }
         printf("\n");
     }
     #endif
 
-    return rsz;
+    return wpos;
 }
-
-
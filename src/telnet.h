@@ -3,6 +3,13 @@
 #include <cstdint>
 #include <functional>
 #include <unistd.h>
+#include <sys/uio.h>
+
+#include "deflate.h"
+
+class Serial;
+class BroadcastRing;
+struct BridgeMetrics;
 
 
 class TelnetConnection {
@@ -12,9 +19,40 @@ class TelnetConnection {
 
         TelnetConnection() : 
             m_fd { -1 }, 
+            m_raw { false },
             m_iac { false }, 
             m_state { STATE_NONE },
             m_subnegotiation_sz { 0 }, 
+            m_binary { false },
+            m_serial { nullptr },
+            m_com_port { false },
+            m_com_port_changed { false },
+            m_suspended { false },
+            m_linestate_mask { 0 },
+            m_modemstate_mask { 0xff },
+            m_linestate { 0 },
+            m_ring { nullptr },
+            m_metrics { nullptr },
+            m_cursor { 0 },
+            m_live { 0 },
+            m_iac_half { false },
+            m_dropped { 0 },
+            m_blocked { false },
+            m_blocked_since { 0 },
+            m_websocket { false },
+            m_frame_header { },
+            m_header_len { 0 },
+            m_header_sent { 0 },
+            m_frame_left { 0 },
+            m_compress_offered { false },
+            m_deflate { },
+            m_zout { nullptr },
+            m_zout_len { 0 },
+            m_zout_sent { 0 },
+            m_zfrom { 0 },
+            m_zstart { 0 },
+            m_segments { 0 },
+            m_sent { 0 },
             m_window_size_cb { nullptr },
             m_terminal_cb { nullptr }
         {}
@@ -29,6 +67,37 @@ class TelnetConnection {
         void set_window_size_cb(window_size_cb cb) { m_window_size_cb = cb; }
         void set_terminal_cb(terminal_cb cb) { m_terminal_cb = cb; }
 
+        /** Serial port controlled by the client through RFC 2217 */
+        void set_serial(Serial *serial) { m_serial = serial; }
+        /** Send NOTIFY-LINESTATE if the masked line state has changed */
+        void poll_line_state();
+        /** Client asked us to stop sending data (RFC 2217 FLOWCONTROL-SUSPEND) */
+        bool suspended() const { return m_suspended; }
+
+        bool raw() const { return m_raw; }
+        /** Send to a WebSocket the HTTP server has accepted, its input arrives through the server */
+        void attach_websocket(int fd);
+        bool websocket() const { return m_websocket; }
+        /** Ring data is sent compressed (MCCP2, telnet option 86) */
+        bool compressed() const { return m_zout!=nullptr; }
+
+        /** Start sending ring data from start, data before the current head is replayed without holding up the ring. Sends are counted in metrics */
+        void attach(BroadcastRing *ring, uint32_t start, BridgeMetrics *metrics);
+        /** Send as much pending ring data as the socket takes without blocking */
+        bool pump();
+        /** The socket didn't take all ring data on the last pump */
+        bool blocked() const;
+        /** Number of live ring bytes not yet sent, replayed data is not counted */
+        uint32_t backlog() const;
+        /** Bytes skipped because the client fell behind the ring */
+        uint32_t dropped() const { return m_dropped; }
+        /** Ring data sent, and the number of sends it took */
+        uint32_t sent() const { return m_sent; }
+        uint32_t segments() const { return m_segments; }
+
+        /** Turn Nagle's algorithm off (nodelay) or on for the socket */
+        bool set_nodelay(bool nodelay);
+
         operator bool() const { return m_fd>=0; }
         TelnetConnection &operator=(TelnetConnection &other);
 
@@ -39,14 +108,54 @@ class TelnetConnection {
     private:
         static constexpr uint8_t STATE_NONE  { 0x00 };
         static constexpr size_t SUBNEG_MAX { 128 };
+        static constexpr size_t WRITE_IOV_MAX { 16 };
+        static constexpr size_t COM_PORT_VALUE_MAX { 16 };
+        // Compressed output is sent a segment at a time
+        static constexpr size_t COMPRESS_OUT_SIZE { 1440 };
 
         friend class TelnetServer;
         int m_fd;
+        bool m_raw;
 
         bool m_iac;
         uint8_t m_state;
         uint8_t m_subnegotiation_buf[SUBNEG_MAX];
         size_t m_subnegotiation_sz;
+        bool m_binary;
+
+        Serial *m_serial;
+        bool m_com_port;
+        bool m_com_port_changed;
+        bool m_suspended;
+        uint8_t m_linestate_mask;
+        uint8_t m_modemstate_mask;
+        uint8_t m_linestate;
+
+        BroadcastRing *m_ring;
+        BridgeMetrics *m_metrics;
+        uint32_t m_cursor;
+        uint32_t m_live;
+        bool m_iac_half;
+        uint32_t m_dropped;
+        bool m_blocked;
+        int64_t m_blocked_since;
+        bool m_websocket;
+        uint8_t m_frame_header[4];
+        uint8_t m_header_len;
+        uint8_t m_header_sent;
+        // Payload of the current frame still to be sent
+        uint32_t m_frame_left;
+        bool m_compress_offered;
+        Deflate m_deflate;
+        // Compressed output, allocated while the client takes it
+        uint8_t *m_zout;
+        uint16_t m_zout_len;
+        uint16_t m_zout_sent;
+        // Ring data in the compressed output, and the start of the history matches may use
+        uint32_t m_zfrom;
+        uint32_t m_zstart;
+        uint32_t m_segments;
+        uint32_t m_sent;
 
         window_size_cb m_window_size_cb;
         terminal_cb m_terminal_cb;
@@ -59,16 +168,40 @@ class TelnetConnection {
         void process_will_command(uint8_t value);
         void process_window_size(const uint8_t *data, size_t len);
         void process_terminal_type(const uint8_t *data, size_t len);
-
+        void process_com_port(const uint8_t *data, size_t len);
+        void start_com_port();
+        uint8_t process_com_port_control(uint8_t value);
+
+        bool complete_iac();
+        void set_blocked(bool blocked);
+        size_t websocket_iov(struct iovec iov[3], size_t &header);
+        bool start_compress();
+        bool stop_compress();
+        bool pump_compressed();
+        void compress_ring(uint32_t head);
+        bool send_compressed(int flags);
+        void record_latency(uint32_t from, uint32_t to);
+        bool write_compressed(const struct iovec *iov, size_t iovcnt);
+        bool send_all(const uint8_t *buf, size_t count);
         bool write_raw(const uint8_t *buf, size_t count);
+        bool write_iov(struct iovec *iov, size_t iovcnt);
+        bool write_escaped(const uint8_t *prefix, size_t prefix_len, const uint8_t *buf, size_t count, const uint8_t *suffix, size_t suffix_len);
         bool write_command(uint8_t command, uint8_t value);
         bool write_subnegotiation(const uint8_t *data, size_t len);
+        bool write_com_port(uint8_t command, const uint8_t *value, size_t len);
 };
 
 class TelnetServer {
     public:
-        constexpr TelnetServer(uint16_t port) :
+        /**
+         * A raw server passes bytes verbatim, without telnet negotiation or 
+         * IAC escaping. With an NVS key the port can be changed by set_port().
+         */
+        constexpr TelnetServer(uint16_t port, bool raw = false, const char *nvs_key = nullptr) :
             m_port { port },
+            m_raw { raw },
+            m_nvs_key { nvs_key },
+            m_compress { false },
             m_server_fd { -1 }
         {}
 
@@ -78,10 +211,23 @@ class TelnetServer {
         bool accept(TelnetConnection &connection);
 
         int fd() const { return m_server_fd; }
+        uint16_t port() const { return m_port; }
+
+        /** Store a new port in NVS, 0 disables the server. Applied on next start. */
+        bool set_port(uint16_t port);
+
+        /** Offer compression (MCCP2) to new telnet clients, stored in NVS */
+        bool set_compress(bool compress);
+        bool compress() const { return m_compress; }
 
     private:
-        const uint16_t m_port;
+        uint16_t m_port;
+        const bool m_raw;
+        const char *m_nvs_key;
+        bool m_compress;
 
         int m_server_fd;
+
+        void load_settings();
 };
 
@@ -0,0 +1,131 @@
+#include "trace.h"
+
+#include <stdio.h>
+
+
+TraceRing g_trace;
+
+
+size_t TraceRing::snapshot(TraceRecord *records, size_t count) const
+{
+    auto head = m_head.load(std::memory_order_acquire);
+    uint32_t available = head-m_base;
+    if (available>SIZE) {
+        available = SIZE;
+    }
+    if (count>available) {
+        count = available;
+    }
+    auto first = head-count;
+    for (size_t i=0; i<count; i++) {
+        records[i] = m_records[(first+i)%SIZE];
+    }
+
+    // Slots the writer filled meanwhile, or may be filling now, held older records
+    auto now = m_head.load(std::memory_order_acquire);
+    auto invalid = static_cast<int32_t>(now+1-SIZE-first);
+    if (invalid<=0) {
+        return count;
+    }
+    if (static_cast<size_t>(invalid)>=count) {
+        return 0;
+    }
+    for (size_t i=invalid; i<count; i++) {
+        records[i-invalid] = records[i];
+    }
+    return count-invalid;
+}
+
+
+static const char *command_name(uint8_t command)
+{
+    switch (command) {
+        case 0xfb: return "WILL";
+        case 0xfc: return "WONT";
+        case 0xfd: return "DO";
+        case 0xfe: return "DONT";
+        case 0xfa: return "SB";
+        default: return "?";
+    }
+}
+
+
+static const char *option_name(uint8_t option)
+{
+    switch (option) {
+        case 0x00: return "binary";
+        case 0x01: return "echo";
+        case 0x03: return "suppress GA";
+        case 0x05: return "status";
+        case 0x18: return "terminal type";
+        case 0x1f: return "window size";
+        case 0x20: return "terminal speed";
+        case 0x21: return "remote flow control";
+        case 0x22: return "line mode";
+        case 0x23: return "X display location";
+        case 0x26: return "TUID";
+        case 0x27: return "environment";
+        case 0x2c: return "COM port control";
+        case 0x56: return "compress2";
+        default: return "unknown";
+    }
+}
+
+
+void TraceRing::format(const TraceRecord &record, char *buf, size_t size)
+{
+    static const char LEVELS[] { '-', 'W', 'I', 'D' };
+    auto len = snprintf(buf, size, "%10lu.%06lu %c ",
+        static_cast<unsigned long>(record.time_us/1000000), static_cast<unsigned long>(record.time_us%1000000),
+        record.level<sizeof(LEVELS) ? LEVELS[record.level] : '?');
+    if (len<0 || static_cast<size_t>(len)>=size) {
+        return;
+    }
+    buf += len;
+    size -= len;
+
+    auto arg0 = static_cast<unsigned>(record.arg0);
+    auto arg1 = static_cast<unsigned long>(record.arg1);
+    switch (record.event) {
+        case TraceEvent::TELNET_RECV_COMMAND:
+        case TraceEvent::TELNET_SEND_COMMAND: {
+            uint8_t command = record.arg1>>8;
+            uint8_t option = record.arg1;
+            snprintf(buf, size, "socket %u %s %s %s (%02x)", arg0,
+                record.event==TraceEvent::TELNET_RECV_COMMAND ? "<" : ">",
+                command_name(command), option_name(option), option);
+            break;
+        }
+        case TraceEvent::TELNET_UNEXPECTED_COMMAND:
+            snprintf(buf, size, "socket %u unexpected command %02lx", arg0, arg1);
+            break;
+        case TraceEvent::TELNET_UNSUPPORTED_SUBNEGOTIATION:
+            snprintf(buf, size, "socket %u unsupported subnegotiation, %lu bytes: %02lx %02lx %02lx",
+                arg0, arg1>>24, arg1 & 0xff, (arg1>>8) & 0xff, (arg1>>16) & 0xff);
+            break;
+        case TraceEvent::TELNET_SUBNEGOTIATION_OVERFLOW:
+            snprintf(buf, size, "socket %u subnegotiation buffer overflow", arg0);
+            break;
+        case TraceEvent::TELNET_DOUBLE_IAC:
+            snprintf(buf, size, "socket %u double 0xFF", arg0);
+            break;
+        case TraceEvent::CLIENT_LAGGING:
+            snprintf(buf, size, "socket %u lagging, skipped %lu bytes", arg0, arg1);
+            break;
+        case TraceEvent::CLIENT_READ:
+            snprintf(buf, size, "client %u read %lu bytes", arg0, arg1);
+            break;
+        case TraceEvent::SERIAL_TX_FULL:
+            snprintf(buf, size, "client %u serial transmit full, dropped %lu bytes", arg0, arg1);
+            break;
+        case TraceEvent::SERIAL_READ:
+            snprintf(buf, size, "serial read %lu bytes", arg1);
+            break;
+        case TraceEvent::TRIGGER_MATCH:
+            snprintf(buf, size, "trigger %u matched, %lu times", arg0, arg1);
+            break;
+        default:
+            snprintf(buf, size, "event %u %u %lu", static_cast<unsigned>(record.event), arg0, arg1);
+            break;
+    }
+}
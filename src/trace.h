@@ -0,0 +1,107 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <esp_timer.h>
+
+
+/**
+ * Trace points for the data path. Instead of formatting text and writing
+ * it to the console in the middle of a transfer, a trace point stores an
+ * event id, two arguments and a timestamp in a RAM ring. The ring is
+ * decoded to text later, by the trace_dump command.
+ *
+ * TRACE_LEVEL selects the trace points compiled in, the others are removed
+ * entirely: 0 none, 1 warnings, 2 protocol events, 3 every data chunk.
+ */
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_WARN  1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+
+#define TRACE_AT(level, event, arg0, arg1) do { \
+        if ((level) <= TRACE_LEVEL) { \
+            g_trace.write((level), (event), (arg0), (arg1)); \
+        } \
+    } while (0)
+
+#define TRACE_W(event, arg0, arg1) TRACE_AT(TRACE_LEVEL_WARN, event, arg0, arg1)
+#define TRACE_I(event, arg0, arg1) TRACE_AT(TRACE_LEVEL_INFO, event, arg0, arg1)
+#define TRACE_D(event, arg0, arg1) TRACE_AT(TRACE_LEVEL_DEBUG, event, arg0, arg1)
+
+
+enum class TraceEvent : uint8_t {
+    // arg0: socket, arg1: command << 8 | option
+    TELNET_RECV_COMMAND,
+    TELNET_SEND_COMMAND,
+    // arg0: socket, arg1: command
+    TELNET_UNEXPECTED_COMMAND,
+    // arg0: socket, arg1: length << 24 | first three bytes (option first)
+    TELNET_UNSUPPORTED_SUBNEGOTIATION,
+    TELNET_SUBNEGOTIATION_OVERFLOW,
+    // arg0: socket
+    TELNET_DOUBLE_IAC,
+    // arg0: socket, arg1: bytes skipped
+    CLIENT_LAGGING,
+    // arg0: client, arg1: bytes
+    CLIENT_READ,
+    SERIAL_TX_FULL,
+    // arg1: bytes
+    SERIAL_READ,
+    // arg0: trigger, arg1: matches
+    TRIGGER_MATCH,
+};
+
+
+struct TraceRecord {
+    uint32_t time_us;
+    uint8_t level;
+    TraceEvent event;
+    uint16_t arg0;
+    uint32_t arg1;
+};
+
+
+/**
+ * Ring of the most recent trace records. Only the bridge loop writes it,
+ * so a write is a handful of stores; readers copy records out and drop the
+ * ones overwritten while they copied.
+ */
+class TraceRing {
+    public:
+        static constexpr size_t SIZE { 256 };
+
+        constexpr TraceRing() : m_records { }, m_head { 0 }, m_base { 0 } {}
+
+        void write(uint8_t level, TraceEvent event, uint16_t arg0, uint32_t arg1)
+        {
+            auto head = m_head.load(std::memory_order_relaxed);
+            auto &record = m_records[head%SIZE];
+            record.time_us = esp_timer_get_time();
+            record.level = level;
+            record.event = event;
+            record.arg0 = arg0;
+            record.arg1 = arg1;
+            m_head.store(head+1, std::memory_order_release);
+        }
+
+        /** Copy the newest records since the last clear, at most count, oldest first */
+        size_t snapshot(TraceRecord *records, size_t count) const;
+        /** Forget the records written so far, for the reading task */
+        void clear() { m_base = m_head.load(std::memory_order_acquire); }
+
+        /** Text for a record, without a newline */
+        static void format(const TraceRecord &record, char *buf, size_t size);
+
+    private:
+        TraceRecord m_records[SIZE];
+        std::atomic<uint32_t> m_head;
+        uint32_t m_base;
+};
+
+extern TraceRing g_trace;
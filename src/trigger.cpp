@@ -0,0 +1,367 @@
+#include "trigger.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <esp_log.h>
+#include <nvs.h>
+#include <driver/gpio.h>
+
+#include "capture.h"
+#include "trace.h"
+#include "globals.h"
+
+
+static constexpr const char* TAG = "trigger";
+
+static constexpr const char *TRIGGER_NVS_NAMESPACE { "trigger" };
+static constexpr const char *TRIGGER_NVS_LIST { "list" };
+
+static constexpr size_t MAX_STATES { TriggerEngine::MAX_TRIGGERS*TriggerEngine::PATTERN_MAX+1 };
+static constexpr uint8_t NO_STATE { 0xff };
+static_assert(MAX_STATES<=NO_STATE, "states must fit a byte");
+
+// "trigger 7: " and a pattern with every byte escaped
+static constexpr size_t TEXT_SIZE { 16+TriggerEngine::PATTERN_MAX*4 };
+
+
+struct TriggerEngine::Automaton {
+    // Triggers that differ from the previous automaton
+    uint8_t changed;
+    uint16_t classes;
+    Trigger triggers[MAX_TRIGGERS];
+    uint8_t byte_class[256];
+    // Triggers that end in each state, and the next state for each state and class
+    uint8_t *output;
+    uint8_t *next;
+};
+
+
+/** Pattern as text, with bytes that don't print escaped */
+static size_t format_pattern(const TriggerEngine::Trigger &trigger, char *buf, size_t size)
+{
+    size_t len = 0;
+    for (size_t i=0; i<trigger.len && len+5<size; i++) {
+        auto ch = trigger.pattern[i];
+        if (ch=='\\') {
+            len += snprintf(buf+len, size-len, "\\\\");
+        }
+        else if (isprint(ch)) {
+            buf[len++] = ch;
+        }
+        else if (ch=='\r') {
+            len += snprintf(buf+len, size-len, "\\r");
+        }
+        else if (ch=='\n') {
+            len += snprintf(buf+len, size-len, "\\n");
+        }
+        else {
+            len += snprintf(buf+len, size-len, "\\x%02x", ch);
+        }
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+
+bool TriggerEngine::start()
+{
+    nvs_handle_t handle;
+    if (nvs_open(TRIGGER_NVS_NAMESPACE, NVS_READONLY, &handle)==ESP_OK) {
+        size_t size = sizeof(m_triggers);
+        if (nvs_get_blob(handle, TRIGGER_NVS_LIST, m_triggers, &size)!=ESP_OK || size!=sizeof(m_triggers)) {
+            memset(m_triggers, 0, sizeof(m_triggers));
+        }
+        nvs_close(handle);
+    }
+
+    size_t count = 0;
+    for (auto &trigger : m_triggers) {
+        if (trigger.len>PATTERN_MAX) {
+            trigger.len = 0;
+        }
+        if (trigger.len && (trigger.actions & GPIO)) {
+            gpio_reset_pin(static_cast<gpio_num_t>(trigger.gpio));
+            gpio_set_direction(static_cast<gpio_num_t>(trigger.gpio), GPIO_MODE_OUTPUT);
+            gpio_set_level(static_cast<gpio_num_t>(trigger.gpio), 0);
+        }
+        count += trigger.len ? 1 : 0;
+    }
+    if (!compile()) {
+        return false;
+    }
+    ESP_LOGI(TAG, "%u triggers", count);
+    return true;
+}
+
+
+bool TriggerEngine::store()
+{
+    nvs_handle_t handle;
+    auto res = nvs_open(TRIGGER_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error opening NVS store: err=%d", res);
+        return false;
+    }
+    res = nvs_set_blob(handle, TRIGGER_NVS_LIST, m_triggers, sizeof(m_triggers));
+    if (res != ESP_OK) {
+        ESP_LOGE(TAG, "Error storing NVS triggers: err=%d", res);
+        nvs_close(handle);
+        return false;
+    }
+    nvs_commit(handle);
+    nvs_close(handle);
+    return true;
+}
+
+
+int TriggerEngine::add(const uint8_t *pattern, size_t len, uint8_t actions, int gpio)
+{
+    if (len==0 || len>PATTERN_MAX || ((actions & GPIO) && (gpio<0 || gpio>=GPIO_NUM_MAX))) {
+        return -1;
+    }
+    int index = -1;
+    for (size_t i=0; i<MAX_TRIGGERS; i++) {
+        if (m_triggers[i].len==0) {
+            index = i;
+            break;
+        }
+    }
+    if (index<0) {
+        ESP_LOGE(TAG, "All %u triggers are in use", MAX_TRIGGERS);
+        return -1;
+    }
+
+    auto &trigger = m_triggers[index];
+    trigger = Trigger { };
+    trigger.len = len;
+    trigger.actions = actions;
+    trigger.gpio = (actions & GPIO) ? gpio : -1;
+    memcpy(trigger.pattern, pattern, len);
+    if (!compile()) {
+        trigger = Trigger { };
+        return -1;
+    }
+    if (actions & GPIO) {
+        gpio_reset_pin(static_cast<gpio_num_t>(gpio));
+        gpio_set_direction(static_cast<gpio_num_t>(gpio), GPIO_MODE_OUTPUT);
+        gpio_set_level(static_cast<gpio_num_t>(gpio), 0);
+    }
+    store();
+    return index;
+}
+
+
+bool TriggerEngine::remove(size_t index)
+{
+    if (index>=MAX_TRIGGERS || m_triggers[index].len==0) {
+        return false;
+    }
+    auto trigger = m_triggers[index];
+    m_triggers[index] = Trigger { };
+    if (!compile()) {
+        m_triggers[index] = trigger;
+        return false;
+    }
+    if (trigger.actions & GPIO) {
+        gpio_reset_pin(static_cast<gpio_num_t>(trigger.gpio));
+    }
+    return store();
+}
+
+
+void TriggerEngine::list() const
+{
+    for (size_t i=0; i<MAX_TRIGGERS; i++) {
+        auto &trigger = m_triggers[i];
+        if (trigger.len==0) {
+            continue;
+        }
+        char pattern[TEXT_SIZE];
+        format_pattern(trigger, pattern, sizeof(pattern));
+        printf("%u: \"%s\"%s%s", i, pattern,
+            (trigger.actions & CAPTURE) ? " capture" : "",
+            (trigger.actions & NOTIFY) ? " notify" : "");
+        if (trigger.actions & GPIO) {
+            printf(" gpio %d", trigger.gpio);
+        }
+        printf(", %lu matches\n", m_matches[i].get());
+    }
+}
+
+
+/**
+ * Build the automaton for the current patterns and hand it to the bridge
+ * loop. The transitions start out as a trie of the patterns; a breadth
+ * first walk then fills in every missing transition with the one of the
+ * longest suffix that is also a pattern prefix (the failure link), and adds
+ * the matches of that suffix to the state's output.
+ */
+bool TriggerEngine::compile()
+{
+    uint8_t byte_class[256] { };
+    size_t classes = 1;
+    size_t states = 1;
+    for (auto &trigger : m_triggers) {
+        for (size_t i=0; i<trigger.len; i++) {
+            auto &cls = byte_class[trigger.pattern[i]];
+            if (!cls) {
+                cls = classes++;
+            }
+        }
+        states += trigger.len;
+    }
+    if (states*classes > TABLE_MAX) {
+        ESP_LOGE(TAG, "Patterns too large, %u states of %u byte classes", states, classes);
+        return false;
+    }
+
+    auto automaton = static_cast<Automaton*>(malloc(sizeof(Automaton) + states + states*classes));
+    if (!automaton) {
+        ESP_LOGE(TAG, "Unable to allocate automaton");
+        return false;
+    }
+    automaton->classes = classes;
+    memcpy(automaton->triggers, m_triggers, sizeof(m_triggers));
+    memcpy(automaton->byte_class, byte_class, sizeof(byte_class));
+    auto output = reinterpret_cast<uint8_t*>(automaton+1);
+    auto next = output+states;
+    automaton->output = output;
+    automaton->next = next;
+    memset(output, 0, states);
+    memset(next, NO_STATE, states*classes);
+
+    size_t count = 1;
+    for (size_t i=0; i<MAX_TRIGGERS; i++) {
+        auto &trigger = m_triggers[i];
+        size_t state = 0;
+        for (size_t j=0; j<trigger.len; j++) {
+            auto &to = next[state*classes + byte_class[trigger.pattern[j]]];
+            if (to==NO_STATE) {
+                to = count++;
+            }
+            state = to;
+        }
+        if (trigger.len) {
+            output[state] |= 1<<i;
+        }
+    }
+
+    uint8_t fail[MAX_STATES];
+    uint8_t queue[MAX_STATES];
+    size_t head = 0;
+    size_t tail = 0;
+    for (size_t cls=0; cls<classes; cls++) {
+        auto &to = next[cls];
+        if (to==NO_STATE) {
+            to = 0;
+        }
+        else {
+            fail[to] = 0;
+            queue[tail++] = to;
+        }
+    }
+    while (head<tail) {
+        auto state = queue[head++];
+        for (size_t cls=0; cls<classes; cls++) {
+            auto &to = next[state*classes + cls];
+            auto fallback = next[fail[state]*classes + cls];
+            if (to==NO_STATE) {
+                to = fallback;
+            }
+            else {
+                fail[to] = fallback;
+                output[to] |= output[fallback];
+                queue[tail++] = to;
+            }
+        }
+    }
+
+    // Take back an automaton the bridge loop hasn't picked up, keeping what it changed
+    uint8_t changed = 0;
+    auto previous = m_pending.exchange(nullptr, std::memory_order_acquire);
+    if (previous) {
+        changed = previous->changed;
+        free(previous);
+    }
+    for (size_t i=0; i<MAX_TRIGGERS; i++) {
+        if (memcmp(&m_triggers[i], &m_published[i], sizeof(Trigger))!=0) {
+            changed |= 1<<i;
+        }
+    }
+    memcpy(m_published, m_triggers, sizeof(m_triggers));
+    automaton->changed = changed;
+    m_pending.store(automaton, std::memory_order_release);
+    return true;
+}
+
+
+void TriggerEngine::scan(const uint8_t *data, size_t len)
+{
+    if (m_pending.load(std::memory_order_relaxed)) {
+        auto automaton = m_pending.exchange(nullptr, std::memory_order_acquire);
+        if (automaton) {
+            for (size_t i=0; i<MAX_TRIGGERS; i++) {
+                if (automaton->changed & (1<<i)) {
+                    m_matches[i].set(0);
+                    m_levels[i] = false;
+                }
+            }
+            free(m_active);
+            m_active = automaton;
+            m_state = 0;
+        }
+    }
+
+    // Without patterns there is a single byte class
+    auto automaton = m_active;
+    if (!automaton || automaton->classes==1) {
+        return;
+    }
+    auto classes = automaton->classes;
+    auto byte_class = automaton->byte_class;
+    auto output = automaton->output;
+    auto next = automaton->next;
+    size_t state = m_state;
+    for (size_t i=0; i<len; i++) {
+        state = next[state*classes + byte_class[data[i]]];
+        if (output[state]) {
+            fire(*automaton, output[state]);
+        }
+    }
+    m_state = state;
+}
+
+
+void TriggerEngine::fire(const Automaton &automaton, uint8_t matched)
+{
+    for (size_t i=0; i<MAX_TRIGGERS; i++) {
+        if (!(matched & (1<<i))) {
+            continue;
+        }
+        auto &trigger = automaton.triggers[i];
+        m_matches[i].add();
+        TRACE_I(TraceEvent::TRIGGER_MATCH, i, m_matches[i].get());
+
+        if (trigger.actions & GPIO) {
+            m_levels[i] = !m_levels[i];
+            gpio_set_level(static_cast<gpio_num_t>(trigger.gpio), m_levels[i]);
+        }
+        if (!(trigger.actions & (CAPTURE | NOTIFY))) {
+            continue;
+        }
+        // "\r\n[" and "]\r\n" around the text for clients
+        char notice[3+TEXT_SIZE+3];
+        auto len = snprintf(notice, sizeof(notice), "\r\n[trigger %u: ", i);
+        len += format_pattern(trigger, notice+len, sizeof(notice)-len-3);
+        if (trigger.actions & CAPTURE) {
+            notice[len] = '\0';
+            g_capture.mark(notice+3);
+        }
+        if ((trigger.actions & NOTIFY) && m_notify_cb) {
+            memcpy(notice+len, "]\r\n", 3);
+            m_notify_cb(notice, len+3);
+        }
+    }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+
+#include "metrics.h"
+
+
+/**
+ * Patterns watched for in the serial output, such as "Guru Meditation" or a
+ * bootloader prompt, with actions run on every match.
+ *
+ * The patterns are compiled into one Aho-Corasick automaton, stored as a
+ * DFA: bytes are mapped to classes of the bytes that occur in the patterns,
+ * and every state has a next state for every class. Scanning takes two
+ * table lookups per byte, whatever the number of patterns, and matches
+ * carry over chunk boundaries.
+ *
+ * Patterns are edited by the console task, which compiles a new automaton
+ * and hands it to the bridge loop. Only the bridge loop scans and counts.
+ */
+class TriggerEngine {
+    public:
+        static constexpr size_t MAX_TRIGGERS { 8 };
+        // States fit a byte: at most MAX_TRIGGERS*PATTERN_MAX+1
+        static constexpr size_t PATTERN_MAX { 31 };
+        // Largest transition table, MAX_TRIGGERS long patterns of distinct bytes would not fit
+        static constexpr size_t TABLE_MAX { 16384 };
+
+        enum Action : uint8_t {
+            COUNT = 0,
+            CAPTURE = 1<<0,
+            NOTIFY = 1<<1,
+            GPIO = 1<<2,
+        };
+
+        struct Trigger {
+            uint8_t len;
+            uint8_t actions;
+            int8_t gpio;
+            uint8_t pattern[PATTERN_MAX];
+        };
+
+        typedef void (*notify_cb_t)(const char *text, size_t len);
+
+        constexpr TriggerEngine() :
+            m_triggers { },
+            m_published { },
+            m_pending { nullptr },
+            m_active { nullptr },
+            m_state { 0 },
+            m_levels { },
+            m_matches { },
+            m_notify_cb { nullptr }
+        {}
+
+        /** Load the patterns from NVS */
+        bool start();
+
+        /** Add a pattern, stored in NVS. Returns the index, -1 on failure */
+        int add(const uint8_t *pattern, size_t len, uint8_t actions, int gpio);
+        bool remove(size_t index);
+        /** Print the patterns, their actions and match counts to stdout */
+        void list() const;
+
+        /** Called from the bridge loop with the notice of a NOTIFY match */
+        void set_notify_cb(notify_cb_t cb) { m_notify_cb = cb; }
+
+        /** Run the serial output through the automaton, from the bridge loop */
+        void scan(const uint8_t *data, size_t len);
+
+    private:
+        struct Automaton;
+
+        // Owned by the console task, along with a copy of the triggers last compiled
+        Trigger m_triggers[MAX_TRIGGERS];
+        Trigger m_published[MAX_TRIGGERS];
+        // Compiled by the console task, taken over by the bridge loop
+        std::atomic<Automaton*> m_pending;
+
+        // Owned by the bridge loop
+        Automaton *m_active;
+        uint8_t m_state;
+        bool m_levels[MAX_TRIGGERS];
+        Counter m_matches[MAX_TRIGGERS];
+        notify_cb_t m_notify_cb;
+
+        bool store();
+        bool compile();
+        void fire(const Automaton &automaton, uint8_t matched);
+};
@@ -0,0 +1,223 @@
+#include "web.h"
+#include "assets.h"
+
+#include <string.h>
+#include <sys/unistd.h>
+#include <esp_log.h>
+#include <esp_http_server.h>
+#include <esp_vfs_eventfd.h>
+
+
+static constexpr const char* TAG = "web";
+
+static constexpr size_t WEB_EVENT_QUEUE_LEN { 16 };
+// Largest frame taken from the browser, pastes are sent in frames of this size
+static constexpr size_t WEB_FRAME_MAX { 1024 };
+// Control frames carry at most 125 bytes
+static constexpr size_t WEB_CONTROL_MAX { 125 };
+
+
+bool WebTerminal::start()
+{
+    if (!m_events) {
+        m_events = xQueueCreate(WEB_EVENT_QUEUE_LEN, sizeof(Event));
+        m_event_fd = eventfd(0, 0);
+        if (!m_events || m_event_fd<0) {
+            ESP_LOGE(TAG, "Unable to create event queue");
+            return false;
+        }
+    }
+
+    httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+    config.server_port = m_port;
+    // An idle terminal session must not be purged to make room for a page load,
+    // page sockets are closed after each response instead
+    config.max_open_sockets = MAX_SESSIONS+PAGE_SOCKETS;
+    config.lru_purge_enable = false;
+    config.uri_match_fn = httpd_uri_match_wildcard;
+    config.global_user_ctx = this;
+    config.global_user_ctx_free_fn = [](void *) {};
+    config.close_fn = on_close;
+
+    httpd_handle_t server = nullptr;
+    auto res = httpd_start(&server, &config);
+    if (res!=ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start HTTP server: err=%d", res);
+        return false;
+    }
+    m_server = server;
+
+    httpd_uri_t websocket = { };
+    websocket.uri = "/ws";
+    websocket.method = HTTP_GET;
+    websocket.handler = on_websocket;
+    websocket.user_ctx = this;
+    websocket.is_websocket = true;
+    // Nothing may be sent on the socket by the server task, the bridge loop owns sending
+    websocket.handle_ws_control_frames = true;
+    httpd_register_uri_handler(server, &websocket);
+
+    // Everything else is a static file, matched after /ws
+    httpd_uri_t asset = { };
+    asset.uri = "/*";
+    asset.method = HTTP_GET;
+    asset.handler = on_asset;
+    asset.user_ctx = this;
+    httpd_register_uri_handler(server, &asset);
+
+    if (!m_assets.running() && !m_assets.start()) {
+        ESP_LOGW(TAG, "Only the WebSocket is available");
+    }
+
+    ESP_LOGI(TAG, "Web terminal on port %u", m_port);
+    return true;
+}
+
+
+void WebTerminal::stop()
+{
+    if (m_server) {
+        httpd_stop(m_server);
+        m_server = nullptr;
+    }
+}
+
+
+bool WebTerminal::post(const Event &event)
+{
+    // Waits while the bridge loop is behind, the browser's input stays in the socket meanwhile
+    if (xQueueSend(m_events, &event, portMAX_DELAY)!=pdTRUE) {
+        return false;
+    }
+    uint64_t value = 1;
+    ::write(m_event_fd, &value, sizeof(value));
+    return true;
+}
+
+
+bool WebTerminal::next(Event &event)
+{
+    if (xQueueReceive(m_events, &event, 0)==pdTRUE) {
+        return true;
+    }
+    // Clear the wake-up, and set it again if the server task got in between
+    uint64_t value;
+    ::read(m_event_fd, &value, sizeof(value));
+    if (uxQueueMessagesWaiting(m_events)>0) {
+        value = 1;
+        ::write(m_event_fd, &value, sizeof(value));
+    }
+    return false;
+}
+
+
+void WebTerminal::close(int fd)
+{
+    httpd_sess_trigger_close(m_server, fd);
+}
+
+
+bool WebTerminal::add_session(int fd)
+{
+    for (auto &session : m_sessions) {
+        if (session<0) {
+            session = fd;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool WebTerminal::remove_session(int fd)
+{
+    for (auto &session : m_sessions) {
+        if (session==fd) {
+            session = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+esp_err_t WebTerminal::on_asset(httpd_req_t *req)
+{
+    auto self = static_cast<WebTerminal*>(req->user_ctx);
+    httpd_resp_set_hdr(req, "Connection", "close");
+    auto res = self->m_assets.serve(req);
+    httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+    return res;
+}
+
+
+esp_err_t WebTerminal::on_websocket(httpd_req_t *req)
+{
+    auto self = static_cast<WebTerminal*>(req->user_ctx);
+    auto fd = httpd_req_to_sockfd(req);
+
+    if (req->method==HTTP_GET) {
+        // Handshake done, from now on the bridge loop sends on this socket
+        if (!self->add_session(fd)) {
+            ESP_LOGW(TAG, "Too many terminal sessions");
+            return ESP_FAIL;
+        }
+        Event event = { EventType::OPEN, 0, fd, { } };
+        self->post(event);
+        return ESP_OK;
+    }
+
+    httpd_ws_frame_t frame = { };
+    auto res = httpd_ws_recv_frame(req, &frame, 0);
+    if (res!=ESP_OK) {
+        return res;
+    }
+
+    static uint8_t buf[WEB_FRAME_MAX];
+    switch (frame.type) {
+        case HTTPD_WS_TYPE_TEXT:
+        case HTTPD_WS_TYPE_BINARY:
+        case HTTPD_WS_TYPE_CONTINUE:
+            if (frame.len>sizeof(buf)) {
+                ESP_LOGW(TAG, "Terminal frame of %u bytes too large", frame.len);
+                return ESP_FAIL;
+            }
+            break;
+        case HTTPD_WS_TYPE_CLOSE:
+            // Closing the session makes the browser see the end of the connection
+            return ESP_FAIL;
+        default:
+            // Pings aren't answered, browsers don't send them
+            if (frame.len>WEB_CONTROL_MAX) {
+                return ESP_FAIL;
+            }
+            break;
+    }
+
+    frame.payload = buf;
+    res = httpd_ws_recv_frame(req, &frame, frame.len);
+    if (res!=ESP_OK || (frame.type!=HTTPD_WS_TYPE_TEXT && frame.type!=HTTPD_WS_TYPE_BINARY && frame.type!=HTTPD_WS_TYPE_CONTINUE)) {
+        return res;
+    }
+
+    Event event = { EventType::INPUT, 0, fd, { } };
+    for (size_t pos=0; pos<frame.len; pos+=event.len) {
+        event.len = frame.len-pos < EVENT_DATA_MAX ? frame.len-pos : EVENT_DATA_MAX;
+        memcpy(event.data, buf+pos, event.len);
+        self->post(event);
+    }
+    return ESP_OK;
+}
+
+
+void WebTerminal::on_close(httpd_handle_t server, int fd)
+{
+    auto self = static_cast<WebTerminal*>(httpd_get_global_user_ctx(server));
+    if (!self->remove_session(fd)) {
+        ::close(fd);
+        return;
+    }
+    // The bridge loop may still be sending, it closes the socket
+    Event event = { EventType::CLOSE, 0, fd, { } };
+    self->post(event);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <esp_err.h>
+
+struct httpd_req;
+class WebAssets;
+
+
+/**
+ * Browser terminal: an HTTP server with a WebSocket endpoint at /ws, and
+ * the terminal page and other static files from WebAssets.
+ *
+ * The server task does the handshake and receives the browser's frames,
+ * the bridge loop sends serial output on the socket itself, as binary
+ * frames straight out of the raw ring (see TelnetConnection). The server
+ * task hands sessions and input to the bridge loop as events; the socket
+ * of a session is closed by the bridge loop once it has seen the CLOSE.
+ */
+class WebTerminal {
+    public:
+        static constexpr size_t EVENT_DATA_MAX { 64 };
+        // Sockets are scarce, terminal sessions also take telnet client slots
+        static constexpr size_t MAX_SESSIONS { 2 };
+        // Page loads, each socket is closed after one response
+        static constexpr size_t PAGE_SOCKETS { 3 };
+
+        enum class EventType : uint8_t {
+            OPEN,
+            INPUT,
+            CLOSE,
+        };
+
+        struct Event {
+            EventType type;
+            uint8_t len;
+            int fd;
+            uint8_t data[EVENT_DATA_MAX];
+        };
+
+        constexpr WebTerminal(uint16_t port, WebAssets &assets) :
+            m_port { port },
+            m_assets { assets },
+            m_server { nullptr },
+            m_events { nullptr },
+            m_event_fd { -1 },
+            m_sessions { -1, -1 }
+        {}
+
+        bool start();
+        void stop();
+
+        /** Readable while events are waiting */
+        int fd() const { return m_event_fd; }
+        /** Take the next event, never blocks */
+        bool next(Event &event);
+        /** Ask the server to end a session, a CLOSE event follows */
+        void close(int fd);
+
+    private:
+        const uint16_t m_port;
+        WebAssets &m_assets;
+        void *m_server;
+        QueueHandle_t m_events;
+        int m_event_fd;
+        // WebSocket sockets, only used by the server task
+        int m_sessions[MAX_SESSIONS];
+
+        bool post(const Event &event);
+        bool add_session(int fd);
+        bool remove_session(int fd);
+
+        static esp_err_t on_asset(struct httpd_req *req);
+        static esp_err_t on_websocket(struct httpd_req *req);
+        static void on_close(void *server, int fd);
+};
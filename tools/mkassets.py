@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""
+Pack the web assets in data/ into an image for the `assets` partition.
+
+Files are gzipped once here, so the bridge sends them from flash as they
+are with Content-Encoding: gzip. Each file gets a strong ETag, the hash of
+its compressed bytes. References from HTML pages to other assets get the
+ETag as a version query, so those assets can be cached for a year and a
+changed asset still reaches the browser at once. HTML pages themselves are
+revalidated on every load, which costs a 304 while they are unchanged.
+
+Image layout, little endian, see src/assets.h:
+  header   magic "WSA1", entry count, image size, reserved
+  entries  path[48], content type[32], etag[20], offset, size, flags
+  data     file contents, each 4 byte aligned
+"""
+
+import argparse
+import gzip
+import hashlib
+import mimetypes
+import os
+import re
+import struct
+import sys
+
+MAGIC = b'WSA1'
+HEADER = struct.Struct('<4sIII')
+ENTRY = struct.Struct('<48s32s20sIII')
+
+FLAG_GZIP = 1
+# Referenced with a version query, may be cached for long
+FLAG_VERSIONED = 2
+
+TYPES = {
+    '.html': 'text/html',
+    '.js': 'text/javascript',
+    '.css': 'text/css',
+    '.svg': 'image/svg+xml',
+    '.ico': 'image/x-icon',
+    '.png': 'image/png',
+    '.json': 'application/json',
+    '.txt': 'text/plain',
+}
+# Already compressed formats are stored as they are
+STORED = ('.png', '.jpg', '.gif', '.woff2')
+
+PARTITION_TABLE_END = 0x9000
+APP_ALIGN = 0x10000
+DATA_ALIGN = 0x1000
+
+
+def parse_size(text):
+    text = text.strip()
+    for suffix, scale in (('K', 1024), ('M', 1024 * 1024)):
+        if text.upper().endswith(suffix):
+            return int(text[:-1], 0) * scale
+    return int(text, 0)
+
+
+def partition_offset(csv, name):
+    """Offset and size of a partition, placed like gen_esp32part.py does"""
+    offset = PARTITION_TABLE_END
+    with open(csv) as f:
+        for line in f:
+            line = line.split('#')[0].strip()
+            if not line:
+                continue
+            fields = [field.strip() for field in line.split(',')]
+            align = APP_ALIGN if fields[1] == 'app' else DATA_ALIGN
+            if fields[3]:
+                offset = parse_size(fields[3])
+            offset = (offset + align - 1) & ~(align - 1)
+            size = parse_size(fields[4])
+            if fields[0] == name:
+                return offset, size
+            offset += size
+    raise KeyError('partition %s not in %s' % (name, csv))
+
+
+def etag(data):
+    return '"%s"' % hashlib.sha256(data).hexdigest()[:16]
+
+
+def load(root):
+    assets = {}
+    for dirpath, dirnames, filenames in os.walk(root):
+        dirnames.sort()
+        for filename in sorted(filenames):
+            if filename.startswith('.'):
+                continue
+            path = os.path.join(dirpath, filename)
+            url = '/' + os.path.relpath(path, root).replace(os.sep, '/')
+            with open(path, 'rb') as f:
+                assets[url] = f.read()
+    return assets
+
+
+def encode(url, data):
+    ext = os.path.splitext(url)[1].lower()
+    if ext in STORED:
+        return data, 0
+    packed = gzip.compress(data, 9, mtime=0)
+    if len(packed) >= len(data):
+        return data, 0
+    return packed, FLAG_GZIP
+
+
+def build(root):
+    assets = load(root)
+    encoded = {}
+    pages = []
+    for url, data in assets.items():
+        if url.endswith('.html'):
+            pages.append(url)
+        else:
+            encoded[url] = encode(url, data)
+
+    versioned = set()
+    for url in pages:
+        base = url.rsplit('/', 1)[0] + '/'
+
+        def version(match):
+            target = match.group(2)
+            resolved = target if target.startswith('/') else base + target
+            if resolved not in encoded:
+                return match.group(0)
+            versioned.add(resolved)
+            tag = etag(encoded[resolved][0]).strip('"')
+            return '%s="%s?v=%s"' % (match.group(1), target, tag[:8])
+
+        page = re.sub(r'(src|href)="([^"?#:]+)"', version, assets[url].decode('utf-8'))
+        encoded[url] = encode(url, page.encode('utf-8'))
+
+    entries = []
+    blobs = []
+    offset = HEADER.size + ENTRY.size * len(encoded)
+    for url in sorted(encoded):
+        data, flags = encoded[url]
+        if url in versioned:
+            flags |= FLAG_VERSIONED
+        if len(url.encode()) >= 48:
+            raise ValueError('path too long: %s' % url)
+        ext = os.path.splitext(url)[1].lower()
+        content_type = TYPES.get(ext) or mimetypes.guess_type(url)[0] or 'application/octet-stream'
+        entries.append(ENTRY.pack(url.encode(), content_type.encode(), etag(data).encode(), offset, len(data), flags))
+        padded = data + b'\0' * (-len(data) % 4)
+        blobs.append(padded)
+        offset += len(padded)
+        print('%-24s %6u -> %6u bytes%s' % (url, len(assets[url]), len(data), ' gzip' if flags & FLAG_GZIP else ''))
+
+    return HEADER.pack(MAGIC, len(entries), offset, 0) + b''.join(entries) + b''.join(blobs)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('data', help='asset directory')
+    parser.add_argument('output', help='image file')
+    parser.add_argument('--partitions', help='partition table CSV, to check the image fits')
+    parser.add_argument('--partition', default='assets', help='partition name (default assets)')
+    args = parser.parse_args()
+
+    image = build(args.data)
+    if args.partitions:
+        offset, size = partition_offset(args.partitions, args.partition)
+        if len(image) > size:
+            sys.exit('image of %u bytes does not fit partition %s of %u bytes' % (len(image), args.partition, size))
+        print('%u bytes for partition %s at 0x%x' % (len(image), args.partition, offset))
+    with open(args.output, 'wb') as f:
+        f.write(image)
+
+
+if __name__ == '__main__':
+    main()
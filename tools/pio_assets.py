@@ -0,0 +1,47 @@
+"""
+PlatformIO extra script: pack data/ with mkassets.py on every build, and
+add an `uploadassets` target that writes the image to the assets partition:
+
+    pio run -t uploadassets
+"""
+
+import os
+import sys
+
+Import("env")
+
+sys.path.insert(0, os.path.join(env.subst("$PROJECT_DIR"), "tools"))
+import mkassets  # noqa: E402
+
+PARTITION = "assets"
+
+data_dir = env.subst("$PROJECT_DATA_DIR")
+partitions = os.path.join(env.subst("$PROJECT_DIR"), env.GetProjectOption("board_build.partitions"))
+image = os.path.join(env.subst("$BUILD_DIR"), "assets.bin")
+offset, size = mkassets.partition_offset(partitions, PARTITION)
+
+
+def build_assets(target, source, env):
+    data = mkassets.build(data_dir)
+    if len(data) > size:
+        sys.stderr.write("Web assets of %u bytes do not fit partition %s\n" % (len(data), PARTITION))
+        env.Exit(1)
+    with open(image, "wb") as f:
+        f.write(data)
+
+
+assets = env.Command(image, env.Glob(os.path.join(data_dir, "*")), build_assets)
+env.AlwaysBuild(assets)
+env.Depends("buildprog", assets)
+
+env.AddCustomTarget(
+    "uploadassets",
+    assets,
+    [
+        env.VerboseAction(env.AutodetectUploadPort, "Looking for upload port..."),
+        '"$PYTHONEXE" "$UPLOADER" --chip $BOARD_MCU --port "$UPLOAD_PORT" --baud $UPLOAD_SPEED '
+        'write_flash 0x%x "%s"' % (offset, image),
+    ],
+    title="Upload web assets",
+    description="Write the packed data/ directory to the %s partition" % PARTITION,
+)